@@ -0,0 +1,79 @@
+#include <labkit/protocols/crc16.hh>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace labkit;
+
+// Bitwise CRC-16/MODBUS as used by ModbusRtu before Crc16
+static uint16_t crcBitwise(const uint8_t* t_data, size_t t_len)
+{
+    uint16_t crc = Crc16::INIT;
+    for (size_t i = 0; i < t_len; i++) {
+        crc ^= t_data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x0001) ? ((crc >> 1) ^ Crc16::POLY) : (crc >> 1);
+    }
+    return crc;
+}
+
+// Returns MB/s of t_func over all buffers
+static double throughput(const std::vector<std::vector<uint8_t>>& t_bufs,
+    unsigned t_rounds, uint16_t (*t_func)(const uint8_t*, size_t))
+{
+    size_t bytes = 0;
+    volatile uint16_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < t_rounds; r++)
+        for (const auto& buf : t_bufs) {
+            sink = sink ^ t_func(buf.data(), buf.size());
+            bytes += buf.size();
+        }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    return bytes / secs.count() / 1e6;
+}
+
+/*
+ *  Compares Crc16 against the bitwise calculation on random buffers of
+ *  MODBUS RTU frame size, incrementally and in one piece, then measures
+ *  the throughput of both. Exits with 1 on the first mismatch.
+ */
+int main()
+{
+    const unsigned BUFFERS = 2000;
+    const unsigned ROUNDS = 50;
+
+    std::mt19937 rng(2217);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_int_distribution<size_t> length(0, 256);
+
+    std::vector<std::vector<uint8_t>> bufs(BUFFERS);
+    for (auto& buf : bufs) {
+        buf.resize(length(rng));
+        for (auto& b : buf)
+            b = byte(rng);
+    }
+
+    for (const auto& buf : bufs) {
+        uint16_t expected = crcBitwise(buf.data(), buf.size());
+        size_t split = buf.size() / 3;
+        Crc16 crc;
+        crc.update(buf.data(), split);
+        crc.update(buf.data() + split, buf.size() - split);
+        if ( (Crc16::calc(buf) != expected) || (crc.value() != expected) ) {
+            printf("Mismatch for %zu bytes: %04X != %04X\n", buf.size(),
+                Crc16::calc(buf), expected);
+            return 1;
+        }
+    }
+    printf("%u buffers match\n", BUFFERS);
+
+    double bitwise = throughput(bufs, ROUNDS, crcBitwise);
+    double table = throughput(bufs, ROUNDS, Crc16::calc);
+    printf("bitwise:    %8.1f MB/s\n", bitwise);
+    printf("slice-by-8: %8.1f MB/s (%.1fx)\n", table, table / bitwise);
+
+    return 0;
+}
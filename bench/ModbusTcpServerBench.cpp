@@ -0,0 +1,90 @@
+#include <labkit/protocols/modbustcpserver.hh>
+#include <labkit/protocols/modbustcp.hh>
+#include <labkit/comms/tcpipcomm.hh>
+#include <labkit/exceptions.hh>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace labkit;
+
+/*
+ *  Measures requests/s of ModbusTcpServer over loopback: several clients
+ *  read register blocks, one request at a time and pipelined with
+ *  ModbusTcp::readRegBlocks(). Exits with 1 if a response does not match
+ *  the server's table.
+ */
+
+static const unsigned CLIENTS = 4;
+static const uint16_t REGS = 1000;
+
+// Runs the clients for t_duration; returns requests/s, 0 on errors
+static double run(unsigned t_port, size_t t_window, std::chrono::milliseconds t_duration)
+{
+    std::atomic<bool> stop {false};
+    std::atomic<bool> failed {false};
+    std::atomic<uint64_t> requests {0};
+
+    auto client = [&](unsigned t_id) {
+        try {
+            auto comm = std::make_shared<TcpipComm>("127.0.0.1", t_port);
+            ModbusTcp modbus(comm);
+            modbus.setWindowSize(t_window);
+
+            std::vector<Modbus::RegBlock> blocks;
+            for (unsigned i = 0; i < 64; i++) {
+                uint16_t addr = (t_id * 64 + i) * 4 % REGS;
+                blocks.push_back({1, Modbus::FC03, addr, 4});
+            }
+            while (!stop) {
+                auto res = modbus.readRegBlocks(blocks);
+                for (size_t i = 0; i < blocks.size(); i++)
+                    if (res[i][0] != blocks[i].addr)
+                        throw BadProtocol("Unexpected register value");
+                requests += blocks.size();
+            }
+        } catch (const std::exception& ex) {
+            printf("Client %u: %s\n", t_id, ex.what());
+            failed = true;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < CLIENTS; i++)
+        threads.emplace_back(client, i);
+    std::this_thread::sleep_for(t_duration);
+    stop = true;
+    for (auto& thread : threads)
+        thread.join();
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    return failed ? 0.0 : requests / secs.count();
+}
+
+int main()
+{
+    ModbusTcpServer server;
+    server.resize(ModbusTcpServer::HOLDING_REGS, REGS);
+    std::vector<uint16_t> regs(REGS);
+    for (uint16_t i = 0; i < REGS; i++)
+        regs[i] = i;
+    server.setRegs(ModbusTcpServer::HOLDING_REGS, 0, regs);
+    server.listen(0, "127.0.0.1");
+    server.start();
+
+    for (size_t window : {1, 16}) {
+        double rate = run(server.getPort(), window, std::chrono::milliseconds(1000));
+        if (rate == 0.0)
+            return 1;
+        printf("%u clients, window %2zu: %9.0f requests/s\n", CLIENTS, window, rate);
+    }
+
+    auto stats = server.getStats();
+    printf("%lu requests, %lu exceptions\n", (unsigned long)stats.requests,
+        (unsigned long)stats.exceptions);
+    return (stats.exceptions == 0) ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+#include <labkit/comms/usbcomm.hh>
+#include <labkit/exceptions.hh>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace labkit;
+using Clock = std::chrono::steady_clock;
+
+/*
+ *  Compares bulk IN throughput of synchronous readBulk() calls against
+ *  startBulkStream() with several transfers in flight. Needs a device that
+ *  sends data continuously on its first bulk IN endpoint (e.g. a logic
+ *  analyzer or a USB loopback gadget), so it is not run as a test:
+ *
+ *      usb_stream_bench <vid> <pid> [interface] [transfers] [size]
+ */
+
+static const std::chrono::seconds DURATION(2);
+
+// Returns MB/s of back-to-back synchronous reads
+static double readSync(UsbComm& t_comm, size_t t_size)
+{
+    std::vector<uint8_t> buf(t_size);
+    size_t bytes = 0;
+    auto start = Clock::now();
+    while (Clock::now() - start < DURATION)
+        bytes += t_comm.readBulk(buf.data(), buf.size());
+    std::chrono::duration<double> secs = Clock::now() - start;
+    return bytes / secs.count() / 1e6;
+}
+
+// Returns MB/s of a stream with t_num transfers in flight
+static double readStream(UsbComm& t_comm, unsigned t_num, size_t t_size)
+{
+    size_t bytes = 0;
+    auto start = Clock::now();
+    t_comm.startBulkStream([&](const uint8_t*, size_t t_len) {
+        bytes += t_len;
+        return Clock::now() - start < DURATION;
+    }, t_num, t_size);
+    while (t_comm.streaming())
+        UsbComm::handleEvents(100);
+    t_comm.stopBulkStream();
+    std::chrono::duration<double> secs = Clock::now() - start;
+    return bytes / secs.count() / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        printf("Usage: %s <vid> <pid> [interface] [transfers] [size]\n", argv[0]);
+        return 2;
+    }
+    uint16_t vid = strtoul(argv[1], nullptr, 16);
+    uint16_t pid = strtoul(argv[2], nullptr, 16);
+    int iface = (argc > 3) ? atoi(argv[3]) : 0;
+    unsigned num = (argc > 4) ? strtoul(argv[4], nullptr, 0) : 8;
+    size_t size = (argc > 5) ? strtoul(argv[5], nullptr, 0) : 64 * 1024;
+
+    try {
+        UsbComm comm(vid, pid);
+        comm.configInterface(iface);
+
+        double sync = readSync(comm, size);
+        printf("readBulk():        %8.1f MB/s\n", sync);
+        double stream = readStream(comm, num, size);
+        printf("startBulkStream(): %8.1f MB/s (%u x %zu bytes)\n", stream, num, size);
+    } catch (const Exception& ex) {
+        printf("%s\n", ex.what());
+        return 1;
+    }
+    return 0;
+}
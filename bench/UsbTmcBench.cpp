@@ -0,0 +1,115 @@
+#include <labkit/comms/usbtmccomm.hh>
+#include <labkit/comms/fakeusbtmcbackend.hh>
+#include <labkit/exceptions.hh>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace labkit;
+using Clock = std::chrono::steady_clock;
+
+/*
+ *  Runs UsbTmcComm against FakeUsbTmcBackend. First every read path is
+ *  checked with responses of 1 - 1500 bytes, into buffers the response
+ *  fills exactly (no zero length packet on packet boundaries) and into
+ *  larger ones; then the throughput of queries is measured. Exits with 1
+ *  on the first wrong or failed read.
+ */
+
+// Returns n bytes of a pattern depending on n
+static std::string pattern(size_t t_len)
+{
+    std::string ret(t_len, '\0');
+    for (size_t i = 0; i < t_len; i++)
+        ret[i] = 'a' + (i + t_len) % 26;
+    return ret;
+}
+
+// Responder answering "GET <n>" with n bytes
+static std::string respond(const std::string& t_msg)
+{
+    return pattern(std::stoul(t_msg.substr(4)));
+}
+
+static void request(UsbTmcComm& t_comm, size_t t_len)
+{
+    std::string msg = "GET " + std::to_string(t_len);
+    t_comm.writeDevDepMsg((const uint8_t*)msg.data(), msg.size());
+    return;
+}
+
+// Returns false if a read does not return the response
+static bool check(UsbTmcComm& t_comm, size_t t_len, size_t t_max_len)
+{
+    std::string expected = pattern(t_len);
+
+    request(t_comm, t_len);
+    std::vector<uint8_t> data(t_max_len);
+    int nbytes = t_comm.readDevDepMsg(data.data(), data.size(), 100, 0x00);
+    if (std::string(data.begin(), data.begin() + nbytes) != expected)
+        return false;
+
+    request(t_comm, t_len);
+    UsbBuffer buf = t_comm.readDevDepMsg(t_max_len, 100, 0x00);
+    if (std::string((const char*)buf.data(), buf.size()) != expected)
+        return false;
+
+    request(t_comm, t_len);
+    std::string chunks;
+    t_comm.readDevDepMsg([&](const uint8_t* t_data, size_t t_size, bool) {
+        chunks.append((const char*)t_data, t_size);
+    }, 100, t_max_len, 0x00);
+    return chunks == expected;
+}
+
+// Returns MB/s of queries with responses of t_len bytes
+static double throughput(UsbTmcComm& t_comm, size_t t_len, unsigned t_count)
+{
+    std::vector<uint8_t> data(t_len);
+    auto start = Clock::now();
+    for (unsigned i = 0; i < t_count; i++) {
+        request(t_comm, t_len);
+        size_t received = 0;
+        while (received < t_len)
+            received += t_comm.readDevDepMsg(data.data() + received,
+                t_len - received, 1000, 0x00);
+    }
+    std::chrono::duration<double> secs = Clock::now() - start;
+    return t_len * t_count / secs.count() / 1e6;
+}
+
+int main()
+{
+    for (uint16_t pkt : {64, 512}) {
+        FakeUsbTmcBackend* fake = new FakeUsbTmcBackend(respond);
+        fake->setPacketSize(pkt);
+        UsbTmcComm comm;
+        comm.setBackend(std::unique_ptr<UsbBackend>(fake));
+        comm.open(0x1234, 0x5678);
+        comm.configTmcInterface();
+
+        try {
+            for (size_t len = 1; len <= 1500; len++)
+                for (size_t extra : {0, 1, 4, 64}) {
+                    if (!check(comm, len, len + extra)) {
+                        printf("Packet size %u: wrong response of %zu bytes "
+                            "(buffer %zu)\n", pkt, len, len + extra);
+                        return 1;
+                    }
+                }
+            printf("Packet size %u: read paths ok\n", pkt);
+
+            for (size_t len : {64, 4096, 1 << 20}) {
+                unsigned count = (1 << 24) / len;
+                printf("Packet size %3u, %7zu byte responses: %8.1f MB/s\n",
+                    pkt, len, throughput(comm, len, count > 10000 ? 10000 : count));
+            }
+        } catch (const Exception& ex) {
+            printf("Packet size %u: %s\n", pkt, ex.what());
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+#ifndef LK_FAKE_USBTMC_BACKEND_HH
+#define LK_FAKE_USBTMC_BACKEND_HH
+
+#include <labkit/comms/usbbackend.hh>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace labkit
+{
+
+/**
+ * @brief In-memory USBTMC/USB488 device
+ *
+ *  Emulates a USBTMC device on the bulk endpoints, so UsbTmcComm and the
+ *  instrument classes can be run and benchmarked without hardware:
+ *
+ *      UsbTmcComm comm;
+ *      comm.setBackend(std::unique_ptr<UsbBackend>(new FakeUsbTmcBackend()));
+ *      comm.open(0x1234, 0x5678);
+ *      comm.configTmcInterface();
+ *
+ *  Device dependent messages are passed to a responder once complete (EOM);
+ *  its response is returned on the next REQUEST_DEV_DEP_MSG_IN. The bTag and
+ *  ~bTag fields are checked like a real device does (stall on mismatch),
+ *  responses are split into transfers of at most the requested size and
+ *  the configured maximum transfer size, and every transfer can be delayed
+ *  to emulate device latency. Like on hardware, a transfer shorter than
+ *  requested ends with a short or zero length packet; a read asking for
+ *  more than the rest of a transfer without one times out, and a read not
+ *  fitting the next packet overflows.
+ *
+ *  Asynchronous transfers are not supported.
+ */
+class FakeUsbTmcBackend : public UsbBackend {
+public:
+    /// Returns the response to a received message; empty = no response
+    using Responder = std::function<std::string(const std::string& t_msg)>;
+
+    /// Constructor; the default responder answers "*IDN?" and echoes queries
+    FakeUsbTmcBackend(Responder t_responder = nullptr);
+
+    /// No copy constructor; descriptors point into the object
+    FakeUsbTmcBackend(const FakeUsbTmcBackend&) = delete;
+    /// No assignment operator; descriptors point into the object
+    FakeUsbTmcBackend& operator=(const FakeUsbTmcBackend&) = delete;
+
+    int open(uint16_t t_vid, uint16_t t_pid, const std::string& t_serno) override;
+    void close() override;
+
+    int claimInterface(int t_iface) override;
+    int releaseInterface(int t_iface) override;
+    int setAltSetting(int t_iface, int t_alt) override;
+
+    int getConfigDescriptor(libusb_config_descriptor** t_cfg) override;
+    void freeConfigDescriptor(libusb_config_descriptor* t_cfg) override {};
+
+    int controlTransfer(uint8_t t_request_type, uint8_t t_request,
+        uint16_t t_value, uint16_t t_index, uint8_t* t_data, uint16_t t_len,
+        unsigned t_timeout_ms) override;
+    int bulkTransfer(uint8_t t_ep_addr, uint8_t* t_data, int t_len,
+        int* t_transferred, unsigned t_timeout_ms) override;
+    int interruptTransfer(uint8_t t_ep_addr, uint8_t* t_data, int t_len,
+        int* t_transferred, unsigned t_timeout_ms) override;
+    int clearHalt(uint8_t t_ep_addr) override;
+
+    std::shared_ptr<UsbBufferPool> bufferPool() override { return m_pool; }
+
+    /// Set responder for received messages
+    void setResponder(Responder t_responder) { m_responder = t_responder; }
+    /// Set delay of every bulk transfer
+    void setLatency(std::chrono::microseconds t_latency) { m_latency = t_latency; }
+    /// Set maximum bytes returned per bulk transfer (IN), 0 = unlimited
+    void setMaxTransferSize(size_t t_size) { m_max_xfer_size = t_size; }
+    /// Set wMaxPacketSize of the bulk endpoints
+    void setPacketSize(uint16_t t_size);
+    /// Set status byte reported by READ_STATUS_BYTE
+    void setStatusByte(uint8_t t_stb) { m_stb = t_stb; }
+    /// Queue service request notification on the interrupt endpoint (IN)
+    void notifyServiceRequest(uint8_t t_stb);
+
+    /// Returns number of messages received
+    unsigned messages() const { return m_msg_count; }
+    /// Returns number of triggers received
+    unsigned triggers() const { return m_trigger_count; }
+    /// Returns number of bytes received on the bulk endpoint (OUT)
+    size_t bytesOut() const { return m_bytes_out; }
+    /// Returns number of bytes sent on the bulk endpoint (IN)
+    size_t bytesIn() const { return m_bytes_in; }
+
+    /// Endpoint addresses of the emulated interface
+    static constexpr uint8_t EP_BULK_OUT = 0x01;
+    static constexpr uint8_t EP_BULK_IN = 0x82;
+    static constexpr uint8_t EP_INT_IN = 0x83;
+
+private:
+    Responder m_responder {};
+    std::shared_ptr<UsbBufferPool> m_pool {};
+    bool m_open {false};
+    int m_cur_iface {-1};
+
+    // Descriptors of a single USB488 interface
+    libusb_endpoint_descriptor m_ep_desc[3];
+    libusb_interface_descriptor m_iface_desc;
+    libusb_interface m_iface;
+    libusb_config_descriptor m_cfg;
+
+    // Emulation settings
+    std::chrono::microseconds m_latency {0};
+    size_t m_max_xfer_size {0};
+    uint8_t m_stb {0x00};
+
+    // Bulk OUT: message being received, bytes (incl. padding) outstanding
+    std::string m_msg_out {};
+    size_t m_out_left {0}, m_out_pad {0};
+    uint8_t m_out_msg_id {0x00}, m_out_tag {0x00};
+    bool m_out_eom {false};
+
+    // Bulk IN: pending request and transfer being sent
+    bool m_req_pending {false};
+    uint8_t m_req_tag {0x00}, m_req_msg_id {0x00}, m_req_attr {0x00};
+    uint8_t m_req_term_char {0x00};
+    size_t m_req_size {0};
+    std::string m_response {};
+    std::vector<uint8_t> m_in_data {};
+    size_t m_in_pos {0};
+    bool m_in_zlp {false};  ///< Zero length packet pending
+
+    // Interrupt IN notifications
+    std::deque<std::vector<uint8_t>> m_notifications {};
+
+    // Statistics
+    unsigned m_msg_count {0}, m_trigger_count {0};
+    size_t m_bytes_out {0}, m_bytes_in {0};
+
+    /// Handle bulk transfer (OUT)
+    int bulkOut(const uint8_t* t_data, int t_len, int* t_transferred);
+    /// Handle bulk transfer (IN)
+    int bulkIn(uint8_t* t_data, int t_len, int* t_transferred);
+    /// Message (OUT) completely received
+    void completeOut();
+    /// Build DEV_DEP_MSG_IN transfer for the pending request
+    bool prepareIn();
+    /// Reset transfer state (clear, abort)
+    void reset();
+    /// Default responder
+    static std::string defaultResponse(const std::string& t_msg);
+};
+
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef LK_RFC2217_COMM_HH
+#define LK_RFC2217_COMM_HH
+
+#include <labkit/comms/serialcomm.hh>
+#include <labkit/comms/tcpipcomm.hh>
+
+namespace labkit
+{
+
+/** \brief Communication interface for RFC 2217 serial port servers.
+ *
+ *  RFC 2217 (Telnet Com Port Control Option) allows to configure a remote
+ *  serial port in-band on the data connection. Baud rate, frame format, flow
+ *  control and the modem control lines (DTR/RTS) can therefore be changed
+ *  without closing the connection. It is supported by most ethernet to
+ *  serial converters (e.g. Moxa NPort, Lantronix) and by ser2net.
+ *
+ *  Data bytes equal to IAC (0xFF) are escaped on write, telnet commands are
+ *  removed from the received data stream on read.
+ *
+ *  Rfc2217Server provides a local loopback port to test against.
+ */
+class Rfc2217Comm : public SerialComm {
+public:
+    /// Default constructor
+    Rfc2217Comm() : SerialComm() {};
+
+    /** \brief Connect to RFC 2217 server with specified baud rate and frame
+     *  format.
+     *
+     *  \param t_ip_addr IPv4 address of the server (e.g. "192.168.2.100")
+     *  \param t_port Port of the TCP/IP socket.
+     *  \param t_baud Baud rate in bits per second.
+     *  \param t_csize Number of data bits (8/7/6/5) per the frame.
+     *  \param t_par Parity for the frame (none/even/odd).
+     *  \param t_sbits Number of stop bits (1/2) per frame.
+     */
+    Rfc2217Comm(std::string t_ip_addr, unsigned t_port = PORT,
+        BaudRate t_baud = BAUD_9600, CharSize t_csize = CHAR_8,
+        Parity t_par = PAR_NONE, StopBits t_sbits = STOP_1);
+
+    /// Destructor
+    ~Rfc2217Comm();
+
+    /// Default port for RFC 2217 servers
+    static constexpr unsigned PORT = 2217;
+
+    /// Open RFC 2217 connection with stored settings
+    void open() override;
+    /// Open RFC 2217 connection with provided settings
+    void open(std::string t_ip_addr, unsigned t_port = PORT,
+        BaudRate t_baud = BAUD_9600, CharSize t_csize = CHAR_8,
+        Parity t_par = PAR_NONE, StopBits t_sbits = STOP_1);
+    /// Close RFC 2217 connection
+    void close() override;
+
+    int writeRaw(const uint8_t* t_data, size_t t_len) override;
+
+    int readRaw(uint8_t* t_data, size_t t_max_len,
+        unsigned t_timeout_ms = DFLT_TIMEOUT_MS) override;
+
+    // Returns human readable info string
+    std::string getInfo() const noexcept override;
+
+    /// Set ip address
+    void setIp(std::string t_ip_addr);
+    /// Returns ip address
+    std::string getIp() const { return m_ip_addr; }
+
+    /// Set port number
+    void setPort(unsigned t_port);
+    /// Returns port number
+    unsigned getPort() const { return m_port; }
+
+    // Set baud rate for serial interface
+    void setBaud(BaudRate t_baud) override;
+
+    // Set number of data bits per packet
+    void setCharSize(CharSize t_csize) override;
+
+    // Send 1 or 2 stop bits
+    void setStopBits(StopBits t_sbits) override;
+
+    // Enable and set parity
+    void setParity(Parity t_par) override;
+
+    /// Send changed settings to the server (in-band, no reconnect)
+    void applySettings() override;
+
+    // Flow control
+    void enableRtsCts() override;
+    void disableRtsCts() override;
+    void enableDtrDsr() override;
+    void disableDtrDsr() override;
+    void enableXOnXOff(char t_xon = 0x11, char t_xoff = 0x13) override;
+    void disableXOnXOff() override;
+
+    // Data Terminal Ready (DTR) for manual flow control
+    void setDtr() override;
+    void clearDtr() override;
+
+    // Request To Send (RTS) for manual flow control
+    void setRts() override;
+    void clearRts() override;
+
+    /// Returns last line state reported by the server (NOTIFY-LINESTATE)
+    uint8_t getLineState() const { return m_line_state; }
+    /// Returns last modem state reported by the server (NOTIFY-MODEMSTATE)
+    uint8_t getModemState() const { return m_modem_state; }
+
+private:
+    TcpipComm m_tcpip;
+    std::string m_ip_addr {"127.0.0.1"};
+    unsigned m_port {PORT};
+    uint8_t m_flc {FLOW_NONE};
+
+    // Last states reported by the server
+    uint8_t m_line_state {0x00}, m_modem_state {0x00};
+
+    // Telnet definitions (RFC 854 & RFC 2217)
+    enum Telnet : uint8_t {
+        SE   = 240,     ///< End of subnegotiation
+        SB   = 250,     ///< Begin of subnegotiation
+        WILL = 251,
+        WONT = 252,
+        DO   = 253,
+        DONT = 254,
+        IAC  = 255      ///< Interpret As Command
+    };
+
+    enum TelnetOption : uint8_t {
+        BINARY        = 0,
+        SGA           = 3,      ///< Suppress Go Ahead
+        COM_PORT_OPT  = 44
+    };
+
+    enum ComPortCmd : uint8_t {
+        SET_BAUDRATE        = 1,
+        SET_DATASIZE        = 2,
+        SET_PARITY          = 3,
+        SET_STOPSIZE        = 4,
+        SET_CONTROL         = 5,
+        NOTIFY_LINESTATE    = 6,
+        NOTIFY_MODEMSTATE   = 7,
+        SET_LINESTATE_MASK  = 10,
+        SET_MODEMSTATE_MASK = 11,
+        PURGE_DATA          = 12,
+        SERVER_OFFSET       = 100   ///< Server responses = command + 100
+    };
+
+    enum ControlValue : uint8_t {
+        FLOW_NONE     = 1,
+        FLOW_XONXOFF  = 2,
+        FLOW_HARDWARE = 3,
+        DTR_ON        = 8,
+        DTR_OFF       = 9,
+        RTS_ON        = 11,
+        RTS_OFF       = 12,
+        FLOW_DSR      = 19
+    };
+
+    // State of the telnet command parser; persists between reads
+    enum RxState {RX_DATA, RX_IAC, RX_OPT, RX_SB, RX_SB_IAC};
+    RxState m_rx_state {RX_DATA};
+    uint8_t m_rx_cmd {0x00};
+    std::vector<uint8_t> m_rx_sb {};
+
+    // Reused transmit buffer for IAC escaping
+    std::vector<uint8_t> m_tx_buf {};
+
+    /// Send telnet option negotiation (IAC WILL/WONT/DO/DONT option)
+    void sendNegotiation(uint8_t t_cmd, uint8_t t_opt);
+    /// Send COM-PORT-OPTION subnegotiation (IAC SB 44 cmd value... IAC SE)
+    void sendComPortCmd(uint8_t t_cmd, const uint8_t* t_val, size_t t_len);
+    /// Remove telnet commands from received data in place, returns data length
+    size_t filterTelnet(uint8_t* t_data, size_t t_len);
+    /// Handle a received option negotiation
+    void handleNegotiation(uint8_t t_cmd, uint8_t t_opt);
+    /// Handle a received subnegotiation
+    void handleSubnegotiation();
+};
+
+}
+
+#endif
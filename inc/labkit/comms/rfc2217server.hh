@@ -0,0 +1,129 @@
+#ifndef LK_RFC2217_SERVER_HH
+#define LK_RFC2217_SERVER_HH
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace labkit
+{
+
+/** \brief Local RFC 2217 server with a loopback serial port
+ *
+ *  Stand-in for an ethernet to serial converter, so Rfc2217Comm can be run
+ *  and benchmarked without hardware:
+ *
+ *      Rfc2217Server server;
+ *      server.listen();
+ *      server.start();
+ *      Rfc2217Comm comm("127.0.0.1", server.getPort(), SerialComm::BAUD_115200);
+ *
+ *  Telnet options BINARY, SGA and COM-PORT-OPTION are accepted, all others
+ *  refused. COM-PORT-OPTION commands are applied to the emulated port and
+ *  acknowledged with the resulting value, queries (value 0) are answered
+ *  with the current value. Data bytes are echoed back as if TX and RX of
+ *  the port were connected.
+ *
+ *  One client is served at a time; a new connection replaces the current
+ *  one.
+ */
+class Rfc2217Server
+{
+public:
+    /// Settings of the emulated port (RFC 2217 encoding)
+    struct Settings
+    {
+        uint32_t baud;      ///< Baud rate
+        uint8_t datasize;   ///< Data bits (5 - 8)
+        uint8_t parity;     ///< 1 = none, 2 = odd, 3 = even, 4 = mark, 5 = space
+        uint8_t stopsize;   ///< 1 = 1, 2 = 2, 3 = 1.5 stop bits
+        uint8_t flow;       ///< 1 = none, 2 = XON/XOFF, 3 = RTS/CTS, 19 = DSR
+        bool dtr;           ///< DTR line
+        bool rts;           ///< RTS line
+    };
+
+    Rfc2217Server() {};
+    /// Destructor; stops the server
+    ~Rfc2217Server();
+
+    /// No copy constructor; the server owns sockets
+    Rfc2217Server(const Rfc2217Server&) = delete;
+    /// No assignment operator; the server owns sockets
+    Rfc2217Server& operator=(const Rfc2217Server&) = delete;
+
+    /** \brief Create listening socket
+     *
+     *  \param t_port Port to listen on; 0 = any free port (see getPort())
+     *  \param t_ip_addr IPv4 address of the interface
+     */
+    void listen(unsigned t_port = 0, const std::string& t_ip_addr = "127.0.0.1");
+    /// Returns port the server listens on
+    unsigned getPort() const { return m_port; }
+
+    /// Start server thread
+    void start();
+    /// Stop server thread and close the connection
+    void stop();
+    /// Returns true if the server thread is running
+    bool running() const { return m_thread.joinable(); }
+
+    /// Returns settings of the emulated port
+    Settings getSettings() const;
+    /// Returns number of COM-PORT-OPTION commands received
+    unsigned commands() const { return m_commands; }
+    /// Returns number of data bytes received
+    size_t bytesReceived() const { return m_bytes_rx; }
+
+    /// Send NOTIFY-LINESTATE to the client
+    void notifyLineState(uint8_t t_state);
+    /// Send NOTIFY-MODEMSTATE to the client
+    void notifyModemState(uint8_t t_state);
+
+private:
+    int m_listen_fd {-1};
+    int m_event_fd {-1};                ///< Wakes the server thread
+    int m_conn_fd {-1};
+    unsigned m_port {0};
+
+    std::thread m_thread {};
+    std::atomic<bool> m_stop {false};
+    /// Protects settings and writes to the connection
+    mutable std::mutex m_mutex {};
+
+    Settings m_settings {9600, 8, 1, 1, 1, false, false};
+    std::atomic<unsigned> m_commands {0};
+    std::atomic<size_t> m_bytes_rx {0};
+
+    // State of the telnet command parser of the current connection
+    enum RxState {RX_DATA, RX_IAC, RX_OPT, RX_SB, RX_SB_IAC};
+    RxState m_rx_state {RX_DATA};
+    uint8_t m_rx_cmd {0x00};
+    std::vector<uint8_t> m_rx_sb {};
+    std::vector<uint8_t> m_tx_buf {};   ///< Data echoed and replies
+
+    /// Server thread
+    void run();
+    /// Accept connection; replaces the current one
+    void acceptConnection();
+    /// Close current connection
+    void closeConnection();
+    /// Parse received bytes; queues echoed data and replies in m_tx_buf
+    void handleData(const uint8_t* t_data, size_t t_len);
+    /// Handle option negotiation
+    void handleNegotiation(uint8_t t_cmd, uint8_t t_opt);
+    /// Apply and acknowledge COM-PORT-OPTION command
+    void handleComPortCmd();
+    /// Queue COM-PORT-OPTION subnegotiation (IAC escaped)
+    void queueComPortCmd(uint8_t t_cmd, const uint8_t* t_val, size_t t_len);
+    /// Send queued bytes; call locked
+    void flush();
+    /// Throw exception with errno information if t_stat < 0
+    void checkAndThrow(int t_stat, const std::string& t_msg) const;
+};
+
+}
+
+#endif
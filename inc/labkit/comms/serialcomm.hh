@@ -162,6 +162,7 @@ protected:
     bool m_update_settings {true};
 
     static int cSizeToInt(CharSize t_csize);
+    static unsigned baudToInt(BaudRate t_baud);
     static std::string parToStr(Parity t_par);
     static char parToChar(Parity t_par);
 
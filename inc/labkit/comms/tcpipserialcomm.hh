@@ -4,6 +4,9 @@
 #include <labkit/comms/serialcomm.hh>
 #include <labkit/comms/tcpipcomm.hh>
 
+#include <map>
+#include <mutex>
+
 namespace labkit
 {
 
@@ -67,9 +70,23 @@ public:
     // Enable and set parity
     void setParity(Parity t_par) override;
 
-    // Apply termios settings
+    /** \brief Send settings to the converter.
+     *
+     *  Always reconfigures the converter, which restarts its TCP/IP server.
+     *  Settings changed by the setters are otherwise collected and applied
+     *  at once on the next read or write; that is skipped if the converter
+     *  is already configured with identical settings (only settings applied
+     *  from within this process are known, see invalidateConfig()).
+     */
     void applySettings() override;
 
+    /** \brief Forget the configuration applied to the converter
+     *
+     *  Call if the converter was rebooted or reconfigured elsewhere; the
+     *  settings are then sent again on the next open, read or write.
+     */
+    void invalidateConfig();
+
     // Enable and set parity
     void enableRtsCts() override;
     void disableRtsCts() override;
@@ -91,10 +108,29 @@ private:
     std::string m_ip_addr {"127.0.0.1"};
     unsigned m_port {0};
     unsigned m_flc {0};
-    bool m_update_settings {false};
 
     static constexpr unsigned HTTP_PORT = 80;
 
+    /// Serial settings of a converter
+    struct Config {
+        BaudRate baud;
+        CharSize csize;
+        Parity par;
+        StopBits sbits;
+        unsigned flc;
+        bool operator==(const Config& t_other) const;
+    };
+
+    /// Last configuration applied to each converter (key = ip address)
+    static std::map<std::string, Config> s_applied_cfg;
+    static std::mutex s_cfg_mutex;
+
+    /// Apply changed settings unless the converter is configured already
+    void updateSettings();
+
+    /// Send configuration via http; keeps the config connection alive
+    void postConfig(const std::string& t_body);
+
     /// Convert baud rate to bdr parameter for http setup
     static std::string getBdr(BaudRate t_baud);
     /// Convert char size to dtb parameter for http setup
@@ -0,0 +1,111 @@
+#ifndef LK_USB_BACKEND_HH
+#define LK_USB_BACKEND_HH
+
+#include <labkit/comms/usbbuffer.hh>
+#include <libusb.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace labkit
+{
+
+/**
+ * @brief Device access used by UsbComm
+ *
+ *  The backend performs the device I/O of a UsbComm: opening the device,
+ *  claiming interfaces, reading descriptors, and synchronous transfers.
+ *  All methods return libusb status codes (LIBUSB_SUCCESS or a negative
+ *  libusb_error), so error handling is the same for every backend.
+ *
+ *  LibusbBackend is used by default. Other backends (e.g. FakeUsbTmcBackend)
+ *  allow to run the USB protocol layers without hardware. Asynchronous
+ *  transfers are only available if the backend provides a libusb handle.
+ */
+class UsbBackend {
+public:
+    /// Destructor
+    virtual ~UsbBackend() {};
+
+    /// Open device with given VID, PID, and serial (first device if empty)
+    virtual int open(uint16_t t_vid, uint16_t t_pid, const std::string& t_serno) = 0;
+    /// Close device
+    virtual void close() = 0;
+
+    /// Claim interface, detaching kernel drivers if required
+    virtual int claimInterface(int t_iface) = 0;
+    /// Release interface
+    virtual int releaseInterface(int t_iface) = 0;
+    /// Apply alternate setting of an interface
+    virtual int setAltSetting(int t_iface, int t_alt) = 0;
+
+    /// Get active configuration descriptor; release with freeConfigDescriptor
+    virtual int getConfigDescriptor(libusb_config_descriptor** t_cfg) = 0;
+    /// Release configuration descriptor
+    virtual void freeConfigDescriptor(libusb_config_descriptor* t_cfg) = 0;
+
+    /// Control transfer, returns number of bytes transferred or error
+    virtual int controlTransfer(uint8_t t_request_type, uint8_t t_request,
+        uint16_t t_value, uint16_t t_index, uint8_t* t_data, uint16_t t_len,
+        unsigned t_timeout_ms) = 0;
+    /// Bulk transfer; direction is given by the endpoint address
+    virtual int bulkTransfer(uint8_t t_ep_addr, uint8_t* t_data, int t_len,
+        int* t_transferred, unsigned t_timeout_ms) = 0;
+    /// Interrupt transfer; direction is given by the endpoint address
+    virtual int interruptTransfer(uint8_t t_ep_addr, uint8_t* t_data, int t_len,
+        int* t_transferred, unsigned t_timeout_ms) = 0;
+    /// Clear halt/stall condition of an endpoint
+    virtual int clearHalt(uint8_t t_ep_addr) = 0;
+
+    /// Returns transfer buffer pool of the open device
+    virtual std::shared_ptr<UsbBufferPool> bufferPool() = 0;
+
+    /// Returns libusb handle for asynchronous transfers, NULL if unsupported
+    virtual libusb_device_handle* handle() { return NULL; }
+};
+
+/**
+ * @brief Backend accessing devices via libusb
+ *
+ *  Devices are looked up in the UsbRegistry. The device handle is owned by
+ *  the buffer pool, so it stays valid while lent buffers exist.
+ */
+class LibusbBackend : public UsbBackend {
+public:
+    /// Default constructor
+    LibusbBackend() {};
+    /// Destructor; closes device
+    ~LibusbBackend() { this->close(); };
+
+    int open(uint16_t t_vid, uint16_t t_pid, const std::string& t_serno) override;
+    void close() override;
+
+    int claimInterface(int t_iface) override;
+    int releaseInterface(int t_iface) override;
+    int setAltSetting(int t_iface, int t_alt) override;
+
+    int getConfigDescriptor(libusb_config_descriptor** t_cfg) override;
+    void freeConfigDescriptor(libusb_config_descriptor* t_cfg) override;
+
+    int controlTransfer(uint8_t t_request_type, uint8_t t_request,
+        uint16_t t_value, uint16_t t_index, uint8_t* t_data, uint16_t t_len,
+        unsigned t_timeout_ms) override;
+    int bulkTransfer(uint8_t t_ep_addr, uint8_t* t_data, int t_len,
+        int* t_transferred, unsigned t_timeout_ms) override;
+    int interruptTransfer(uint8_t t_ep_addr, uint8_t* t_data, int t_len,
+        int* t_transferred, unsigned t_timeout_ms) override;
+    int clearHalt(uint8_t t_ep_addr) override;
+
+    std::shared_ptr<UsbBufferPool> bufferPool() override { return m_pool; }
+
+    libusb_device_handle* handle() override { return m_handle; }
+
+private:
+    libusb_device_handle* m_handle {NULL};
+    std::shared_ptr<UsbBufferPool> m_pool {};
+};
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef LK_USB_BUFFER_HH
+#define LK_USB_BUFFER_HH
+
+#include <libusb.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace labkit
+{
+
+class UsbBufferPool;
+
+/**
+ * @brief Transfer buffer lent from a USB buffer pool
+ *
+ *  The buffer is move-only and returns its memory to the pool when it is
+ *  destroyed. Transfers may read into the whole capacity; the valid data is
+ *  given by data() and size() and can be restricted to a part of the buffer
+ *  (e.g. without a protocol header) using trim(...).
+ */
+class UsbBuffer {
+public:
+    /// Empty buffer
+    UsbBuffer() = default;
+    /// Destructor; returns memory to the pool
+    ~UsbBuffer();
+
+    /// Move constructor
+    UsbBuffer(UsbBuffer&& t_other) noexcept;
+    /// Move assignment
+    UsbBuffer& operator=(UsbBuffer&& t_other) noexcept;
+    /// No copy constructor; memory is owned by one buffer only
+    UsbBuffer(const UsbBuffer&) = delete;
+    /// No assignment operator; memory is owned by one buffer only
+    UsbBuffer& operator=(const UsbBuffer&) = delete;
+
+    /// Returns pointer to valid data
+    uint8_t* data() { return m_mem + m_offset; }
+    /// Returns pointer to valid data
+    const uint8_t* data() const { return m_mem + m_offset; }
+    /// Returns number of valid bytes
+    size_t size() const { return m_size; }
+    /// Returns true if no valid data is present
+    bool empty() const { return m_size == 0; }
+
+    /// Returns pointer to start of the memory
+    uint8_t* raw() { return m_mem; }
+    /// Returns size of the memory in bytes
+    size_t capacity() const { return m_capacity; }
+    /// Returns true if the memory is DMA-capable device memory
+    bool dma() const { return m_dma; }
+
+    /// Set valid data to the first t_len bytes of the memory
+    void resize(size_t t_len) { this->trim(0, t_len); }
+    /// Set valid data to t_len bytes starting at t_offset
+    void trim(size_t t_offset, size_t t_len);
+
+private:
+    friend class UsbBufferPool;
+
+    std::shared_ptr<UsbBufferPool> m_pool {};
+    uint8_t* m_mem {NULL};
+    size_t m_capacity {0}, m_offset {0}, m_size {0};
+    bool m_dma {false};
+
+    /// Return memory to the pool
+    void release() noexcept;
+};
+
+/**
+ * @brief Pool of transfer buffers of a USB device handle
+ *
+ *  If supported by the kernel (Linux usbfs mmap), memory is allocated with
+ *  libusb_dev_mem_alloc(...). The host controller transfers data directly
+ *  from and to this memory, so no copies between kernel and user space are
+ *  required. Otherwise page aligned heap memory is used.
+ *
+ *  Returned memory is kept for reuse, so repeated transfers of similar size
+ *  do not allocate. The pool owns the device handle: it is closed when the
+ *  pool and all buffers lent from it have been destroyed, since device
+ *  memory cannot be freed after the handle was closed.
+ */
+class UsbBufferPool : public std::enable_shared_from_this<UsbBufferPool> {
+public:
+    /// Create pool for an open device handle; takes ownership of the handle
+    static std::shared_ptr<UsbBufferPool> create(libusb_device_handle* t_handle);
+
+    /// Destructor; frees all memory and closes the device handle
+    ~UsbBufferPool();
+
+    /// No copy constructor
+    UsbBufferPool(const UsbBufferPool&) = delete;
+    /// No assignment operator
+    UsbBufferPool& operator=(const UsbBufferPool&) = delete;
+
+    /// Lend buffer with a capacity of at least t_size bytes
+    UsbBuffer acquire(size_t t_size);
+
+    /// Free all idle memory
+    void shrink();
+
+    /// Returns true if DMA-capable device memory is available
+    bool dma() const { return m_dma; }
+
+    /// Maximum number of idle memory blocks kept for reuse
+    static constexpr size_t MAX_IDLE = 16;
+    /// Memory is allocated in multiples of this size
+    static constexpr size_t PAGE_SIZE = 4096;
+
+private:
+    explicit UsbBufferPool(libusb_device_handle* t_handle) : m_handle(t_handle) {};
+
+    friend class UsbBuffer;
+
+    /// Idle memory block
+    struct Block {
+        uint8_t* mem;
+        size_t size;
+        bool dma;
+    };
+
+    libusb_device_handle* m_handle {NULL};
+    std::mutex m_mutex {};
+    std::vector<Block> m_idle {};
+    std::atomic<bool> m_dma {true};    // Cleared after first failed device allocation
+
+    /// Take memory back from a buffer
+    void put(uint8_t* t_mem, size_t t_size, bool t_dma) noexcept;
+    /// Free memory block
+    void free(const Block& t_block) noexcept;
+};
+
+}
+
+#endif
@@ -2,8 +2,16 @@
 #define LK_USB_COMM_HH
 
 #include <labkit/comms/basiccomm.hh>
+#include <labkit/comms/usbbackend.hh>
+#include <labkit/comms/usbbuffer.hh>
 #include <libusb.h>
 
+#include <functional>
+#include <exception>
+#include <memory>
+#include <set>
+#include <poll.h>
+
 namespace labkit 
 {
 
@@ -13,11 +21,32 @@ namespace labkit
  *  The usb_comm is based on libusb-1.0 enabling driverless USB communication.
  *
  *  For setting up the USB communication to the device the devices vendor ID,
- *  product ID, interface number, endpoint addresses and types, and the max
- *  package size have to be provided using claim_interface(...), 
- *  config_endpoint_in(...), and config_endpoint_out(...). This information
- *  can be gathered using tools like 'lsusb' (usbutils).
+ *  product ID, and interface number have to be provided. Endpoint addresses,
+ *  types, and max packet sizes are read from the active configuration
+ *  descriptor when the interface is claimed using configInterface(...) or
+ *  configInterfaceByClass(...). They can be overridden using 
+ *  configEndpointIn(...) and configEndpointOut(...); this information can be
+ *  gathered using tools like 'lsusb' (usbutils).
  * 
+ *  Besides blocking transfers, asynchronous transfers are supported. Their
+ *  callbacks are invoked while handleEvents() is executed. To drive USB 
+ *  devices from an existing event loop (e.g. together with TcpipComm and 
+ *  SerialComm file descriptors), add the file descriptors from getPollFds() 
+ *  to the loop, wait at most getNextTimeout() milliseconds, and call
+ *  handleEvents(0) whenever one of them is ready or the timeout expired.
+ *
+ *  libusb events are shared by all devices: whichever thread handles them
+ *  runs the callbacks of every device. Applications using asynchronous
+ *  transfers on several devices should therefore handle events on a single
+ *  thread and use the devices from that thread only.
+ *
+ *  Transfer buffers for large reads can be lent from a buffer pool of the
+ *  device (see acquireBuffer(...)). The pool uses DMA-capable device memory
+ *  if supported by the kernel, so data is not copied in user space.
+ *
+ *  Device I/O is performed by a UsbBackend, libusb by default. Asynchronous
+ *  transfers and streams require the libusb backend.
+ *
  *  For more information on the USB protocol please refer to the wonderful
  *  article 'USB in a NutShell':
  *
@@ -69,6 +98,11 @@ public:
     /// Returns USB communication type
     CommType type() const noexcept override { return USB; }
 
+    /// Replace device backend (e.g. FakeUsbTmcBackend); device must be closed
+    void setBackend(std::unique_ptr<UsbBackend> t_backend);
+    /// Returns device backend
+    UsbBackend& getBackend() { return *m_backend; }
+
     /**
      * @brief USB control transfer (i.e. setup package)
      *
@@ -86,26 +120,159 @@ public:
     int controlTransfer(uint8_t t_request_type, uint8_t t_request, uint16_t t_value, 
         uint16_t t_index, const uint8_t* t_data, int t_len, int t_timeout_ms = DFLT_TIMEOUT_MS);
 
-    /// Send data to bulk endpoint
-    int writeBulk(const uint8_t* t_data, int t_len);
+    /**
+     * @brief Send data to bulk endpoint (OUT)
+     *
+     *  Data is submitted in large transfers; the host controller splits them
+     *  into wMaxPacketSize packets. If enabled, a zero-length packet
+     *  terminates transfers whose length is a multiple of wMaxPacketSize.
+     * 
+     * @param t_data Bytes to be written
+     * @param t_len Number of bytes to be written
+     * @param t_timeout_ms Timeout for the whole write, 0 = no timeout
+     * @return Total number of bytes written
+     */
+    int writeBulk(const uint8_t* t_data, int t_len, 
+        int t_timeout_ms = DFLT_TIMEOUT_MS);
     /// Read data from bulk endpoint
     int readBulk(uint8_t* t_data, int t_max_len, 
         int t_timeout_ms = DFLT_TIMEOUT_MS);
 
-    /// Send data to interrupt endpoint
-    int writeInterrupt(const uint8_t* t_data, int t_len);
-    /// Read data from interrupt endpoint
+    /**
+     * @brief Read data from bulk endpoint (IN) into a lent buffer
+     *
+     *  Reads up to the capacity of the buffer; the size of the buffer is set
+     *  to the number of received bytes.
+     * 
+     * @param t_buf Buffer acquired using acquireBuffer(...)
+     * @param t_timeout_ms Timeout in milliseconds
+     * @return Number of bytes read
+     */
+    int readBulk(UsbBuffer& t_buf, int t_timeout_ms = DFLT_TIMEOUT_MS);
+
+    /**
+     * @brief Lend transfer buffer from the buffer pool of the device
+     *
+     *  The buffer returns to the pool when destroyed. It may outlive the
+     *  connection; the device handle is released with the last buffer.
+     * 
+     * @param t_size Minimum capacity in bytes
+     * @return Buffer with size t_size
+     */
+    UsbBuffer acquireBuffer(size_t t_size);
+
+    /// Callback for streamed data; return false to stop the stream
+    using StreamCallback = std::function<bool(const uint8_t* t_data, size_t t_len)>;
+
+    /**
+     * @brief Start asynchronous streaming from the bulk endpoint (IN)
+     *
+     *  Keeps t_num_transfers transfers of t_transfer_size bytes in flight so
+     *  the host controller always has a buffer to fill. Each completed
+     *  transfer is passed to the callback and resubmitted automatically.
+     *  The callback is invoked from handleEvents() (or any other function
+     *  processing libusb events) in the calling thread. The stream stops
+     *  when the callback returns false or throws, or a transfer fails; its
+     *  transfers are then released, so it can be started again.
+     * 
+     * @param t_callback Called with the data of every completed transfer
+     * @param t_num_transfers Number of transfers in flight
+     * @param t_transfer_size Size of each transfer in bytes; should be a 
+     *  multiple of wMaxPacketSize
+     * @param t_timeout_ms Timeout per transfer, 0 = no timeout
+     */
+    void startBulkStream(StreamCallback t_callback, unsigned t_num_transfers = 8,
+        size_t t_transfer_size = 64*1024, unsigned t_timeout_ms = 0);
+    /** \brief Stop streaming and wait for all transfers to be retired
+     *
+     *  Rethrows the exception of the callback or the transfer error that
+     *  stopped the stream, if any.
+     */
+    void stopBulkStream();
+    /// Returns true while stream transfers are in flight
+    bool streaming() const { return m_bulk_stream.active > 0; }
+
+    /// Callback for completed asynchronous transfers
+    using TransferCallback = std::function<void(libusb_transfer_status t_status, 
+        const uint8_t* t_data, size_t t_len)>;
+
+    /// Submit asynchronous read from bulk endpoint (IN)
+    void submitBulkRead(size_t t_max_len, TransferCallback t_callback,
+        unsigned t_timeout_ms = DFLT_TIMEOUT_MS);
+    /// Submit asynchronous write to bulk endpoint (OUT); data is copied
+    void submitBulkWrite(const uint8_t* t_data, size_t t_len, 
+        TransferCallback t_callback, unsigned t_timeout_ms = DFLT_TIMEOUT_MS);
+    /// Submit asynchronous write of a lent buffer to bulk endpoint (OUT)
+    void submitBulkWrite(UsbBuffer&& t_buf, TransferCallback t_callback,
+        unsigned t_timeout_ms = DFLT_TIMEOUT_MS);
+    /// Rethrow the first exception thrown by a callback of a single transfer
+    void checkTransfers();
+
+    /**
+     * @brief Process pending asynchronous transfers and hotplug events of all
+     *  USB devices
+     *
+     *  Callbacks of all devices are invoked in the calling thread. Exceptions
+     *  thrown by them are kept by the device they belong to and reported by
+     *  stopBulkStream(), stopInterruptListener() and checkTransfers().
+     * 
+     * @param t_timeout_ms Maximum time to wait for events, 0 = non-blocking
+     */
+    static void handleEvents(unsigned t_timeout_ms = DFLT_TIMEOUT_MS);
+
+    /// Returns file descriptors that have to be polled for USB events
+    static std::vector<pollfd> getPollFds();
+
+    /// Returns time in ms until handleEvents() has to be called to handle
+    /// transfer timeouts, -1 = no timeout pending
+    static int getNextTimeout();
+
+    /// Set callbacks notified when USB file descriptors are added or removed
+    static void setPollFdNotifiers(std::function<void(int t_fd, short t_events)> t_added,
+        std::function<void(int t_fd)> t_removed);
+
+    /// Send data to interrupt endpoint (OUT)
+    int writeInterrupt(const uint8_t* t_data, int t_len, 
+        int t_timeout_ms = DFLT_TIMEOUT_MS);
+    /// Read data from interrupt endpoint (IN)
     int readInterrupt(uint8_t* t_data, int t_max_len, 
         int t_timeout_ms = DFLT_TIMEOUT_MS);
 
     /**
-     * @brief Claim usb interface
+     * @brief Start listening on the interrupt endpoint (IN)
+     *
+     *  Keeps an interrupt transfer armed at all times; every received 
+     *  packet is passed to the callback (from handleEvents()) and the 
+     *  transfer is resubmitted until the callback returns false.
+     * 
+     * @param t_callback Called with the data of every received packet
+     */
+    void startInterruptListener(StreamCallback t_callback);
+    /// Stop listening on the interrupt endpoint
+    void stopInterruptListener();
+    /// Returns true while the interrupt listener is armed
+    bool listening() const { return m_int_stream.active > 0; }
+
+    /**
+     * @brief Claim usb interface and configure its endpoints
+     *
+     *  The first bulk endpoints (IN and OUT) and the first interrupt endpoint
+     *  (IN) of the interface are configured with the wMaxPacketSize given in
+     *  the active configuration descriptor.
      * 
      * @param t_iface Interface number
      * @param t_alt Alternative settings number (typ. not used)
      */
     void configInterface(int t_iface = 0, int t_alt = 0);
 
+    /**
+     * @brief Claim first interface of given class and subclass
+     * 
+     * @param t_class Interface class (e.g. 0xFE application specific)
+     * @param t_subclass Interface subclass (e.g. 0x03 USBTMC)
+     */
+    void configInterfaceByClass(uint8_t t_class, uint8_t t_subclass);
+
     /// Enum for endpoint comminucation type; control, bulk or interrupt transfer
     enum EndpointType {CONTROL, BULK, INTERRUPT};
 
@@ -127,8 +294,16 @@ public:
     void configEndpointOut(uint8_t t_p_addr, EndpointType t_type = BULK, 
         size_t t_max_size = 64);
 
-    // Clear endpoint buffers
-    void clear();
+    /// Clear halt condition of the endpoints (IN and OUT)
+    virtual void clear();
+
+    /// En-/disable zero-length packet termination of bulk writes (OUT)
+    void setZeroLengthPacket(bool t_ena) { m_zlp_out = t_ena; }
+    /// Returns true if bulk writes are terminated by zero-length packets
+    bool getZeroLengthPacket() const { return m_zlp_out; }
+
+    /// Maximum size of a single bulk transfer (OUT)
+    static constexpr size_t MAX_TRANSFER_SIZE = DFLT_BUF_SIZE;
 
     /// Set vendor ID
     void setVid(uint16_t t_vid) { m_vid = t_vid; }
@@ -144,9 +319,8 @@ public:
     std::string getSerial() const { return m_serno; }
 
 protected:
-    static libusb_context* s_default_ctx;
-    static int s_dev_count;
-    libusb_device* m_usb_dev {NULL};
+    // Device I/O; handle is NULL if asynchronous transfers are unsupported
+    std::unique_ptr<UsbBackend> m_backend {new LibusbBackend()};
     libusb_device_handle* m_usb_handle {NULL};
 
     // Current device I/O information
@@ -154,12 +328,67 @@ protected:
     EndpointType m_ep_in_type {BULK}, m_ep_out_type {BULK};
     uint8_t m_ep_in_addr {0x80}, m_ep_out_addr {0x00};
     size_t m_max_pkt_size_in {64}, m_max_pkt_size_out {64};
+    // Interrupt endpoint (IN), e.g. for notifications; 0x00 = none
+    uint8_t m_ep_int_in_addr {0x00};
+    size_t m_max_pkt_size_int_in {0};
+    bool m_zlp_out {true};
 
     // Device info
     uint16_t m_vid {0x0000}, m_pid {0x0000};
     std::string m_serno {""};
 
+    /// Transfers of an asynchronous stream that are resubmitted on completion
+    struct Stream {
+        std::vector<libusb_transfer*> xfers {};
+        std::vector<UsbBuffer> bufs {};
+        StreamCallback cb {};
+        bool stop {false};
+        int active {0};
+        int status {LIBUSB_TRANSFER_COMPLETED};
+        std::exception_ptr ex {};
+    };
+
+    // Asynchronous bulk stream (IN) and interrupt listener (IN)
+    Stream m_bulk_stream {}, m_int_stream {};
+
+    // Pending single asynchronous transfers
+    struct PendingTransfer;
+    std::set<libusb_transfer*> m_async_xfers {};
+    // Exception thrown by a single transfer callback; see checkTransfers()
+    std::exception_ptr m_transfer_ex {};
+
     void check_and_throw(int status, const std::string& msg) const;
+
+    /// Throw if the backend does not support asynchronous transfers
+    void checkAsync() const;
+
+private:
+    /// Allocate and submit stream transfers
+    void startStream(Stream& t_stream, uint8_t t_ep_addr, uint8_t t_type,
+        StreamCallback t_callback, unsigned t_num_transfers, 
+        size_t t_transfer_size, unsigned t_timeout_ms);
+    /// Stop stream and throw errors that occured while streaming
+    void stopStream(Stream& t_stream);
+    /// libusb completion handler for stream transfers
+    static void LIBUSB_CALL streamCallback(libusb_transfer* t_transfer);
+    /// Cancel stream transfers, wait for completion and free them (no throw)
+    static void cancelStream(Stream& t_stream) noexcept;
+    /// Free transfers and buffers of a retired stream
+    static void releaseStream(Stream& t_stream) noexcept;
+
+    /// Submit single asynchronous transfer
+    void submitTransfer(uint8_t t_ep_addr, UsbBuffer&& t_buf,
+        TransferCallback t_callback, unsigned t_timeout_ms);
+    /// libusb completion handler for single transfers
+    static void LIBUSB_CALL transferCallback(libusb_transfer* t_transfer);
+    /// Cancel single transfers and wait for completion (no throw)
+    void cancelTransfers() noexcept;
+
+    // Poll fd notifiers
+    static std::function<void(int, short)> s_pollfd_added;
+    static std::function<void(int)> s_pollfd_removed;
+    /// Configure endpoints from the interface descriptor
+    void configEndpoints(const libusb_interface_descriptor* t_desc);
 };
 
 }
@@ -0,0 +1,107 @@
+#ifndef LK_USB_REGISTRY_HH
+#define LK_USB_REGISTRY_HH
+
+#include <libusb.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace labkit
+{
+
+/**
+ * @brief Process-wide registry of connected USB devices
+ *
+ *  The registry owns the libusb context shared by all USB communication
+ *  interfaces. Devices are enumerated once; device descriptors and serial
+ *  numbers are cached, so opening a device does not require enumerating the
+ *  bus and reading string descriptors of every device again.
+ *
+ *  If supported by the platform, the registry is kept up to date by libusb
+ *  hotplug callbacks. They are delivered by the thread handling libusb
+ *  events (see UsbComm::handleEvents()); the registry does not handle
+ *  events itself. If a device cannot be found, the bus is enumerated again;
+ *  a device which cannot be opened as it was disconnected is looked up
+ *  again after enumerating (see LibusbBackend::open()).
+ */
+class UsbRegistry {
+public:
+    /// Returns the process-wide registry
+    static UsbRegistry& instance();
+
+    /// Destructor; releases all devices and the libusb context
+    ~UsbRegistry();
+
+    /// No copy constructor; there is only one registry
+    UsbRegistry(const UsbRegistry&) = delete;
+    /// No assignment operator; there is only one registry
+    UsbRegistry& operator=(const UsbRegistry&) = delete;
+
+    /// Returns the libusb context shared by all USB devices
+    libusb_context* context() const { return m_ctx; }
+
+    /**
+     * @brief Find device with given VID, PID, and serial number
+     *
+     * @param t_vid Vendor ID
+     * @param t_pid Product ID
+     * @param t_serno Serial number; first matching device if empty
+     * @return Referenced device (release with libusb_unref_device) or NULL
+     */
+    libusb_device* find(uint16_t t_vid, uint16_t t_pid,
+        const std::string& t_serno = "");
+
+    /**
+     * @brief Enumerate all devices again
+     *
+     * Devices still connected keep their cached serial numbers; devices no
+     * longer connected are removed, new ones are added.
+     */
+    void refresh();
+
+private:
+    UsbRegistry();
+
+    /// Cached device information
+    struct Entry {
+        libusb_device* dev;
+        libusb_device_descriptor desc;
+        std::string serno;
+        bool serno_read;    ///< Serial number read successfully
+    };
+
+    libusb_context* m_ctx {NULL};
+    std::mutex m_mutex {};
+    bool m_hotplug {false};
+    libusb_hotplug_callback_handle m_hotplug_handle {};
+
+    /// Cached devices, key = (VID << 16) | PID
+    std::unordered_map<uint32_t, std::vector<Entry>> m_devices {};
+
+    /// Find listed device like find(); m_mutex must not be locked
+    libusb_device* findListed(uint16_t t_vid, uint16_t t_pid,
+        const std::string& t_serno);
+    /// Store serial number read for a listed device (locks m_mutex)
+    void storeSerial(const Entry& t_entry);
+    /// Add device to registry (m_mutex has to be locked)
+    void addDevice(libusb_device* t_dev);
+    /// Remove device from registry (m_mutex has to be locked)
+    void removeDevice(libusb_device* t_dev);
+    /// Remove all devices from registry (m_mutex has to be locked)
+    void clearDevices();
+
+    /// libusb hotplug handler
+    static int LIBUSB_CALL hotplugCallback(libusb_context* t_ctx,
+        libusb_device* t_dev, libusb_hotplug_event t_event, void* t_user_data);
+
+    /// Read serial number string descriptor; returns false on errors
+    static bool readSerial(libusb_device* t_dev,
+        const libusb_device_descriptor& t_desc, std::string& t_serno);
+};
+
+}
+
+#endif
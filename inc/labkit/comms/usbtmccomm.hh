@@ -3,6 +3,8 @@
 
 #include <labkit/comms/usbcomm.hh>
 
+#include <map>
+
 namespace labkit
 {
 
@@ -15,11 +17,18 @@ namespace labkit
  *
  *  USBTMC is often used by instruments utilizing the Standard Commands for
  *  Programmable Instruments (SCPI).
+ *
+ *  Bulk writes are not terminated by zero-length packets; the length of a
+ *  transfer is given by the TransferSize field of the USBTMC header.
+ *
+ *  The capabilities of the device are read when the interface is configured.
+ *  USB488 devices support reading the status byte, remote/local control, and
+ *  triggers without going through the bulk message queue.
  */
 class UsbTmcComm : public UsbComm {
 public:
     /// Default constructor
-    UsbTmcComm() : UsbComm() {};
+    UsbTmcComm() : UsbComm() { m_zlp_out = false; };
 
     /**
      * @brief Open USBTMC communication to device with given VID, PID, and serial
@@ -29,7 +38,7 @@ public:
      * @param t_serno Serial number
      */
     UsbTmcComm(uint16_t t_vid, uint16_t t_pid, std::string t_serno = "")
-      : UsbComm(t_vid, t_pid, t_serno) {};
+      : UsbComm(t_vid, t_pid, t_serno) { m_zlp_out = false; };
 
     /// Destructor
     ~UsbTmcComm() {};
@@ -57,6 +66,74 @@ public:
 
     CommType type() const noexcept override { return USBTMC; }
 
+    /// Close USBTMC communication
+    void close() override;
+
+    /// Claim the first USBTMC interface, configure its endpoints, and read
+    /// the device capabilities
+    void configTmcInterface();
+
+    /// USBTMC and USB488 capabilities (GET_CAPABILITIES)
+    struct Capabilities {
+        bool valid {false};             ///< Capabilities have been read
+        uint16_t bcd_usbtmc {0x0000};   ///< USBTMC version (BCD)
+        bool indicator_pulse {false};   ///< INDICATOR_PULSE supported
+        bool talk_only {false};
+        bool listen_only {false};
+        bool term_char {false};         ///< TermChar supported for reads
+        uint16_t bcd_usb488 {0x0000};   ///< USB488 version, 0 = no USB488
+        bool usb4882 {false};           ///< USB488.2 interface
+        bool ren_control {false};       ///< REN_CONTROL, GO_TO_LOCAL, LOCAL_LOCKOUT
+        bool trigger {false};           ///< TRIGGER supported
+        bool scpi {false};              ///< Understands SCPI commands
+        bool sr1 {false};               ///< Service requests (SR1)
+        bool rl1 {false};               ///< Remote/local control (RL1)
+        bool dt1 {false};               ///< Device trigger (DT1)
+    };
+
+    /// Read capabilities from the device
+    void readCapabilities();
+    /// Returns capabilities read by readCapabilities()
+    const Capabilities& getCapabilities() const { return m_caps; }
+
+    /**
+     * @brief Read status byte using a control request (USB488)
+     *
+     *  The status byte is polled without a bulk query, so it can be read
+     *  while the device is busy processing commands. If the interface has an
+     *  interrupt endpoint (IN), the device sends the status byte there.
+     * 
+     * @return Status byte
+     */
+    uint8_t readStatusByte(unsigned t_timeout_ms = DFLT_TIMEOUT_MS);
+
+    /// Assert (true) or deassert (false) remote enable (USB488 REN_CONTROL)
+    void setRemoteEnable(bool t_enable);
+    /// Switch device to local control (USB488 GO_TO_LOCAL)
+    void goToLocal();
+    /// Trigger device (USB488 TRIGGER; bulk message without payload)
+    void trigger();
+
+    /**
+     * @brief Abort the last bulk transfer (OUT)
+     *
+     *  Sends INITIATE_ABORT_BULK_OUT, waits for completion, and clears the
+     *  halt condition of the endpoint. Called automatically if a write fails.
+     */
+    void abortBulkOut();
+
+    /**
+     * @brief Abort the last bulk transfer (IN)
+     *
+     *  Sends INITIATE_ABORT_BULK_IN and discards the data remaining in the
+     *  device's FIFO. Called automatically if a read fails or returns data
+     *  of an earlier transfer.
+     */
+    void abortBulkIn();
+
+    /// Clear input and output buffers of the device (INITIATE_CLEAR)
+    void clear() override;
+
     /// USBTMC device dependant data write
     int writeDevDepMsg(const uint8_t* t_msg, size_t t_len,
         uint8_t t_transfer_attr = EOM);
@@ -65,11 +142,73 @@ public:
         int t_timeout_ms = DFLT_TIMEOUT_MS, uint8_t t_transfer_attr = TERM_CHAR, 
         uint8_t t_term_char = '\n');
 
+    /**
+     * @brief USBTMC device dependant data read into a lent buffer
+     *
+     *  The message is received directly into a buffer of the device's buffer
+     *  pool; the USBTMC header is trimmed from the valid data, so the payload
+     *  is not copied. Preferable for large reads like waveform data.
+     * 
+     * @param t_max_len Maximum message length in bytes
+     * @return Buffer holding the message
+     */
+    UsbBuffer readDevDepMsg(size_t t_max_len, int t_timeout_ms = DFLT_TIMEOUT_MS,
+        uint8_t t_transfer_attr = TERM_CHAR, uint8_t t_term_char = '\n');
+
+    /// Callback for streamed reads; receives payload chunks, t_eom on the last
+    using ChunkCallback = std::function<void(const uint8_t* t_data, size_t t_len,
+        bool t_eom)>;
+
+    /**
+     * @brief USBTMC device dependant data read in chunks
+     *
+     *  The message is requested in DEV_DEP_MSG_IN transfers of at most
+     *  t_chunk_size bytes until a transfer with EOM set is received. Every
+     *  completed bulk transfer is passed to the callback, so large responses
+     *  (e.g. waveform data) can be processed or stored while being read;
+     *  only a single pooled buffer is used. If the callback throws, the
+     *  transfer is aborted before the exception is passed on.
+     *
+     * @param t_callback Called for every received chunk
+     * @param t_chunk_size Maximum transfer size requested from the device
+     * @return Total number of bytes received
+     */
+    size_t readDevDepMsg(const ChunkCallback& t_callback, 
+        int t_timeout_ms = DFLT_TIMEOUT_MS, size_t t_chunk_size = DFLT_CHUNK_SIZE,
+        uint8_t t_transfer_attr = TERM_CHAR, uint8_t t_term_char = '\n');
+
+    /// Default transfer size of streamed reads
+    static constexpr size_t DFLT_CHUNK_SIZE = 1024 * 1024;
+
     /// USBTMC vendor specific data write
     int writeVendorSpecific(std::string msg);
     /// USBTMC vendor specific data read
     std::string readVendorSpecific(int timeout_ms = DFLT_TIMEOUT_MS);
 
+    /// Callback for service requests (SRQ); receives the status byte
+    using SrqCallback = std::function<void(uint8_t t_stb)>;
+
+    /**
+     * @brief Subscribe to service requests
+     *
+     *  USB488 devices report service requests on the interrupt endpoint (IN).
+     *  The endpoint is listened to asynchronously once the first subscriber
+     *  is added; callbacks are invoked from UsbComm::handleEvents().
+     *
+     *  To get notified when an operation is complete, enable the OPC bit in
+     *  the event status enable register and the ESB bit in the service 
+     *  request enable register ("*ESE 1" and "*SRE 32"), then send "*OPC".
+     * 
+     * @param t_callback Called with the status byte of every service request
+     * @return Subscription ID
+     */
+    int subscribeServiceRequest(SrqCallback t_callback);
+    /// Remove service request subscriber
+    void unsubscribeServiceRequest(int t_id);
+
+    /// Wait for the next service request, returns the status byte
+    uint8_t waitForServiceRequest(unsigned t_timeout_ms = DFLT_TIMEOUT_MS);
+
 private:
 
     // USBTMC protocol definitions
@@ -83,7 +222,22 @@ private:
         INITIATE_CLEAR              = 0x05,
         CHECK_CLEAR_STATUS          = 0x06,
         GET_CAPABILITIES            = 0x07,
-        INDICATOR_PULSE             = 0x40
+        INDICATOR_PULSE             = 0x40,
+        // USB488
+        READ_STATUS_BYTE            = 0x80,
+        REN_CONTROL                 = 0xA0,
+        GO_TO_LOCAL                 = 0xA1,
+        LOCAL_LOCKOUT               = 0xA2
+    };
+
+    enum Status : uint8_t {
+        STATUS_SUCCESS              = 0x01,
+        STATUS_PENDING              = 0x02,
+        STATUS_INTERRUPT_IN_BUSY    = 0x20,
+        STATUS_FAILED               = 0x80,
+        STATUS_TRANSFER_NOT_IN_PROGRESS = 0x81,
+        STATUS_SPLIT_NOT_IN_PROGRESS    = 0x82,
+        STATUS_SPLIT_IN_PROGRESS        = 0x83
     };
 
     enum MsgID : uint16_t {
@@ -92,7 +246,8 @@ private:
         DEV_DEP_MSG_IN              = 0x02,
         VENDOR_SPECIFIC_OUT         = 0x7E,
         REQUEST_VENDOR_SPECIFIC_IN  = 0x7F,
-        VENDOR_SPECIFIC_IN          = 0x7F
+        VENDOR_SPECIFIC_IN          = 0x7F,
+        TRIGGER                     = 0x80    // USB488
     };
 
     enum bmTransferAttributes : uint16_t {
@@ -100,7 +255,78 @@ private:
         TERM_CHAR = 0x02
     };
 
-    uint8_t m_cur_tag {0x01}, m_term_char {0x00};
+    // USB488 interrupt notification (bNotify1) for service requests
+    static constexpr uint8_t NOTIFY_SRQ = 0x81;
+
+    Capabilities m_caps {};
+
+    // READ_STATUS_BYTE bTag (2..127) and status byte received on the 
+    // interrupt endpoint
+    uint8_t m_stb_tag {0x01}, m_stb_reply {0x00};
+    bool m_stb_received {false};
+
+    // Time limits for aborts and clear, and for discarding data
+    static constexpr unsigned RECOVERY_TIMEOUT_MS = 500;
+    static constexpr unsigned DRAIN_TIMEOUT_MS = 50;
+
+    // Bulk transfers which abort the transfer on failure
+    void sendBulk(const uint8_t* t_data, size_t t_len);
+    int receiveBulk(uint8_t* t_data, size_t t_max_len, int t_timeout_ms);
+
+    // Read and discard bulk IN data until a short packet is received
+    void drainBulkIn();
+
+    // Returns length of a bulk IN transfer with t_len payload bytes (header,
+    // payload, and alignment bytes), rounded up to whole packets; reads of
+    // exactly this length end with the transfer
+    size_t transferLen(size_t t_len) const;
+
+    // Receive the zero length packet ending a transfer of t_transfer_size
+    // payload bytes, if it is pending: t_requested bytes were requested and
+    // the last read ended exactly at the end of the transfer (t_full)
+    void receiveZeroLengthPacket(size_t t_transfer_size, size_t t_requested,
+        bool t_full, int t_timeout_ms);
+
+    // Abort transfer (or clear device if aborting fails); never throws
+    void recover(bool t_in) noexcept;
+
+    // Class specific control request (IN), returns USBTMC_status
+    uint8_t controlRequest(uint8_t t_request, uint16_t t_value, uint16_t t_index,
+        uint8_t* t_resp, uint16_t t_len, 
+        uint8_t t_recipient = LIBUSB_RECIPIENT_INTERFACE);
+
+    // Last used bTag (0 = none yet)
+    uint8_t m_cur_tag {0x00}, m_term_char {0x00};
+
+    // Per-connection staging buffer for headers and partial packets
+    static constexpr size_t STAGING_PACKETS = 2;
+    UsbBuffer m_staging {};
+
+    // Returns staging buffer of at least STAGING_PACKETS packets
+    uint8_t* staging();
+
+    // Advance bTag for a new transfer, returns the new bTag
+    uint8_t nextTag();
+
+    // Send message (OUT) with header; payload is not copied except for the
+    // first and the last packet, returns payload length
+    int writeMsgOut(uint8_t t_message_id, const uint8_t* t_msg, size_t t_len,
+        uint8_t t_transfer_attr);
+
+    // Service request subscribers and last received service request
+    std::map<int, SrqCallback> m_srq_subscribers {};
+    int m_srq_next_id {0};
+    unsigned m_srq_count {0};
+    uint8_t m_srq_stb {0x00};
+
+    // Handle interrupt notification, returns true to keep listening
+    bool handleNotification(const uint8_t* t_data, size_t t_len);
+
+    // Request and receive message into lent buffer, returns buffer trimmed
+    // to the message
+    UsbBuffer readMsgIn(uint8_t t_request_id, uint8_t t_message_id,
+        size_t t_max_len, int t_timeout_ms, uint8_t t_transfer_attr, 
+        uint8_t t_term_char);
 
     // Creates a USBTMC header
     void createUsbTmcHeader(uint8_t* t_header, uint8_t t_message_id,
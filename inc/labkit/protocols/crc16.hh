@@ -0,0 +1,62 @@
+#ifndef LK_CRC16_HH
+#define LK_CRC16_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace labkit
+{
+
+/** \brief CRC-16/MODBUS checksum (polynomial 0xA001 reflected, init 0xFFFF)
+ *
+ *  Table driven (slice-by-8) implementation; the lookup tables are generated
+ *  at compile time. The checksum can be calculated incrementally over
+ *  non-contiguous data:
+ *
+ *      Crc16 crc;
+ *      crc.update(header, header_len);
+ *      crc.update(payload, payload_len);
+ *      uint16_t sum = crc.value();
+ *
+ *  The checksum is transmitted low byte first. Calculated over a frame
+ *  including its checksum, the result is 0 for an intact frame.
+ */
+class Crc16
+{
+public:
+    /// Start value of the checksum
+    static constexpr uint16_t INIT = 0xFFFF;
+    /// Reflected polynomial x^16 + x^15 + x^2 + 1
+    static constexpr uint16_t POLY = 0xA001;
+
+    /// Constructor, optionally continuing from a previous checksum
+    constexpr Crc16(uint16_t t_crc = INIT) : m_crc(t_crc) {};
+
+    /// Add data to the checksum
+    Crc16& update(const uint8_t* t_data, size_t t_len);
+    /// Add data to the checksum
+    Crc16& update(const std::vector<uint8_t>& t_data)
+        { return this->update(t_data.data(), t_data.size()); }
+    /// Add a single byte to the checksum
+    Crc16& update(uint8_t t_byte);
+
+    /// Returns checksum of the data added so far
+    constexpr uint16_t value() const { return m_crc; }
+    /// Restart calculation
+    void reset() { m_crc = INIT; }
+
+    /// Returns checksum of a contiguous buffer
+    static uint16_t calc(const uint8_t* t_data, size_t t_len)
+        { return Crc16().update(t_data, t_len).value(); }
+    /// Returns checksum of a vector
+    static uint16_t calc(const std::vector<uint8_t>& t_data)
+        { return calc(t_data.data(), t_data.size()); }
+
+private:
+    uint16_t m_crc;
+};
+
+}
+
+#endif
@@ -2,24 +2,70 @@
 #define LK_MODBUS_HH
 
 #include <memory>
+#include <vector>
 #include <labkit/comms/basiccomm.hh>
 
 namespace labkit
 {
 
+/** \brief Packed bits of coils and discrete inputs
+ *
+ *  Bits are stored like in MODBUS frames: bit 0 is the LSB of the first byte.
+ *  Responses are copied as they are, without unpacking every bit.
+ */
+class ModbusBits
+{
+public:
+    ModbusBits() {};
+    /// Create t_len bits, all off
+    explicit ModbusBits(size_t t_len) : m_bytes((t_len + 7) / 8), m_len(t_len) {};
+    /// Create from packed bytes (e.g. FC01/FC02 response)
+    ModbusBits(const uint8_t* t_packed, size_t t_len);
+    /// Create from vector
+    ModbusBits(const std::vector<bool>& t_bits);
+
+    /// Returns number of bits
+    size_t size() const { return m_len; }
+    /// Returns true if there are no bits
+    bool empty() const { return m_len == 0; }
+
+    /// Returns bit; no range check
+    bool operator[](size_t t_pos) const
+        { return (m_bytes[t_pos >> 3] >> (t_pos & 0x07)) & 0x01; }
+    /// Returns bit; throws if out of range
+    bool test(size_t t_pos) const;
+    /// Set or clear bit; throws if out of range
+    void set(size_t t_pos, bool t_ena = true);
+
+    /// Returns number of bits set
+    size_t count() const;
+
+    /// Returns packed bytes; unused bits of the last byte are 0
+    const std::vector<uint8_t>& bytes() const { return m_bytes; }
+
+    /// Returns bits as vector
+    std::vector<bool> toVector() const;
+
+private:
+    std::vector<uint8_t> m_bytes {};
+    size_t m_len {0};
+};
+
 /** \brief Abstract base class for the MODBUS protocol
  *
- *  Basic MODBUS definitions used by MODBUS TCP and MODBUS RTC.
+ *  Basic MODBUS definitions used by MODBUS TCP and MODBUS RTC. The function
+ *  codes are implemented on PDU level; derived classes implement the framing
+ *  of a transaction().
  */
 class Modbus
 {
 public:
     Modbus() {};
     Modbus(std::shared_ptr<BasicComm> t_comm) : m_comm(t_comm) {};
-    ~Modbus() {};
-    
+    virtual ~Modbus() {};
+
     /// Set communication interface
-    void setComm(std::shared_ptr<BasicComm> t_comm) { t_comm = m_comm; }
+    void setComm(std::shared_ptr<BasicComm> t_comm) { m_comm = t_comm; }
 
     /// Modbus function codes
     enum FunctionCode : uint8_t 
@@ -31,7 +77,8 @@ public:
         FC05 = 0x05,    ///< Write single coil
         FC06 = 0x06,    ///< Write single holding register
         FC15 = 0x0F,    ///< Write multiple coils
-        FC16 = 0x10     ///< Write multiple holding registers
+        FC16 = 0x10,    ///< Write multiple holding registers
+        FC23 = 0x17     ///< Read/write multiple registers
     };
 
     /// Modbus error codes
@@ -41,45 +88,147 @@ public:
         ERR1 = 0x01,    ///< Illegal Function
         ERR2 = 0x02,    ///< Illegal Data Address
         ERR3 = 0x03,    ///< Illegal Data Value
-        ERR4 = 0x04     ///< Slave Device Failure
+        ERR4 = 0x04,    ///< Slave Device Failure
+        ERR10 = 0x0A,   ///< Gateway Path Unavailable
+        ERR11 = 0x0B    ///< Gateway Target Device Failed to Respond
     };
 
-    /// Function Code 01; read coils -> returns true = on, false = off
-    virtual std::vector<bool> readCoils(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_len) = 0;
+    /// Unit ID addressing all slaves of a serial line
+    static constexpr uint8_t BROADCAST_ID = 0;
+
+    /// Protocol limits of a single request
+    static constexpr uint16_t MAX_READ_REGS = 125;      ///< FC03, FC04
+    static constexpr uint16_t MAX_WRITE_REGS = 123;     ///< FC16
+    static constexpr uint16_t MAX_READ_BITS = 2000;     ///< FC01, FC02
+    static constexpr uint16_t MAX_WRITE_BITS = 1968;    ///< FC15
+    static constexpr uint16_t MAX_RW_WRITE_REGS = 121;  ///< FC23 (write part)
+
+    /// Function Code 01; read coils -> bit set = on, cleared = off
+    virtual ModbusBits readCoils(uint8_t t_unit_id, uint16_t t_addr, 
+        uint16_t t_len);
 
     /// Function Code 02; read discrete inputs
-    virtual std::vector<bool> readDiscreteInputs(uint8_t t_unit_id, 
-        uint16_t t_addr, uint16_t t_len) = 0;
+    virtual ModbusBits readDiscreteInputs(uint8_t t_unit_id, 
+        uint16_t t_addr, uint16_t t_len);
 
     /// Function Code 03; read multiple holding registers
     virtual std::vector<uint16_t> readMultipleHoldingRegs(uint8_t t_unit_id, 
-        uint16_t t_addr, uint16_t t_len) = 0;
+        uint16_t t_addr, uint16_t t_len);
 
     /// Function Code 04; read input registers
     virtual std::vector<uint16_t> readInputRegs(uint8_t t_unit_id, 
-        uint16_t t_addr, uint16_t t_len) = 0;
+        uint16_t t_addr, uint16_t t_len);
 
     /// Function Code 05; write single coil -> on = true, off = false
-    virtual void writeSingleCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena) = 0;
+    virtual void writeSingleCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena);
 
     /// Function Code 06; write single holding register
     virtual void writeSingleHoldingReg(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_reg) = 0;
+        uint16_t t_reg);
 
-    /// Function Code 15; write multiple coils -> on = true, off = false
+    /// Function Code 15; write multiple coils -> bit set = on, cleared = off
     virtual void writeMultipleCoils(uint8_t t_unit_id, uint16_t t_addr, 
-        std::vector<bool> t_ena) = 0;
+        const ModbusBits& t_ena);
 
     /// Function Code 16; write multiple holding registers
     virtual void writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr, 
-        std::vector<uint16_t> t_regs) = 0;
+        std::vector<uint16_t> t_regs);
+
+    /** \brief Function Code 23; read/write multiple registers
+     *
+     *  Writes holding registers and reads holding registers with a single
+     *  transaction; the write is performed before the read.
+     *  \param [in] t_read_addr Starting address of the read
+     *  \param [in] t_read_len Number of registers to read (1 - 125)
+     *  \param [in] t_write_addr Starting address of the write
+     *  \param [in] t_regs Registers to write (1 - 121)
+     *  \return Registers read
+     */
+    virtual std::vector<uint16_t> readWriteMultipleRegs(uint8_t t_unit_id, 
+        uint16_t t_read_addr, uint16_t t_read_len, uint16_t t_write_addr,
+        const std::vector<uint16_t>& t_regs);
+
+    /** \brief Send request and return the response
+     *
+     *  Generic transaction, e.g. for function codes without a dedicated
+     *  method or to forward requests. Exception responses are thrown as
+     *  BadProtocol with the exception code as error number.
+     *  \param [in] t_data Request PDU following the function code
+     *  \return Response PDU following the function code
+     */
+    std::vector<uint8_t> request(uint8_t t_unit_id, uint8_t t_function_code,
+        const std::vector<uint8_t>& t_data)
+        { return this->transaction(t_unit_id, t_function_code, t_data); }
+
+    /** \brief Send write request to all slaves (unit ID 0)
+     *
+     *  Every slave executes a broadcast, none responds. Only writes (FC05,
+     *  FC06, FC15, FC16) may be broadcast, and only on a serial line.
+     *  \param [in] t_data Request PDU following the function code
+     */
+    void broadcast(uint8_t t_function_code, const std::vector<uint8_t>& t_data);
+
+    /** \brief Convert register bytes of a frame to registers
+     *
+     *  Swaps the big endian bytes of t_len registers in bulk (SIMD where
+     *  available); t_data and t_regs may not overlap.
+     */
+    static void unpackRegs(const uint8_t* t_data, uint16_t* t_regs, size_t t_len);
+
+    /// Register block of a batch read
+    struct RegBlock
+    {
+        uint8_t unit_id;    ///< Unit identifier
+        uint8_t fcode;      ///< FC03 (holding registers) or FC04 (input registers)
+        uint16_t addr;      ///< Starting address
+        uint16_t len;       ///< Number of registers (1 - 125)
+    };
+
+    /** \brief Read multiple register blocks (FC03/FC04)
+     *
+     *  Blocks are read one after another; protocols supporting multiple
+     *  outstanding requests override this.
+     *  \return Registers of each block, in the order of t_blocks
+     */
+    virtual std::vector<std::vector<uint16_t>> readRegBlocks(
+        const std::vector<RegBlock>& t_blocks);
 
 protected:
     std::shared_ptr<BasicComm> m_comm {nullptr};
 
+    /** \brief Send request and return the response
+     *
+     *  Implemented by the framing of the protocol. Unit ID and function code
+     *  of the response are verified; exception responses are thrown.
+     *  \param [in] t_data Request PDU following the function code
+     *  \return Response PDU following the function code
+     */
+    virtual std::vector<uint8_t> transaction(uint8_t t_unit_id, 
+        uint8_t t_function_code, const std::vector<uint8_t>& t_data) = 0;
+
+    /// Send request without reading a response; throws if not supported
+    virtual void send(uint8_t t_unit_id, uint8_t t_function_code,
+        const std::vector<uint8_t>& t_data);
+
     /// Check error codes and throw corresponding exception
     static void checkAndThrow(uint8_t error);
+
+    /// Returns registers of a FC03/FC04 response PDU (byte count, registers)
+    static std::vector<uint16_t> decodeRegs(const uint8_t* t_data, size_t t_size, 
+        uint16_t t_len);
+
+private:
+    /// Read 16 bit registers; used by FC03 & FC04
+    std::vector<uint16_t> read16BitRegs(uint8_t t_unit_id, 
+        uint8_t t_function_code, uint16_t t_start_addr, uint16_t t_len);
+
+    /// Read bits; used by FC01 & FC02
+    ModbusBits readBits(uint8_t t_unit_id, uint8_t t_function_code, 
+        uint16_t t_start_addr, uint16_t t_len);
+
+    /// Check address and value/quantity echoed by write responses
+    static void checkEcho(const std::vector<uint8_t>& t_resp, uint16_t t_addr, 
+        uint16_t t_value);
 };
 
 }
@@ -0,0 +1,171 @@
+#ifndef LK_MODBUS_DECODER_HH
+#define LK_MODBUS_DECODER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace labkit
+{
+
+/** \brief Incremental decoder of MODBUS frames
+ *
+ *  Received bytes are added in chunks of any size; complete frames are
+ *  returned one by one, no matter how they were split or combined by the
+ *  transport. Bytes can be received directly into the decoder's buffer:
+ *
+ *      size_t space;
+ *      uint8_t* buf = decoder.prepare(space);
+ *      decoder.commit(comm->readRaw(buf, space, timeout_ms));
+ *      ModbusDecoder::Frame frame;
+ *      while (decoder.next(frame))
+ *          handle(frame.data, frame.len);
+ *
+ *  The buffer is used like a ring buffer, but instead of wrapping around,
+ *  the remaining bytes (less than a frame) are moved to the front. Frames
+ *  are therefore always contiguous and returned without copying; they are
+ *  valid until the next call of prepare() or feed().
+ */
+class ModbusDecoder
+{
+public:
+    /// Complete frame in the decoder's buffer
+    struct Frame
+    {
+        const uint8_t* data;    ///< First byte of the frame
+        size_t len;             ///< Length incl. header and checksum
+    };
+
+    /** \brief Constructor
+     *  \param t_max_frame Maximum length of a frame
+     *  \param t_capacity Buffer size; at least two frames
+     */
+    ModbusDecoder(size_t t_max_frame, size_t t_capacity);
+    virtual ~ModbusDecoder() {};
+
+    /// No copy constructor; frames point into the buffer
+    ModbusDecoder(const ModbusDecoder&) = delete;
+    /// No assignment operator; frames point into the buffer
+    ModbusDecoder& operator=(const ModbusDecoder&) = delete;
+
+    /** \brief Returns free space to receive bytes into
+     *
+     *  Makes room for at least a complete frame.
+     *  \param [out] t_space Number of bytes available
+     */
+    uint8_t* prepare(size_t& t_space);
+    /// Add bytes received into the space returned by prepare()
+    void commit(size_t t_len);
+
+    /** \brief Copy received bytes into the buffer
+     *  \return Number of bytes added; less than t_len if the buffer is full,
+     *      then frames must be taken with next() first
+     */
+    size_t feed(const uint8_t* t_data, size_t t_len);
+
+    /** \brief Returns next complete frame
+     *
+     *  Throws BadProtocol on invalid frames; bytes which cannot be part of
+     *  a valid frame are dropped, so decoding can continue.
+     *  \return false if no complete frame is available
+     */
+    bool next(Frame& t_frame);
+
+    /// Returns number of buffered bytes not yet returned as frame
+    size_t size() const { return m_tail - m_head; }
+    /// Drop all buffered bytes
+    void clear() { m_head = m_tail = 0; }
+
+protected:
+    /** \brief Returns length of the frame at the start of t_data
+     *
+     *  Throws BadProtocol if the data cannot be a valid frame, after
+     *  dropping the bytes required to resynchronize.
+     *  \param [in] t_len Bytes available (at least 1)
+     *  \return Frame length; 0 if more bytes are required to tell
+     */
+    virtual size_t frameLength(const uint8_t* t_data, size_t t_len) = 0;
+
+    /// Returns true if a complete frame is valid (e.g. its checksum)
+    virtual bool checkFrame(const uint8_t* t_data, size_t t_len) const
+        { return true; }
+
+    /// Drop bytes at the front to resynchronize after an error
+    void drop(size_t t_len) { m_head += (t_len < size()) ? t_len : size(); }
+
+private:
+    std::unique_ptr<uint8_t[]> m_buf;
+    size_t m_capacity;
+    size_t m_max_frame;
+    size_t m_head {0};  ///< First byte not yet returned as frame
+    size_t m_tail {0};  ///< End of received bytes
+};
+
+/** \brief Decoder of MODBUS TCP frames
+ *
+ *  Frames are delimited by the length field of the MBAP header; requests
+ *  and responses are framed the same way. An invalid header means the
+ *  stream is out of sync: all buffered bytes are dropped.
+ */
+class ModbusTcpDecoder : public ModbusDecoder
+{
+public:
+    explicit ModbusTcpDecoder(size_t t_capacity = DFLT_CAPACITY) :
+        ModbusDecoder(MAX_FRAME, t_capacity) {};
+
+    /// Maximum length of a frame (MBAP header and PDU)
+    static constexpr size_t MAX_FRAME = 260;
+    /// Default buffer size
+    static constexpr size_t DFLT_CAPACITY = 4 * MAX_FRAME;
+
+protected:
+    size_t frameLength(const uint8_t* t_data, size_t t_len) override;
+};
+
+/** \brief Decoder of MODBUS RTU frames
+ *
+ *  RTU frames carry no length; it is derived from the function code and,
+ *  for variable length frames, the byte count. Requests and responses of a
+ *  function code differ in length, so the decoder is created for one of
+ *  them. Frames with an invalid CRC are reported and skipped byte by byte
+ *  until the next valid frame is found.
+ *
+ *  The CRC can be disabled for RTU framing over transports with their own
+ *  error detection.
+ */
+class ModbusRtuDecoder : public ModbusDecoder
+{
+public:
+    /// Frames decoded
+    enum Direction
+    {
+        RESPONSES,      ///< Responses (client side)
+        REQUESTS        ///< Requests (server side)
+    };
+
+    explicit ModbusRtuDecoder(Direction t_dir = RESPONSES,
+        size_t t_capacity = DFLT_CAPACITY) :
+        ModbusDecoder(MAX_FRAME, t_capacity), m_dir(t_dir) {};
+
+    /// Enable or disable the CRC (enabled by default)
+    void setCrc(bool t_ena) { m_crc = t_ena; }
+    /// Returns true if frames carry a CRC
+    bool getCrc() const { return m_crc; }
+
+    /// Maximum length of a frame (unit ID, PDU and CRC)
+    static constexpr size_t MAX_FRAME = 256;
+    /// Default buffer size
+    static constexpr size_t DFLT_CAPACITY = 4 * MAX_FRAME;
+
+protected:
+    size_t frameLength(const uint8_t* t_data, size_t t_len) override;
+    bool checkFrame(const uint8_t* t_data, size_t t_len) const override;
+
+private:
+    Direction m_dir;
+    bool m_crc {true};
+};
+
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef LK_MODBUS_GATEWAY_HH
+#define LK_MODBUS_GATEWAY_HH
+
+#include <labkit/protocols/modbus.hh>
+#include <labkit/protocols/modbustcpserver.hh>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace labkit
+{
+
+/** \brief MODBUS TCP to RTU gateway
+ *
+ *  Accepts MODBUS TCP requests from many clients and forwards them to a bus,
+ *  typically ModbusRtu on a SerialComm (RS-485):
+ *
+ *      auto serial = std::make_shared<SerialComm>("/dev/ttyUSB0", 19200);
+ *      ModbusGateway gateway(std::make_shared<ModbusRtu>(serial));
+ *      gateway.setCacheTime(std::chrono::milliseconds(200));
+ *      gateway.listen(502);
+ *      gateway.start();
+ *
+ *  Requests are queued and sent by a bus thread one after another, without
+ *  delay between transactions. Reads (FC01 - FC04) identical to a read
+ *  which is queued or on the bus are not sent again; all clients receive
+ *  the response of that transaction. Successful reads are cached for
+ *  getCacheTime(), so requests in this window are answered without bus
+ *  access. A write to a unit drops its cached reads and ends coalescing
+ *  with reads queued before the write.
+ *
+ *  Writes (FC05, FC06, FC15, FC16) to unit ID 0 are broadcast on the bus
+ *  without waiting for a response (see Modbus::broadcast()); the client is
+ *  answered like for a successful write once the request was sent. They
+ *  drop the cached reads of all units. Other requests to unit ID 0 are
+ *  rejected with Modbus::ERR1. setUnitId() limits forwarding to one unit;
+ *  requests to other units, including broadcasts, are not answered.
+ *
+ *  Bus errors are reported as gateway exceptions: Modbus::ERR11 if the
+ *  device did not respond correctly, Modbus::ERR10 if the bus is not
+ *  available, does not support broadcasts, or the queue is full.
+ */
+class ModbusGateway : public ModbusTcpServer
+{
+public:
+    /// Gateway statistics
+    struct Stats
+    {
+        uint64_t transactions;  ///< Transactions on the bus
+        uint64_t bus_errors;    ///< Transactions without valid response
+        uint64_t coalesced;     ///< Requests answered by another transaction
+        uint64_t cache_hits;    ///< Requests answered from the cache
+        uint64_t rejected;      ///< Requests rejected (queue full)
+        size_t queued;          ///< Transactions waiting for the bus
+    };
+
+    ModbusGateway(std::shared_ptr<Modbus> t_modbus) : m_modbus(t_modbus) {};
+    /// Destructor; stops the gateway
+    ~ModbusGateway();
+
+    /// Start server and bus thread
+    void start() override;
+    /// Stop server and bus thread; queued requests are dropped
+    void stop() override;
+
+    /// Set time successful reads are cached; 0 = no caching (default)
+    void setCacheTime(std::chrono::milliseconds t_time);
+    /// Returns time successful reads are cached
+    std::chrono::milliseconds getCacheTime() const;
+
+    /// Set maximum number of queued transactions
+    void setMaxQueue(size_t t_max);
+
+    /// Returns gateway statistics
+    Stats getGatewayStats() const;
+
+    /// Default maximum number of queued transactions
+    static constexpr size_t DFLT_MAX_QUEUE = 256;
+
+protected:
+    void processRequest(const Request& t_req, const uint8_t* t_pdu,
+        size_t t_len, std::vector<uint8_t>& t_resp) override;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    /// Maximum number of cached responses
+    static constexpr size_t MAX_CACHE_ENTRIES = 1024;
+
+    /// Transaction on the bus; shared by coalesced requests
+    struct Job
+    {
+        std::string key;                ///< Unit ID and request PDU
+        std::vector<Request> waiters;   ///< Requests answered by the job
+        bool read;                      ///< Read; may be coalesced and cached
+        bool invalidated;               ///< Unit written since queued
+    };
+
+    /// Cached response
+    struct CacheEntry
+    {
+        std::vector<uint8_t> pdu;
+        Clock::time_point time;
+    };
+
+    std::shared_ptr<Modbus> m_modbus {nullptr};
+
+    std::thread m_bus_thread {};
+    mutable std::mutex m_mutex {};
+    std::condition_variable m_cv {};
+    bool m_bus_stop {false};
+
+    std::deque<std::shared_ptr<Job>> m_queue {};
+    /// Reads queued or on the bus, by key
+    std::map<std::string, std::shared_ptr<Job>> m_pending {};
+    std::map<std::string, CacheEntry> m_cache {};
+    Clock::duration m_cache_time {0};
+    size_t m_max_queue {DFLT_MAX_QUEUE};
+
+    uint64_t m_transactions {0}, m_bus_errors {0}, m_coalesced {0};
+    uint64_t m_cache_hits {0}, m_rejected {0};
+
+    /// Bus thread
+    void run();
+    /// Perform transaction; returns response PDU (incl. function code)
+    std::vector<uint8_t> execute(const std::string& t_key);
+    /// Drop cached and end coalescing of reads of a unit (all units for
+    /// Modbus::BROADCAST_ID); call locked
+    void invalidate(uint8_t t_unit_id);
+    /// Store response in the cache; call locked
+    void store(const std::string& t_key, const std::vector<uint8_t>& t_pdu);
+};
+
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef LK_MODBUS_POLLER_HH
+#define LK_MODBUS_POLLER_HH
+
+#include <labkit/protocols/modbus.hh>
+#include <labkit/protocols/modbusscan.hh>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace labkit
+{
+
+/** \brief Cyclic MODBUS polling with a shared register image
+ *
+ *  Points are organized in scan groups with individual periods. A worker
+ *  thread runs the groups by earliest deadline; each group is read with a
+ *  ModbusScan, so its points are merged into few (pipelined) requests.
+ *
+ *  Results are published into a register image which any thread can read
+ *  without locks: each group is protected by a sequence counter (seqlock),
+ *  so a read returns the registers of a single scan. Every point carries
+ *  the time of its last successful scan to detect stale values.
+ *
+ *      ModbusPoller poller(modbus);
+ *      size_t fast = poller.addGroup(std::chrono::milliseconds(100));
+ *      size_t temp = poller.addPoint(fast, 1, Modbus::FC04, 100, 2);
+ *      poller.start();
+ *      ...
+ *      uint16_t regs[2];
+ *      if (poller.read(temp, regs) && !poller.isStale(temp, 3 * period))
+ *          ...
+ *
+ *  Groups and points must be added before the first start(); the image
+ *  keeps its layout when polling is stopped and restarted. While running, the
+ *  MODBUS protocol (and its communication interface) is used exclusively
+ *  by the poller thread.
+ */
+class ModbusPoller
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ModbusPoller(std::shared_ptr<Modbus> t_modbus) : m_modbus(t_modbus) {};
+    /// Destructor; stops polling
+    ~ModbusPoller();
+
+    /// No copy constructor; the image is shared with the poller thread
+    ModbusPoller(const ModbusPoller&) = delete;
+    /// No assignment operator; the image is shared with the poller thread
+    ModbusPoller& operator=(const ModbusPoller&) = delete;
+
+    /// Add scan group with given period; returns group ID
+    size_t addGroup(std::chrono::milliseconds t_period, uint16_t t_gap = 0);
+
+    /// Add point to a scan group; returns point ID
+    size_t addPoint(size_t t_group, uint8_t t_unit_id, uint8_t t_fcode,
+        uint16_t t_addr, uint16_t t_len = 1);
+
+    /// Start polling thread
+    void start();
+    /// Stop polling thread
+    void stop();
+    /// Returns true if the polling thread is running
+    bool running() const { return m_thread.joinable(); }
+
+    /** \brief Read registers of a point from the image (lock-free)
+     *  \param [out] t_regs Registers; the point's length is copied
+     *  \param [out] t_time Time of the scan (optional)
+     *  \return false if the point was not read successfully yet
+     */
+    bool read(size_t t_point, uint16_t* t_regs, Clock::time_point* t_time = nullptr) const;
+    /// Read registers of a point; empty if not read successfully yet
+    std::vector<uint16_t> read(size_t t_point) const;
+
+    /// Returns time of the last successful scan of a point
+    Clock::time_point getTimestamp(size_t t_point) const;
+    /// Returns true if the point is older than t_max_age (or never read)
+    bool isStale(size_t t_point, Clock::duration t_max_age) const;
+
+    /// Statistics of a scan group
+    struct Stats
+    {
+        uint64_t scans;             ///< Successful scans
+        uint64_t errors;            ///< Failed scans
+        uint64_t overruns;          ///< Missed deadlines (cycles skipped)
+        Clock::duration last_duration;  ///< Duration of the last scan
+        Clock::duration max_duration;   ///< Longest scan
+        std::string last_error;     ///< Message of the last failure
+    };
+
+    /// Returns statistics of a scan group
+    Stats getStats(size_t t_group) const;
+
+    /// Callback on overruns; receives group ID and number of skipped cycles
+    using OverrunCallback = std::function<void(size_t t_group, uint64_t t_skipped)>;
+    /// Set overrun callback; called from the poller thread
+    void setOverrunCallback(OverrunCallback t_callback) { m_overrun_cb = t_callback; }
+
+private:
+    struct Group
+    {
+        Clock::duration period;
+        ModbusScan scan;
+        std::vector<size_t> points;     ///< Point IDs, in order of the scan
+        Clock::time_point deadline {};
+        std::atomic<uint32_t> seq {0};  ///< Odd while the image is updated
+        mutable std::mutex stats_mutex;
+        Stats stats {0, 0, 0, {}, {}, ""};
+    };
+
+    struct Point
+    {
+        size_t group;
+        size_t offset;                  ///< First register in the image
+        uint16_t len;
+        std::atomic<int64_t> time {0};  ///< Clock ticks of the last scan, 0 = never
+    };
+
+    std::shared_ptr<Modbus> m_modbus {nullptr};
+    std::vector<std::unique_ptr<Group>> m_groups {};
+    std::vector<std::unique_ptr<Point>> m_points {};
+
+    /// Register image; atomics, so readers never race with the writer
+    std::unique_ptr<std::atomic<uint16_t>[]> m_image {};
+    size_t m_image_size {0};
+
+    std::thread m_thread {};
+    std::mutex m_mutex {};
+    std::condition_variable m_cv {};
+    bool m_stop {false};
+    OverrunCallback m_overrun_cb {nullptr};
+
+    /// Poller thread
+    void run();
+    /// Scan a group and publish the results
+    void scanGroup(Group& t_group);
+    /// Returns point; throws if the ID is invalid
+    const Point& point(size_t t_point) const;
+};
+
+}
+
+#endif
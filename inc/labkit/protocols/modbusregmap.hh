@@ -0,0 +1,362 @@
+#ifndef LK_MODBUS_REG_MAP_HH
+#define LK_MODBUS_REG_MAP_HH
+
+#include <labkit/protocols/modbus.hh>
+#include <labkit/exceptions.hh>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace labkit
+{
+
+/// Types and orders of values stored in MODBUS registers
+struct ModbusReg
+{
+    /// Data type of a value
+    enum Type : uint8_t
+    {
+        INT16,      ///< 1 register
+        UINT16,     ///< 1 register
+        INT32,      ///< 2 registers
+        UINT32,     ///< 2 registers
+        INT64,      ///< 4 registers
+        UINT64,     ///< 4 registers
+        FLOAT32,    ///< 2 registers, IEEE 754
+        FLOAT64     ///< 4 registers, IEEE 754
+    };
+
+    /// Order of the registers of a multi-register value
+    enum WordOrder : uint8_t
+    {
+        HIGH_FIRST,     ///< Most significant register first (e.g. ABCD)
+        LOW_FIRST       ///< Least significant register first (e.g. CDAB)
+    };
+
+    /// Order of the bytes within a register
+    enum ByteOrder : uint8_t
+    {
+        MSB_FIRST,      ///< MODBUS standard (e.g. ABCD)
+        LSB_FIRST       ///< Swapped (e.g. BADC)
+    };
+
+    /// Returns number of registers of a type
+    static constexpr uint16_t size(Type t_type)
+    {
+        return (t_type == INT16) || (t_type == UINT16) ? 1
+            : (t_type == INT64) || (t_type == UINT64) || (t_type == FLOAT64) ? 4 : 2;
+    }
+};
+
+/// Field of a register map; created with regField()
+template <typename T, typename M>
+struct ModbusRegField
+{
+    const char* name;               ///< Name (e.g. for diagnostics)
+    uint16_t addr;                  ///< Address of the first register
+    ModbusReg::Type type;           ///< Data type in the registers
+    M T::* member;                  ///< Member of the user struct
+    double scale;                   ///< Factor applied to the value
+    ModbusReg::WordOrder word_order;
+    ModbusReg::ByteOrder byte_order;
+};
+
+/** \brief Returns field of a register map
+ *
+ *  \param t_member Member the value is stored in; it is converted from
+ *      the data type (multiplied by t_scale if not 1)
+ */
+template <typename T, typename M>
+constexpr ModbusRegField<T, M> regField(const char* t_name, uint16_t t_addr,
+    ModbusReg::Type t_type, M T::* t_member, double t_scale = 1.0,
+    ModbusReg::WordOrder t_word_order = ModbusReg::HIGH_FIRST,
+    ModbusReg::ByteOrder t_byte_order = ModbusReg::MSB_FIRST)
+{
+    return ModbusRegField<T, M> {t_name, t_addr, t_type, t_member, t_scale,
+        t_word_order, t_byte_order};
+}
+
+/** \brief Typed register map of a device
+ *
+ *  Describes where the members of a struct are found in the holding or
+ *  input registers of a device. The read plan (register blocks of up to
+ *  125 registers) is generated at compile time, and every response is
+ *  decoded directly into the struct:
+ *
+ *      struct Meter { float voltage; float current; double energy; };
+ *
+ *      constexpr auto METER = makeRegMap(Modbus::FC04,
+ *          regField("voltage", 0x00, ModbusReg::FLOAT32, &Meter::voltage),
+ *          regField("current", 0x02, ModbusReg::FLOAT32, &Meter::current),
+ *          regField("energy", 0x10, ModbusReg::UINT32, &Meter::energy, 0.01,
+ *              ModbusReg::LOW_FIRST));
+ *      static_assert(METER.blockCount() == 2, "");
+ *
+ *      Meter meter = METER.read(*modbus, 1);
+ *
+ *  Fields are merged into a block if the gap to the previous field is at
+ *  most t_gap registers; gaps are read, so they must be readable. Invalid
+ *  maps (function code, address range) fail to compile when the map is
+ *  constexpr.
+ */
+template <typename T, typename... M>
+class ModbusRegMap : public ModbusReg
+{
+public:
+    /// Number of fields
+    static constexpr size_t FIELDS = sizeof...(M);
+    static_assert(FIELDS > 0, "Register map without fields");
+
+    /// Register block read with a single request
+    struct Block
+    {
+        uint16_t addr;
+        uint16_t len;
+    };
+
+    /** \brief Constructor; creates the read plan
+     *
+     *  \param t_fcode FC03 (holding registers) or FC04 (input registers)
+     *  \param t_gap Maximum unused registers between fields of a block
+     */
+    constexpr ModbusRegMap(uint8_t t_fcode, uint16_t t_gap,
+        ModbusRegField<T, M>... t_fields);
+
+    /// Returns function code used for reading
+    constexpr uint8_t functionCode() const { return m_fcode; }
+    /// Returns number of register blocks (requests) of the read plan
+    constexpr size_t blockCount() const { return m_block_count; }
+    /// Returns register block of the read plan
+    constexpr Block block(size_t t_block) const { return m_blocks[t_block]; }
+    /// Returns name of a field
+    constexpr const char* name(size_t t_field) const { return m_slots[t_field].name; }
+    /// Returns address of a field
+    constexpr uint16_t addr(size_t t_field) const { return m_slots[t_field].addr; }
+
+    /** \brief Decode fields of a block from a response
+     *
+     *  \param [in] t_data Register bytes as received (following the byte count)
+     */
+    void decode(size_t t_block, const uint8_t* t_data, T& t_out) const;
+
+    /// Decode fields of a block from registers (e.g. of a ModbusPoller)
+    void decodeRegs(size_t t_block, const uint16_t* t_regs, T& t_out) const;
+
+    /// Read all blocks and decode the fields into t_out
+    void read(Modbus& t_modbus, uint8_t t_unit_id, T& t_out) const;
+    /// Read all blocks; returns struct with the fields set
+    T read(Modbus& t_modbus, uint8_t t_unit_id) const
+    {
+        T ret {};
+        this->read(t_modbus, t_unit_id, ret);
+        return ret;
+    }
+
+private:
+    /// Position of a field in the read plan
+    struct Slot
+    {
+        const char* name;
+        uint16_t addr;
+        uint16_t len;
+        size_t block;       ///< Block containing the field
+        uint16_t offset;    ///< First register within the block
+    };
+
+    uint8_t m_fcode;
+    std::tuple<ModbusRegField<T, M>...> m_fields;
+    std::array<Slot, FIELDS> m_slots;
+    std::array<Block, FIELDS> m_blocks;
+    size_t m_block_count;
+
+    template <size_t... I>
+    void decodeFields(size_t t_block, const uint16_t* t_regs, T& t_out,
+        std::index_sequence<I...>) const;
+
+    /// Decode a field if it is part of the block
+    template <typename F>
+    static void decodeField(const F& t_field, const Slot& t_slot, size_t t_block,
+        const uint16_t* t_regs, T& t_out);
+
+    /// Store value, scaled if necessary
+    template <typename D, typename V>
+    static void assign(D& t_dst, V t_value, double t_scale)
+    {
+        t_dst = (t_scale == 1.0) ? static_cast<D>(t_value)
+            : static_cast<D>(t_value * t_scale);
+    }
+};
+
+/// Returns register map without gaps in blocks
+template <typename T, typename... M>
+constexpr ModbusRegMap<T, M...> makeRegMap(uint8_t t_fcode,
+    ModbusRegField<T, M>... t_fields)
+{
+    return ModbusRegMap<T, M...>(t_fcode, 0, t_fields...);
+}
+
+/// Returns register map; blocks may contain gaps of up to t_gap registers
+template <typename T, typename... M>
+constexpr ModbusRegMap<T, M...> makeRegMap(uint8_t t_fcode, uint16_t t_gap,
+    ModbusRegField<T, M>... t_fields)
+{
+    return ModbusRegMap<T, M...>(t_fcode, t_gap, t_fields...);
+}
+
+/*
+ *  T E M P L A T E   I M P L E M E N T A T I O N
+ */
+
+template <typename T, typename... M>
+constexpr ModbusRegMap<T, M...>::ModbusRegMap(uint8_t t_fcode, uint16_t t_gap,
+    ModbusRegField<T, M>... t_fields) :
+    m_fcode(t_fcode), m_fields(t_fields...),
+    m_slots {{ Slot {t_fields.name, t_fields.addr, size(t_fields.type), 0, 0}... }},
+    m_blocks {}, m_block_count(0)
+{
+    if ( (t_fcode != Modbus::FC03) && (t_fcode != Modbus::FC04) )
+        throw BadProtocol("Register maps support FC03 and FC04 only");
+
+    // Sort fields by address
+    size_t order[FIELDS] {};
+    for (size_t i = 0; i < FIELDS; i++) {
+        if (m_slots[i].addr + m_slots[i].len > 0x10000)
+            throw BadProtocol("Register map field exceeds address range");
+        size_t k = i;
+        for ( ; (k > 0) && (m_slots[order[k - 1]].addr > m_slots[i].addr); k--)
+            order[k] = order[k - 1];
+        order[k] = i;
+    }
+
+    // Merge fields into blocks of up to MAX_READ_REGS registers
+    for (size_t k = 0; k < FIELDS; k++) {
+        Slot& slot = m_slots[order[k]];
+        size_t end = slot.addr + slot.len;
+        if (m_block_count > 0) {
+            Block& last = m_blocks[m_block_count - 1];
+            size_t last_end = last.addr + last.len;
+            if ( (slot.addr <= last_end + t_gap)
+                 && (std::max(end, last_end) - last.addr <= Modbus::MAX_READ_REGS) ) {
+                last.len = static_cast<uint16_t>(std::max(end, last_end) - last.addr);
+                slot.block = m_block_count - 1;
+                slot.offset = static_cast<uint16_t>(slot.addr - last.addr);
+                continue;
+            }
+        }
+        m_blocks[m_block_count] = Block {slot.addr, slot.len};
+        slot.block = m_block_count++;
+        slot.offset = 0;
+    }
+}
+
+template <typename T, typename... M>
+void ModbusRegMap<T, M...>::decode(size_t t_block, const uint8_t* t_data,
+    T& t_out) const
+{
+    uint16_t regs[Modbus::MAX_READ_REGS];
+    Modbus::unpackRegs(t_data, regs, m_blocks[t_block].len);
+    this->decodeRegs(t_block, regs, t_out);
+    return;
+}
+
+template <typename T, typename... M>
+void ModbusRegMap<T, M...>::decodeRegs(size_t t_block, const uint16_t* t_regs,
+    T& t_out) const
+{
+    this->decodeFields(t_block, t_regs, t_out, std::index_sequence_for<M...>());
+    return;
+}
+
+template <typename T, typename... M>
+void ModbusRegMap<T, M...>::read(Modbus& t_modbus, uint8_t t_unit_id, T& t_out) const
+{
+    for (size_t i = 0; i < m_block_count; i++) {
+        const Block& block = m_blocks[i];
+        std::vector<uint8_t> data {
+            static_cast<uint8_t>(0xFF & (block.addr >> 8)),
+            static_cast<uint8_t>(0xFF & block.addr),
+            static_cast<uint8_t>(0xFF & (block.len >> 8)),
+            static_cast<uint8_t>(0xFF & block.len)
+        };
+        auto resp = t_modbus.request(t_unit_id, m_fcode, data);
+        size_t received_bytes = resp.empty() ? 0 : resp[0];
+        if ( (received_bytes != 2u*block.len) || (resp.size() < 1 + received_bytes) )
+            throw BadProtocol("MODBUS response with " + std::to_string(received_bytes)
+                + " data bytes (expected " + std::to_string(2*block.len) + ")");
+        this->decode(i, resp.data() + 1, t_out);
+    }
+    return;
+}
+
+template <typename T, typename... M>
+template <size_t... I>
+void ModbusRegMap<T, M...>::decodeFields(size_t t_block, const uint16_t* t_regs,
+    T& t_out, std::index_sequence<I...>) const
+{
+    (decodeField(std::get<I>(m_fields), m_slots[I], t_block, t_regs, t_out), ...);
+    return;
+}
+
+template <typename T, typename... M>
+template <typename F>
+void ModbusRegMap<T, M...>::decodeField(const F& t_field, const Slot& t_slot,
+    size_t t_block, const uint16_t* t_regs, T& t_out)
+{
+    if (t_slot.block != t_block)
+        return;
+
+    // Assemble registers to the raw value, most significant first
+    const uint16_t* regs = t_regs + t_slot.offset;
+    uint64_t raw = 0;
+    for (uint16_t i = 0; i < t_slot.len; i++) {
+        uint16_t reg = regs[(t_field.word_order == HIGH_FIRST) ? i : t_slot.len - 1 - i];
+        if (t_field.byte_order == LSB_FIRST)
+            reg = static_cast<uint16_t>((reg << 8) | (reg >> 8));
+        raw = (raw << 16) | reg;
+    }
+
+    auto& dst = t_out.*(t_field.member);
+    switch (t_field.type) {
+    case INT16:
+        assign(dst, static_cast<int16_t>(raw), t_field.scale);
+        break;
+    case UINT16:
+        assign(dst, static_cast<uint16_t>(raw), t_field.scale);
+        break;
+    case INT32:
+        assign(dst, static_cast<int32_t>(raw), t_field.scale);
+        break;
+    case UINT32:
+        assign(dst, static_cast<uint32_t>(raw), t_field.scale);
+        break;
+    case INT64:
+        assign(dst, static_cast<int64_t>(raw), t_field.scale);
+        break;
+    case UINT64:
+        assign(dst, raw, t_field.scale);
+        break;
+    case FLOAT32: {
+        uint32_t bits = static_cast<uint32_t>(raw);
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        assign(dst, value, t_field.scale);
+        break;
+    }
+    case FLOAT64: {
+        double value;
+        memcpy(&value, &raw, sizeof(value));
+        assign(dst, value, t_field.scale);
+        break;
+    }
+    }
+    return;
+}
+
+}
+
+#endif
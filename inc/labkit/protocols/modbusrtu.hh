@@ -2,12 +2,16 @@
 #define LK_MODBUS_RTU_HH
 
 #include <labkit/protocols/modbus.hh>
+#include <labkit/protocols/modbusdecoder.hh>
 
 namespace labkit
 {
 
 /** \brief Implementation of MODBUS Remote Terminal Unit (RTU)
  *
+ *  Responses are read until a complete frame is received, so slow serial
+ *  lines delivering a response in several reads are supported. The frame
+ *  length is derived from the function code and byte count.
  */
 class ModbusRtu : public Modbus
 {
@@ -16,48 +20,42 @@ public:
     ModbusRtu(std::shared_ptr<BasicComm> t_comm) : Modbus(t_comm) {};
     ~ModbusRtu() {};
 
-    /// Function Code 01; read coils -> returns true = on, false = off
-    std::vector<bool> readCoils(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_len) override;
+    /// Set timeout in milliseconds for each read of a response
+    void setTimeout(unsigned t_timeout_ms) { m_timeout_ms = t_timeout_ms; }
 
-    /// Function Code 02; read discrete inputs
-    std::vector<bool> readDiscreteInputs(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_len) override;
+    /// Set delay in milliseconds after a broadcast for the slaves to process it
+    void setTurnaroundDelay(unsigned t_delay_ms) { m_turnaround_ms = t_delay_ms; }
 
-    /// Function Code 03; read multiple holding registers
-    std::vector<uint16_t> readMultipleHoldingRegs(uint8_t t_unit_id, 
-        uint16_t t_addr, uint16_t t_len) override;
+    /// Default turnaround delay (MODBUS over serial line: 100 - 200 ms)
+    static constexpr unsigned DFLT_TURNAROUND_MS = 100;
 
-    /// Function Code 04; read input registers
-    std::vector<uint16_t> readInputRegs(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_len) override;
+protected:
+    std::vector<uint8_t> transaction(uint8_t t_unit_id, uint8_t t_function_code,
+        const std::vector<uint8_t>& t_data) override;
 
-    /// Function Code 05; write single coil -> on = true, off = false
-    void writeSingleCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena) override;
-
-    /// Function Code 06; write single holding register
-    void writeSingleHoldingReg(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_reg) override;
-
-    /// Function Code 15; write multiple coils -> on = true, off = false
-    void writeMultipleCoils(uint8_t t_unit_id, uint16_t t_addr, 
-        std::vector<bool> t_ena) override;
-
-    /// Function Code 16; write multiple holding registers
-    void writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr, 
-        std::vector<uint16_t> t_regs) override;
+    /// Send request and wait for the turnaround delay
+    void send(uint8_t t_unit_id, uint8_t t_function_code,
+        const std::vector<uint8_t>& t_data) override;
 
 private:
-    /// Returns CRC sum used by MODBUS RTU
-    static uint16_t calcCrc16(const std::vector<uint8_t> &t_data);
-    
+    /// Response timeout
+    unsigned m_timeout_ms {BasicComm::DFLT_TIMEOUT_MS};
+    /// Delay after a broadcast
+    unsigned m_turnaround_ms {DFLT_TURNAROUND_MS};
+    /// Frames received
+    ModbusRtuDecoder m_decoder {};
+
     /// Returns MODBUS packet
     std::vector<uint8_t> createPacket(uint8_t t_unit_id, 
         uint8_t t_function_code, const std::vector<uint8_t> &t_data);
 
-    /// Read 16 bit registers; used by FC03 & FC04
-    std::vector<uint16_t> read16BitRegs(uint8_t t_unit_id, 
-        uint8_t t_function_code, uint16_t t_start_addr, uint16_t t_len);
+    /// Returns next complete frame received; valid until the next receive
+    ModbusDecoder::Frame receiveFrame();
+
+    /// Verify unit ID and function code of a response; throws on exception
+    /// responses
+    static void checkResponse(const ModbusDecoder::Frame &t_resp, 
+        uint8_t t_unit_id, uint8_t t_function_code);
 
 };
 
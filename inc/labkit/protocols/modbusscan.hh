@@ -0,0 +1,104 @@
+#ifndef LK_MODBUS_SCAN_HH
+#define LK_MODBUS_SCAN_HH
+
+#include <labkit/protocols/modbus.hh>
+
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace labkit
+{
+
+/** \brief Planner for reading scattered MODBUS registers
+ *
+ *  Points (unit ID, FC03/FC04, address, length) are merged into as few
+ *  register blocks as possible: overlapping and adjacent points are always
+ *  merged, points separated by up to getGapTolerance() unused registers are
+ *  read with a single request as long as the block does not exceed 
+ *  getMaxBlockLen() registers. Registers in forbidden ranges (e.g. addresses
+ *  a device answers with an exception) are never read to bridge a gap.
+ *
+ *  The blocks are read with Modbus::readRegBlocks(), so pipelining of the
+ *  protocol is used, and the registers are returned per point:
+ *
+ *      ModbusScan scan(modbus);
+ *      size_t temp = scan.addPoint(1, Modbus::FC04, 100, 2);
+ *      size_t state = scan.addPoint(1, Modbus::FC03, 7, 1);
+ *      auto values = scan.scan();   // values[temp], values[state]
+ */
+class ModbusScan
+{
+public:
+    ModbusScan() {};
+    ModbusScan(std::shared_ptr<Modbus> t_modbus) : m_modbus(t_modbus) {};
+    ~ModbusScan() {};
+
+    /// Set MODBUS protocol used for scans
+    void setModbus(std::shared_ptr<Modbus> t_modbus) { m_modbus = t_modbus; }
+
+    /// Add point to be read; returns its index in the scan results
+    size_t addPoint(uint8_t t_unit_id, uint8_t t_fcode, uint16_t t_addr, 
+        uint16_t t_len = 1);
+
+    /// Exclude registers from gap bridging (per unit ID and function code)
+    void addForbiddenRange(uint8_t t_unit_id, uint8_t t_fcode, uint16_t t_addr,
+        uint16_t t_len);
+
+    /// Remove all points and forbidden ranges
+    void clear();
+
+    /// Set maximum number of unused registers read to merge two points
+    void setGapTolerance(uint16_t t_gap);
+    /// Returns maximum number of unused registers read to merge two points
+    uint16_t getGapTolerance() const { return m_gap; }
+
+    /// Set maximum registers per request (1 - 125)
+    void setMaxBlockLen(uint16_t t_len);
+    /// Returns maximum registers per request
+    uint16_t getMaxBlockLen() const { return m_max_len; }
+
+    /// Returns register blocks read by scan()
+    const std::vector<Modbus::RegBlock>& getBlocks();
+
+    /// Read all points; returns registers of each point in order of addition
+    std::vector<std::vector<uint16_t>> scan();
+
+    /// Maximum number of registers of FC03/FC04 requests
+    static constexpr uint16_t MAX_REGS = Modbus::MAX_READ_REGS;
+
+private:
+    /// Part of a point contained in a block
+    struct Slice
+    {
+        size_t block;       ///< Block index
+        uint16_t offset;    ///< First register in block
+        uint16_t pos;       ///< First register in point
+        uint16_t len;       ///< Number of registers
+    };
+
+    std::shared_ptr<Modbus> m_modbus {nullptr};
+    uint16_t m_gap {0};
+    uint16_t m_max_len {MAX_REGS};
+
+    std::vector<Modbus::RegBlock> m_points {};
+    /// Forbidden [first, last] ranges per (unit ID, function code)
+    std::map<std::pair<uint8_t, uint8_t>, 
+        std::vector<std::pair<uint32_t, uint32_t>>> m_forbidden {};
+
+    /// Planned blocks and slices of each point; empty if planning is due
+    std::vector<Modbus::RegBlock> m_blocks {};
+    std::vector<std::vector<Slice>> m_slices {};
+    bool m_planned {false};
+
+    /// Merge points into blocks
+    void plan();
+    /// Returns true if a register in [t_first, t_last] is forbidden
+    bool isForbidden(uint8_t t_unit_id, uint8_t t_fcode, uint32_t t_first, 
+        uint32_t t_last) const;
+};
+
+}
+
+#endif
@@ -2,12 +2,18 @@
 #define LK_MODBUS_TCP_HH
 
 #include <labkit/protocols/modbus.hh>
+#include <labkit/protocols/modbusdecoder.hh>
 
 namespace labkit
 {
 
 /** \brief Implementation of MODBUS TCP
  *
+ *  Responses are matched to requests by their transaction ID; responses
+ *  of other transactions (e.g. late responses after a timeout) are dropped.
+ *  readRegBlocks() keeps up to getWindowSize() requests in flight and
+ *  accepts the responses in any order, which is supported by most devices
+ *  and gateways.
  */
 class ModbusTcp : public Modbus
 {
@@ -16,48 +22,50 @@ public:
     ModbusTcp(std::shared_ptr<BasicComm> t_comm) : Modbus(t_comm) {};
     ~ModbusTcp() {};
 
-    /// Function Code 01; read coils -> returns true = on, false = off
-    std::vector<bool> readCoils(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_len) override;
+    /// Read register blocks with up to getWindowSize() outstanding requests
+    std::vector<std::vector<uint16_t>> readRegBlocks(
+        const std::vector<RegBlock>& t_blocks) override;
 
-    /// Function Code 02; read discrete inputs
-    std::vector<bool> readDiscreteInputs(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_len) override;
+    /// Set maximum number of outstanding requests (1 = no pipelining)
+    void setWindowSize(size_t t_size);
+    /// Returns maximum number of outstanding requests
+    size_t getWindowSize() const { return m_window; }
 
-    /// Function Code 03; read multiple holding registers
-    std::vector<uint16_t> readMultipleHoldingRegs(uint8_t t_unit_id, 
-        uint16_t t_addr, uint16_t t_len) override;
+    /// Set response timeout in milliseconds
+    void setTimeout(unsigned t_timeout_ms) { m_timeout_ms = t_timeout_ms; }
 
-    /// Function Code 04; read input registers
-    std::vector<uint16_t> readInputRegs(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_len) override;
+    /// MBAP header length (incl. unit ID)
+    static constexpr size_t MBAP_LEN = 7;
+    /// Maximum length of a MODBUS TCP frame
+    static constexpr size_t MAX_ADU_LEN = 260;
 
-    /// Function Code 05; write single coil -> on = true, off = false
-    void writeSingleCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena) override;
-
-    /// Function Code 06; write single holding register
-    void writeSingleHoldingReg(uint8_t t_unit_id, uint16_t t_addr, 
-        uint16_t t_reg) override;
-
-    /// Function Code 15; write multiple coils -> on = true, off = false
-    void writeMultipleCoils(uint8_t t_unit_id, uint16_t t_addr, 
-        std::vector<bool> t_ena) override;
-
-    /// Function Code 16; write multiple holding registers
-    void writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr, 
-        std::vector<uint16_t> t_regs) override;
+protected:
+    std::vector<uint8_t> transaction(uint8_t t_unit_id, uint8_t t_function_code,
+        const std::vector<uint8_t>& t_data) override;
 
 private:
     /// Transaction ID used by MODBUS TCP
     uint16_t m_tid {0x0000};
-
-    /// Returns MODBUS packet
+    /// Maximum number of outstanding requests
+    size_t m_window {1};
+    /// Response timeout
+    unsigned m_timeout_ms {BasicComm::DFLT_TIMEOUT_MS};
+    /// Frames received; responses may be split or combined by TCP
+    ModbusTcpDecoder m_decoder {};
+
+    /// Returns MODBUS packet with the current transaction ID
     std::vector<uint8_t> createPacket(uint8_t t_unit_id, 
-        uint8_t t_function_code, std::vector<uint8_t> &t_data);
+        uint8_t t_function_code, const std::vector<uint8_t> &t_data);
+
+    /// Send packet and return the response with the same transaction ID
+    ModbusDecoder::Frame exchange(const std::vector<uint8_t> &t_packet);
+
+    /// Returns next complete frame received; valid until the next receive
+    ModbusDecoder::Frame receiveFrame();
 
-    /// Read 16 bit registers; used by FC03 & FC04
-    std::vector<uint16_t> read16BitRegs(uint8_t t_unit_id, 
-        uint8_t t_function_code, uint16_t t_start_addr, uint16_t t_len);
+    /// Check unit ID and function code of a response; throws on exceptions
+    static void checkResponse(const ModbusDecoder::Frame &t_resp, 
+        uint8_t t_unit_id, uint8_t t_function_code);
 
 };
 
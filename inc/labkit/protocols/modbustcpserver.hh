@@ -0,0 +1,267 @@
+#ifndef LK_MODBUS_TCP_SERVER_HH
+#define LK_MODBUS_TCP_SERVER_HH
+
+#include <labkit/protocols/modbus.hh>
+#include <labkit/protocols/modbusdecoder.hh>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace labkit
+{
+
+/** \brief MODBUS TCP server (slave)
+ *
+ *  Serves the MODBUS data model from memory: coils, discrete inputs, holding
+ *  registers and input registers are contiguous tables starting at address
+ *  0, sized with resize(). Function codes 1 - 6, 15, 16 and 23 are supported.
+ *
+ *      ModbusTcpServer server;
+ *      server.resize(ModbusTcpServer::HOLDING_REGS, 1000);
+ *      server.setRegs(ModbusTcpServer::HOLDING_REGS, 0, {1, 2, 3});
+ *      server.listen(1502);
+ *      server.start();
+ *
+ *  A single thread serves all connections with epoll. Clients may send
+ *  several requests without waiting for the responses (pipelining); all
+ *  complete requests received are answered with a single write. If a client
+ *  does not read its responses, no further requests are read from it.
+ *
+ *  Hooks are called with the affected range of a table before a read and
+ *  after a write is applied; they may update or check the data and return
+ *  an exception code to reject the request (a rejected write is undone).
+ *  Hooks run on the server thread while the tables are locked, so they must
+ *  not call the table accessors of the server.
+ */
+class ModbusTcpServer
+{
+public:
+    /// Tables of the MODBUS data model
+    enum Table : uint8_t
+    {
+        COILS,              ///< Read/write bits
+        DISCRETE_INPUTS,    ///< Read-only bits
+        HOLDING_REGS,       ///< Read/write registers
+        INPUT_REGS          ///< Read-only registers
+    };
+
+    /// Range of a table accessed by a request
+    struct Access
+    {
+        uint8_t unit_id;    ///< Unit identifier of the request
+        Table table;        ///< Table
+        uint16_t addr;      ///< Starting address
+        uint16_t len;       ///< Number of registers or bits
+        uint16_t* regs;     ///< Registers of the range; nullptr for bit tables
+        uint8_t* bits;      ///< Bits of the range (one byte per bit, 0/1);
+                            ///< nullptr for register tables
+    };
+
+    /// Hook; returns 0 or a MODBUS exception code (e.g. Modbus::ERR4)
+    using Hook = std::function<uint8_t(const Access& t_access)>;
+
+    /// Server statistics
+    struct Stats
+    {
+        uint64_t requests;      ///< Requests answered
+        uint64_t exceptions;    ///< Exception responses sent
+        uint64_t accepted;      ///< Connections accepted
+        uint64_t rejected;      ///< Connections refused (limit reached or
+                                ///< out of file descriptors)
+        size_t connections;     ///< Open connections
+    };
+
+    ModbusTcpServer() {};
+    /// Destructor; stops the server and closes all connections
+    virtual ~ModbusTcpServer();
+
+    /// No copy constructor; the server owns sockets
+    ModbusTcpServer(const ModbusTcpServer&) = delete;
+    /// No assignment operator; the server owns sockets
+    ModbusTcpServer& operator=(const ModbusTcpServer&) = delete;
+
+    /** \brief Create listening socket
+     *
+     *  \param t_port Port to listen on; 0 = any free port (see getPort())
+     *  \param t_ip_addr IPv4 address of the interface (e.g. "127.0.0.1")
+     */
+    void listen(unsigned t_port = DFLT_PORT, const std::string& t_ip_addr = "0.0.0.0");
+    /// Returns port the server listens on
+    unsigned getPort() const { return m_port; }
+
+    /// Start server thread
+    virtual void start();
+    /// Stop server thread and close all connections
+    virtual void stop();
+    /// Returns true if the server thread is running
+    bool running() const { return m_thread.joinable(); }
+
+    /// Set maximum number of connections; further clients are refused
+    void setMaxConnections(size_t t_max) { m_max_conns = t_max; }
+    /// Returns maximum number of connections
+    size_t getMaxConnections() const { return m_max_conns; }
+
+    /// Serve only requests to this unit ID; 0 = serve all (default)
+    void setUnitId(uint8_t t_unit_id) { m_unit_id = t_unit_id; }
+    /// Returns unit ID served; 0 = all
+    uint8_t getUnitId() const { return m_unit_id; }
+
+    /// Resize table; new entries are 0
+    void resize(Table t_table, size_t t_size);
+    /// Returns size of a table
+    size_t size(Table t_table) const;
+
+    /// Returns registers of a register table
+    std::vector<uint16_t> getRegs(Table t_table, uint16_t t_addr, uint16_t t_len) const;
+    /// Set registers of a register table
+    void setRegs(Table t_table, uint16_t t_addr, const std::vector<uint16_t>& t_regs);
+
+    /// Returns bits of a bit table
+    ModbusBits getBits(Table t_table, uint16_t t_addr, uint16_t t_len) const;
+    /// Set bits of a bit table
+    void setBits(Table t_table, uint16_t t_addr, const ModbusBits& t_bits);
+
+    /// Set hook called before a table range is read
+    void setReadHook(Hook t_hook);
+    /// Set hook called after a table range is written
+    void setWriteHook(Hook t_hook);
+
+    /// Returns server statistics
+    Stats getStats() const;
+
+    /// Default MODBUS TCP port
+    static constexpr unsigned DFLT_PORT = 502;
+    /// Default maximum number of connections
+    static constexpr size_t DFLT_MAX_CONNECTIONS = 4096;
+
+protected:
+    /// Request received; identifies the client for deferred responses
+    struct Request
+    {
+        int fd;             ///< Socket of the connection
+        uint64_t conn_id;   ///< Connection; fds are reused after closing
+        uint16_t tid;       ///< Transaction ID
+        uint8_t unit_id;    ///< Unit identifier
+    };
+
+    /** \brief Process request and append the response PDU
+     *
+     *  Called on the server thread for each request. Requests which cannot
+     *  be answered immediately are answered later with sendResponse().
+     *  \param [in] t_pdu Request PDU starting with the function code
+     *  \param [out] t_resp Response PDU is appended; nothing = no response
+     *      now (none at all or deferred)
+     */
+    virtual void processRequest(const Request& t_req, const uint8_t* t_pdu,
+        size_t t_len, std::vector<uint8_t>& t_resp);
+
+    /** \brief Send response to a deferred request; thread-safe
+     *
+     *  The response is sent by the server thread; it is dropped if the
+     *  server is stopped or the connection has been closed meanwhile.
+     *  \param [in] t_pdu Response PDU starting with the function code
+     */
+    void sendResponse(const Request& t_req, const std::vector<uint8_t>& t_pdu);
+
+private:
+    /// Events handled per epoll_wait()
+    static constexpr int MAX_EVENTS = 256;
+    /// Unsent responses at which no further requests are read
+    static constexpr size_t MAX_TX_BACKLOG = 65536;
+
+    struct Connection
+    {
+        int fd {-1};
+        uint64_t id {0};
+        ModbusTcpDecoder rx {};         ///< Requests received
+        std::vector<uint8_t> tx {};     ///< Responses to send
+        size_t tx_pos {0};              ///< First byte not yet sent
+        uint32_t events {0};            ///< Events registered with epoll
+    };
+
+    int m_listen_fd {-1};
+    int m_epoll_fd {-1};
+    int m_event_fd {-1};                ///< Wakes the server thread
+    int m_reserve_fd {-1};              ///< Spare fd to refuse clients with
+    bool m_accept_paused {false};       ///< Listening socket not polled
+    unsigned m_port {0};
+    std::string m_ip_addr {};
+
+    std::thread m_thread {};
+    std::atomic<bool> m_stop {false};
+    std::atomic<size_t> m_max_conns {DFLT_MAX_CONNECTIONS};
+    std::atomic<uint8_t> m_unit_id {0};
+    std::unordered_map<int, Connection> m_conns {};
+    uint64_t m_next_conn_id {0};
+
+    /// Deferred responses to be sent by the server thread
+    std::vector<std::pair<Request, std::vector<uint8_t>>> m_responses {};
+    std::mutex m_resp_mutex {};
+
+    /// Tables; bits are stored one per byte
+    std::vector<uint8_t> m_bits[2] {};
+    std::vector<uint16_t> m_regs[2] {};
+    Hook m_read_hook {nullptr};
+    Hook m_write_hook {nullptr};
+    mutable std::mutex m_map_mutex {};
+
+    std::atomic<uint64_t> m_requests {0}, m_exceptions {0};
+    std::atomic<uint64_t> m_accepted {0}, m_rejected {0};
+    std::atomic<size_t> m_conn_count {0};
+
+    /// Server thread
+    void run();
+    /// Accept pending connections
+    void acceptConnections();
+    /// Refuse pending connection when out of fds; returns false if none left
+    bool refuseConnection();
+    /// Enable or disable polling of the listening socket
+    void pauseAccept(bool t_pause);
+    /// Read from connection, answer complete requests and send responses
+    void serviceConnection(Connection& t_conn, bool t_readable);
+    /// Answer complete requests received; returns false on framing errors
+    bool processFrames(Connection& t_conn);
+    /// Send pending responses; returns false on errors
+    bool flush(Connection& t_conn);
+    /// Send deferred responses
+    void deliverResponses();
+    /// Set length field of a response frame appended at t_start
+    void finishResponse(Connection& t_conn, size_t t_start);
+    /// Close connection
+    void closeConnection(int t_fd);
+    /// Close all connections and the epoll instance
+    void shutdown();
+
+    /// Read bits (FC01, FC02)
+    uint8_t readBits(uint8_t t_unit_id, Table t_table, const uint8_t* t_pdu,
+        size_t t_len, std::vector<uint8_t>& t_resp);
+    /// Read registers (FC03, FC04)
+    uint8_t readRegs(uint8_t t_unit_id, Table t_table, const uint8_t* t_pdu,
+        size_t t_len, std::vector<uint8_t>& t_resp);
+    /// Write bits (FC05, FC15)
+    uint8_t writeBits(uint8_t t_unit_id, const uint8_t* t_pdu, size_t t_len,
+        std::vector<uint8_t>& t_resp);
+    /// Write registers (FC06, FC16)
+    uint8_t writeRegs(uint8_t t_unit_id, const uint8_t* t_pdu, size_t t_len,
+        std::vector<uint8_t>& t_resp);
+    /// Read/write registers (FC23)
+    uint8_t readWriteRegs(uint8_t t_unit_id, const uint8_t* t_pdu, size_t t_len,
+        std::vector<uint8_t>& t_resp);
+
+    /// Call hook on a range; returns its exception code
+    uint8_t callHook(const Hook& t_hook, uint8_t t_unit_id, Table t_table,
+        uint16_t t_addr, uint16_t t_len);
+    /// Check table type and range; throws on errors
+    void checkRange(Table t_table, bool t_regs, uint16_t t_addr, size_t t_len) const;
+    /// Throw exception with errno information if t_stat < 0
+    void checkAndThrow(int t_stat, const std::string& t_msg) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef LK_MODBUS_WRITE_BATCH_HH
+#define LK_MODBUS_WRITE_BATCH_HH
+
+#include <labkit/protocols/modbus.hh>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace labkit
+{
+
+/** \brief Collects MODBUS writes and combines them into few transactions
+ *
+ *  Holding register and coil writes are collected and, on execute(), sorted
+ *  by unit ID and address. Consecutive registers are written with FC16,
+ *  consecutive coils with FC15 (single ones with FC06/FC05), split at the
+ *  protocol limits. If the same register is written more than once, only
+ *  the last value is sent.
+ *
+ *  Writes are reordered only between barriers: all writes added before a
+ *  barrier() are completed before any write added after it.
+ *
+ *      ModbusWriteBatch batch(modbus);
+ *      for (auto& reg : setup)
+ *          batch.writeReg(1, reg.addr, reg.value);
+ *      batch.barrier();
+ *      batch.writeCoil(1, START, true);
+ *      auto results = batch.execute();
+ *
+ *  Failed transactions do not stop the batch. If a combined write is
+ *  rejected by the device, it is split in halves and retried, so the
+ *  results identify the failing registers.
+ */
+class ModbusWriteBatch
+{
+public:
+    ModbusWriteBatch() {};
+    ModbusWriteBatch(std::shared_ptr<Modbus> t_modbus) : m_modbus(t_modbus) {};
+    ~ModbusWriteBatch() {};
+
+    /// Set MODBUS protocol used for writes
+    void setModbus(std::shared_ptr<Modbus> t_modbus) { m_modbus = t_modbus; }
+
+    /// Add holding register write
+    void writeReg(uint8_t t_unit_id, uint16_t t_addr, uint16_t t_value);
+    /// Add coil write
+    void writeCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena);
+
+    /// Writes added so far are completed before the following ones
+    void barrier();
+
+    /// Remove all pending writes
+    void clear();
+
+    /// Returns number of pending writes
+    size_t size() const { return m_writes.size(); }
+
+    /// Set maximum registers per FC16 request (1 - 123)
+    void setMaxRegs(uint16_t t_len);
+    /// Set maximum coils per FC15 request (1 - 1968)
+    void setMaxCoils(uint16_t t_len);
+
+    /// Result of a single write
+    struct Result
+    {
+        uint8_t unit_id;        ///< Unit identifier
+        bool coil;              ///< true = coil, false = holding register
+        uint16_t addr;          ///< Address
+        bool ok;                ///< true if written successfully
+        std::string error;      ///< Error message if failed
+    };
+
+    /** \brief Write all pending writes and clear the batch
+     *
+     *  Throws BadConnection (and keeps the pending writes) if the connection
+     *  is lost; other errors are reported in the results.
+     *  \return Result of each write, in the order of addition
+     */
+    std::vector<Result> execute();
+
+    /// Returns number of transactions used by the last execute()
+    size_t getTransactions() const { return m_transactions; }
+
+private:
+    struct Write
+    {
+        uint8_t unit_id;
+        bool coil;
+        uint16_t addr;
+        uint16_t value;
+        size_t segment;     ///< Number of barriers before this write
+    };
+
+    std::shared_ptr<Modbus> m_modbus {nullptr};
+    std::vector<Write> m_writes {};
+    size_t m_segment {0};
+    uint16_t m_max_regs {Modbus::MAX_WRITE_REGS};
+    uint16_t m_max_coils {Modbus::MAX_WRITE_BITS};
+    size_t m_transactions {0};
+
+    /// Write consecutive writes [t_first, t_last) with a single request
+    void writeRun(const std::vector<size_t>& t_order, size_t t_first, 
+        size_t t_last, std::vector<Result>& t_results);
+};
+
+}
+
+#endif
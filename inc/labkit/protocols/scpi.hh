@@ -66,7 +66,7 @@ public:
     /// Serivce Request Enable query
     uint8_t getSre();
 
-    /// STatus Byte query
+    /// STatus Byte query; read via control request on USB488 devices
     uint8_t getStb();
 
     /// Self TeST query
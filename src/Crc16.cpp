@@ -0,0 +1,71 @@
+#include <labkit/protocols/crc16.hh>
+
+#include <array>
+
+namespace labkit
+{
+
+namespace
+{
+
+using CrcTables = std::array<std::array<uint16_t, 256>, 8>;
+
+// Table k holds the checksum of a byte followed by k zero bytes, so eight
+// bytes can be processed with one lookup each (slice-by-8)
+constexpr CrcTables generateTables()
+{
+    CrcTables tables {};
+    for (unsigned i = 0; i < 256; i++) {
+        uint16_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x0001) ? ((crc >> 1) ^ Crc16::POLY) : (crc >> 1);
+        tables[0][i] = crc;
+    }
+    for (unsigned i = 0; i < 256; i++)
+        for (unsigned k = 1; k < 8; k++) {
+            uint16_t prev = tables[k-1][i];
+            tables[k][i] = (prev >> 8) ^ tables[0][prev & 0xFF];
+        }
+    return tables;
+}
+
+constexpr CrcTables s_tables = generateTables();
+
+// Check value of CRC-16/MODBUS is 0x4B37 for "123456789"
+constexpr uint16_t checkValue()
+{
+    const char data[] = "123456789";
+    uint16_t crc = Crc16::INIT;
+    for (int i = 0; i < 9; i++)
+        crc = (crc >> 8) ^ s_tables[0][(crc ^ data[i]) & 0xFF];
+    return crc;
+}
+static_assert(checkValue() == 0x4B37, "CRC table generation failed");
+
+}
+
+Crc16& Crc16::update(const uint8_t* t_data, size_t t_len)
+{
+    uint16_t crc = m_crc;
+    while (t_len >= 8) {
+        crc = s_tables[7][(t_data[0] ^ crc) & 0xFF] ^
+              s_tables[6][(t_data[1] ^ (crc >> 8)) & 0xFF] ^
+              s_tables[5][t_data[2]] ^ s_tables[4][t_data[3]] ^
+              s_tables[3][t_data[4]] ^ s_tables[2][t_data[5]] ^
+              s_tables[1][t_data[6]] ^ s_tables[0][t_data[7]];
+        t_data += 8;
+        t_len -= 8;
+    }
+    while (t_len--)
+        crc = (crc >> 8) ^ s_tables[0][(crc ^ *t_data++) & 0xFF];
+    m_crc = crc;
+    return *this;
+}
+
+Crc16& Crc16::update(uint8_t t_byte)
+{
+    m_crc = (m_crc >> 8) ^ s_tables[0][(m_crc ^ t_byte) & 0xFF];
+    return *this;
+}
+
+}
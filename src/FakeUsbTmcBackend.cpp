@@ -0,0 +1,439 @@
+#include <labkit/comms/fakeusbtmcbackend.hh>
+#include <labkit/debug.hh>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+namespace labkit {
+
+// USBTMC/USB488 protocol definitions (device side)
+static constexpr size_t HEADER_LEN = 12;
+static constexpr uint8_t DEV_DEP_MSG_OUT = 0x01;
+static constexpr uint8_t DEV_DEP_MSG_IN = 0x02;
+static constexpr uint8_t VENDOR_SPECIFIC_OUT = 0x7E;
+static constexpr uint8_t VENDOR_SPECIFIC_IN = 0x7F;
+static constexpr uint8_t TRIGGER = 0x80;
+static constexpr uint8_t ATTR_EOM = 0x01;
+static constexpr uint8_t ATTR_TERM_CHAR = 0x02;
+static constexpr uint8_t STATUS_SUCCESS = 0x01;
+
+enum Request : uint8_t {
+    INITIATE_ABORT_BULK_OUT     = 1,
+    CHECK_ABORT_BULK_OUT_STATUS = 2,
+    INITIATE_ABORT_BULK_IN      = 3,
+    CHECK_ABORT_BULK_IN_STATUS  = 4,
+    INITIATE_CLEAR              = 5,
+    CHECK_CLEAR_STATUS          = 6,
+    GET_CAPABILITIES            = 7,
+    INDICATOR_PULSE             = 64,
+    READ_STATUS_BYTE            = 128,
+    REN_CONTROL                 = 160,
+    GO_TO_LOCAL                 = 161,
+    LOCAL_LOCKOUT               = 162
+};
+
+FakeUsbTmcBackend::FakeUsbTmcBackend(Responder t_responder)
+  : m_responder(t_responder)
+{
+    memset(m_ep_desc, 0, sizeof(m_ep_desc));
+    memset(&m_iface_desc, 0, sizeof(m_iface_desc));
+    memset(&m_iface, 0, sizeof(m_iface));
+    memset(&m_cfg, 0, sizeof(m_cfg));
+
+    m_ep_desc[0].bEndpointAddress = EP_BULK_OUT;
+    m_ep_desc[0].bmAttributes = LIBUSB_TRANSFER_TYPE_BULK;
+    m_ep_desc[1].bEndpointAddress = EP_BULK_IN;
+    m_ep_desc[1].bmAttributes = LIBUSB_TRANSFER_TYPE_BULK;
+    m_ep_desc[2].bEndpointAddress = EP_INT_IN;
+    m_ep_desc[2].bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+    m_ep_desc[2].wMaxPacketSize = 8;
+    m_ep_desc[2].bInterval = 1;
+    this->setPacketSize(512);
+
+    m_iface_desc.bInterfaceNumber = 0;
+    m_iface_desc.bNumEndpoints = 3;
+    m_iface_desc.bInterfaceClass = LIBUSB_CLASS_APPLICATION;
+    m_iface_desc.bInterfaceSubClass = 0x03;     // USBTMC
+    m_iface_desc.bInterfaceProtocol = 0x01;     // USB488
+    m_iface_desc.endpoint = m_ep_desc;
+    m_iface.altsetting = &m_iface_desc;
+    m_iface.num_altsetting = 1;
+    m_cfg.bNumInterfaces = 1;
+    m_cfg.bConfigurationValue = 1;
+    m_cfg.interface = &m_iface;
+    return;
+}
+
+int FakeUsbTmcBackend::open(uint16_t t_vid, uint16_t t_pid, const string& t_serno)
+{
+    // Heap buffers only; there is no device memory
+    m_pool = UsbBufferPool::create(NULL);
+    m_open = true;
+    this->reset();
+    DEBUG_PRINT("Opened fake USBTMC device 0x%04X:0x%04X\n", t_vid, t_pid);
+    return LIBUSB_SUCCESS;
+}
+
+void FakeUsbTmcBackend::close()
+{
+    m_pool.reset();
+    m_open = false;
+    m_cur_iface = -1;
+    return;
+}
+
+int FakeUsbTmcBackend::claimInterface(int t_iface)
+{
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (t_iface != 0)
+        return LIBUSB_ERROR_NOT_FOUND;
+    m_cur_iface = t_iface;
+    return LIBUSB_SUCCESS;
+}
+
+int FakeUsbTmcBackend::releaseInterface(int t_iface)
+{
+    if (t_iface != m_cur_iface)
+        return LIBUSB_ERROR_NOT_FOUND;
+    m_cur_iface = -1;
+    return LIBUSB_SUCCESS;
+}
+
+int FakeUsbTmcBackend::setAltSetting(int t_iface, int t_alt)
+{
+    return (t_alt == 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int FakeUsbTmcBackend::getConfigDescriptor(libusb_config_descriptor** t_cfg)
+{
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+    *t_cfg = &m_cfg;
+    return LIBUSB_SUCCESS;
+}
+
+int FakeUsbTmcBackend::controlTransfer(uint8_t t_request_type, uint8_t t_request,
+    uint16_t t_value, uint16_t t_index, uint8_t* t_data, uint16_t t_len,
+    unsigned t_timeout_ms)
+{
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    // Standard requests are accepted, only class requests are emulated
+    uint8_t type = t_request_type & 0x60;
+    if (type == LIBUSB_REQUEST_TYPE_STANDARD)
+        return 0;
+    if (type != LIBUSB_REQUEST_TYPE_CLASS)
+        return LIBUSB_ERROR_PIPE;
+
+    uint8_t resp[24] = {0x00};
+    resp[0] = STATUS_SUCCESS;
+    size_t len = 1;
+    switch (t_request)
+    {
+        case INITIATE_ABORT_BULK_OUT:
+        resp[1] = m_out_tag;
+        m_msg_out.clear();
+        m_out_left = m_out_pad = 0;
+        len = 2;
+        break;
+
+        case INITIATE_ABORT_BULK_IN:
+        resp[1] = m_req_tag;
+        m_req_pending = false;
+        m_in_data.clear();
+        m_in_pos = 0;
+        m_in_zlp = false;
+        len = 2;
+        break;
+
+        case CHECK_ABORT_BULK_OUT_STATUS:
+        case CHECK_ABORT_BULK_IN_STATUS:
+        len = 8;    // Nothing left in the FIFOs
+        break;
+
+        case INITIATE_CLEAR:
+        this->reset();
+        break;
+
+        case CHECK_CLEAR_STATUS:
+        len = 2;
+        break;
+
+        case GET_CAPABILITIES:
+        resp[3] = 0x01;     // bcdUSBTMC 1.00
+        resp[5] = 0x01;     // TermChar supported
+        resp[13] = 0x01;    // bcdUSB488 1.00
+        resp[14] = 0x07;    // USB488.2, REN_CONTROL/GO_TO_LOCAL, TRIGGER
+        resp[15] = 0x0F;    // SCPI, SR1, RL1, DT1
+        len = 24;
+        break;
+
+        case READ_STATUS_BYTE:
+        // Status byte is sent on the interrupt endpoint
+        resp[1] = t_value & 0x7F;
+        m_notifications.push_back( {uint8_t(0x80 | resp[1]), m_stb} );
+        len = 3;
+        break;
+
+        case INDICATOR_PULSE:
+        case REN_CONTROL:
+        case GO_TO_LOCAL:
+        case LOCAL_LOCKOUT:
+        break;
+
+        default:
+        return LIBUSB_ERROR_PIPE;
+    }
+
+    len = min(len, (size_t)t_len);
+    if (t_data)
+        memcpy(t_data, resp, len);
+    return len;
+}
+
+int FakeUsbTmcBackend::bulkTransfer(uint8_t t_ep_addr, uint8_t* t_data,
+    int t_len, int* t_transferred, unsigned t_timeout_ms)
+{
+    *t_transferred = 0;
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (m_latency.count() > 0)
+        this_thread::sleep_for(m_latency);
+
+    if (t_ep_addr == EP_BULK_OUT)
+        return this->bulkOut(t_data, t_len, t_transferred);
+    if (t_ep_addr == EP_BULK_IN)
+        return this->bulkIn(t_data, t_len, t_transferred);
+    return LIBUSB_ERROR_PIPE;
+}
+
+int FakeUsbTmcBackend::interruptTransfer(uint8_t t_ep_addr, uint8_t* t_data,
+    int t_len, int* t_transferred, unsigned t_timeout_ms)
+{
+    *t_transferred = 0;
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (t_ep_addr != EP_INT_IN)
+        return LIBUSB_ERROR_PIPE;
+    if (m_notifications.empty())
+        return LIBUSB_ERROR_TIMEOUT;
+
+    vector<uint8_t>& pkt = m_notifications.front();
+    *t_transferred = min((size_t)t_len, pkt.size());
+    memcpy(t_data, pkt.data(), *t_transferred);
+    m_notifications.pop_front();
+    return LIBUSB_SUCCESS;
+}
+
+int FakeUsbTmcBackend::clearHalt(uint8_t t_ep_addr)
+{
+    return m_open ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+void FakeUsbTmcBackend::setPacketSize(uint16_t t_size)
+{
+    m_ep_desc[0].wMaxPacketSize = t_size;
+    m_ep_desc[1].wMaxPacketSize = t_size;
+    return;
+}
+
+void FakeUsbTmcBackend::notifyServiceRequest(uint8_t t_stb)
+{
+    m_notifications.push_back( {0x81, t_stb} );
+    return;
+}
+
+/*
+ *      P R I V A T E   M E T H O D S
+ */
+
+int FakeUsbTmcBackend::bulkOut(const uint8_t* t_data, int t_len,
+    int* t_transferred)
+{
+    size_t pos = 0, len = t_len;
+    while (pos < len) {
+        // Every transfer starts with a header
+        if ( (m_out_left == 0) && (m_out_pad == 0) ) {
+            if (len - pos < HEADER_LEN)
+                return LIBUSB_ERROR_PIPE;
+            const uint8_t* hdr = t_data + pos;
+            uint8_t tag = hdr[1];
+            if ( (tag == 0x00) || (hdr[2] != uint8_t(~tag)) ) {
+                DEBUG_PRINT("Fake USBTMC: invalid bTag 0x%02X/0x%02X\n",
+                    hdr[1], hdr[2]);
+                return LIBUSB_ERROR_PIPE;
+            }
+            size_t size = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16)
+                | ((uint32_t)hdr[7] << 24);
+            pos += HEADER_LEN;
+
+            switch (hdr[0])
+            {
+                case DEV_DEP_MSG_OUT:
+                case VENDOR_SPECIFIC_OUT:
+                m_out_msg_id = hdr[0];
+                m_out_tag = tag;
+                m_out_eom = (hdr[0] == DEV_DEP_MSG_OUT) && (hdr[8] & ATTR_EOM);
+                m_out_left = size;
+                m_out_pad = (4 - (HEADER_LEN + size) % 4) % 4;
+                if ( (m_out_left == 0) && (m_out_pad == 0) )
+                    this->completeOut();
+                break;
+
+                case TRIGGER:
+                m_trigger_count++;
+                break;
+
+                case DEV_DEP_MSG_IN:        // REQUEST_DEV_DEP_MSG_IN
+                case VENDOR_SPECIFIC_IN:    // REQUEST_VENDOR_SPECIFIC_IN
+                m_req_pending = true;
+                m_req_tag = tag;
+                m_req_msg_id = hdr[0];
+                m_req_size = size;
+                m_req_attr = (hdr[0] == DEV_DEP_MSG_IN) ? hdr[8] : 0x00;
+                m_req_term_char = hdr[9];
+                break;
+
+                default:
+                return LIBUSB_ERROR_PIPE;
+            }
+            continue;
+        }
+
+        // Payload and alignment bytes
+        size_t nbytes = min(len - pos, m_out_left);
+        if (m_out_msg_id == DEV_DEP_MSG_OUT)
+            m_msg_out.append((const char*)t_data + pos, nbytes);
+        pos += nbytes;
+        m_out_left -= nbytes;
+        nbytes = min(len - pos, m_out_pad);
+        pos += nbytes;
+        m_out_pad -= nbytes;
+        if ( (m_out_left == 0) && (m_out_pad == 0) )
+            this->completeOut();
+    }
+    *t_transferred = t_len;
+    m_bytes_out += t_len;
+    return LIBUSB_SUCCESS;
+}
+
+int FakeUsbTmcBackend::bulkIn(uint8_t* t_data, int t_len, int* t_transferred)
+{
+    if (m_in_pos >= m_in_data.size()) {
+        // Zero length packet ending the previous transfer
+        if (m_in_zlp) {
+            m_in_zlp = false;
+            *t_transferred = 0;
+            return LIBUSB_SUCCESS;
+        }
+        if (!this->prepareIn())
+            return LIBUSB_ERROR_TIMEOUT;    // Nothing to send; device NAKs
+    }
+
+    // Data is sent in packets; the last one must fit into the read
+    size_t packet = m_ep_desc[1].wMaxPacketSize;
+    size_t left = m_in_data.size() - m_in_pos;
+    if ( (left > (size_t)t_len) && (t_len % packet != 0) )
+        return LIBUSB_ERROR_OVERFLOW;
+
+    size_t nbytes = min((size_t)t_len, left);
+    if (m_max_xfer_size > 0)
+        nbytes = min(nbytes, m_max_xfer_size);
+    memcpy(t_data, m_in_data.data() + m_in_pos, nbytes);
+    m_in_pos += nbytes;
+    *t_transferred = nbytes;
+    m_bytes_in += nbytes;
+
+    // A read longer than the rest of the transfer ends with its short or
+    // zero length packet; without one, the host waits for more data like
+    // on real hardware
+    if ( (m_in_pos == m_in_data.size()) && (nbytes < (size_t)t_len) ) {
+        if ( !m_in_zlp && (m_in_data.size() % packet == 0) )
+            return LIBUSB_ERROR_TIMEOUT;
+        m_in_zlp = false;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void FakeUsbTmcBackend::completeOut()
+{
+    if ( (m_out_msg_id != DEV_DEP_MSG_OUT) || !m_out_eom )
+        return;
+    m_msg_count++;
+    m_response += m_responder ? m_responder(m_msg_out)
+        : defaultResponse(m_msg_out);
+    m_msg_out.clear();
+    return;
+}
+
+bool FakeUsbTmcBackend::prepareIn()
+{
+    if (!m_req_pending)
+        return false;
+
+    // Vendor specific requests are answered with an empty message
+    size_t size = 0;
+    uint8_t attr = ATTR_EOM;
+    if (m_req_msg_id == DEV_DEP_MSG_IN) {
+        if (m_response.empty())
+            return false;
+        size = min(m_req_size, m_response.size());
+        if (m_req_attr & ATTR_TERM_CHAR) {
+            size_t term = m_response.find((char)m_req_term_char);
+            if ( (term != string::npos) && (term < size) )
+                size = term + 1;
+        }
+        attr = (size == m_response.size()) ? ATTR_EOM : 0x00;
+    }
+
+    m_in_data.assign(HEADER_LEN + size + (4 - size % 4) % 4, 0x00);
+    m_in_data[0] = (m_req_msg_id == DEV_DEP_MSG_IN) ? DEV_DEP_MSG_IN
+        : VENDOR_SPECIFIC_IN;
+    m_in_data[1] = m_req_tag;
+    m_in_data[2] = ~m_req_tag;
+    m_in_data[4] = 0xFF & size;
+    m_in_data[5] = 0xFF & (size >> 8);
+    m_in_data[6] = 0xFF & (size >> 16);
+    m_in_data[7] = 0xFF & (size >> 24);
+    m_in_data[8] = attr;
+    copy(m_response.begin(), m_response.begin() + size,
+        m_in_data.begin() + HEADER_LEN);
+    m_response.erase(0, size);
+    m_in_pos = 0;
+    m_req_pending = false;
+
+    // Transfers shorter than requested end with a short packet; a zero
+    // length packet is sent if they end on a packet boundary
+    size_t packet = m_ep_desc[1].wMaxPacketSize;
+    m_in_zlp = (size < m_req_size) && (m_in_data.size() % packet == 0);
+    return true;
+}
+
+void FakeUsbTmcBackend::reset()
+{
+    m_msg_out.clear();
+    m_out_left = m_out_pad = 0;
+    m_req_pending = false;
+    m_response.clear();
+    m_in_data.clear();
+    m_in_pos = 0;
+    m_in_zlp = false;
+    m_notifications.clear();
+    return;
+}
+
+string FakeUsbTmcBackend::defaultResponse(const string& t_msg)
+{
+    if (t_msg.compare(0, 5, "*IDN?") == 0)
+        return "LABKIT,FAKE-USBTMC,0,1.0\n";
+    if (t_msg.find('?') != string::npos)
+        return t_msg;
+    return "";
+}
+
+}
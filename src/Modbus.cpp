@@ -1,28 +1,379 @@
 #include <labkit/protocols/modbus.hh>
 #include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace labkit
 {
 
+/*
+ *      M O D B U S   B I T S
+ */
+
+ModbusBits::ModbusBits(const uint8_t* t_packed, size_t t_len) :
+    m_bytes(t_packed, t_packed + (t_len + 7) / 8), m_len(t_len)
+{
+    // Unused bits of the last byte are undefined in responses
+    if (m_len % 8)
+        m_bytes.back() &= (1 << (m_len % 8)) - 1;
+}
+
+ModbusBits::ModbusBits(const std::vector<bool>& t_bits) : 
+    ModbusBits(t_bits.size())
+{
+    for (size_t i = 0; i < t_bits.size(); i++)
+        if (t_bits[i])
+            m_bytes[i >> 3] |= 1 << (i & 0x07);
+}
+
+bool ModbusBits::test(size_t t_pos) const
+{
+    if (t_pos >= m_len)
+        throw BadIo("Bit " + std::to_string(t_pos) + " out of range (" 
+            + std::to_string(m_len) + " bits)");
+    return (*this)[t_pos];
+}
+
+void ModbusBits::set(size_t t_pos, bool t_ena)
+{
+    if (t_pos >= m_len)
+        throw BadIo("Bit " + std::to_string(t_pos) + " out of range (" 
+            + std::to_string(m_len) + " bits)");
+    if (t_ena)
+        m_bytes[t_pos >> 3] |= 1 << (t_pos & 0x07);
+    else
+        m_bytes[t_pos >> 3] &= ~(1 << (t_pos & 0x07));
+    return;
+}
+
+size_t ModbusBits::count() const
+{
+    size_t ret = 0;
+    for (uint8_t byte : m_bytes)
+        ret += __builtin_popcount(byte);
+    return ret;
+}
+
+std::vector<bool> ModbusBits::toVector() const
+{
+    std::vector<bool> ret(m_len);
+    for (size_t i = 0; i < m_len; i++)
+        ret[i] = (*this)[i];
+    return ret;
+}
+
+/*
+ *      M O D B U S
+ */
+
+ModbusBits Modbus::readCoils(uint8_t t_unit_id, uint16_t t_addr, uint16_t t_len)
+{
+    return this->readBits(t_unit_id, FC01, t_addr, t_len);
+}
+
+ModbusBits Modbus::readDiscreteInputs(uint8_t t_unit_id, uint16_t t_addr, 
+    uint16_t t_len)
+{
+    return this->readBits(t_unit_id, FC02, t_addr, t_len);
+}
+
+std::vector<uint16_t> Modbus::readMultipleHoldingRegs(uint8_t t_unit_id, 
+    uint16_t t_addr, uint16_t t_len)
+{
+    return this->read16BitRegs(t_unit_id, FC03, t_addr, t_len);
+}
+
+std::vector<uint16_t> Modbus::readInputRegs(uint8_t t_unit_id, 
+    uint16_t t_addr, uint16_t t_len)
+{
+    return this->read16BitRegs(t_unit_id, FC04, t_addr, t_len);
+}
+
+void Modbus::writeSingleCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena)
+{
+    uint16_t value = t_ena ? 0xFF00 : 0x0000;
+    std::vector<uint8_t> data {
+        static_cast<uint8_t>(0xFF & (t_addr >> 8)),
+        static_cast<uint8_t>(0xFF & t_addr),
+        static_cast<uint8_t>(0xFF & (value >> 8)),
+        static_cast<uint8_t>(0xFF & value)
+    };
+
+    DEBUG_PRINT("Writing coil %s at address 0x%04X (unit_id=%u)\n",
+        t_ena ? "on" : "off", t_addr, t_unit_id);
+
+    auto resp = this->transaction(t_unit_id, FC05, data);
+    checkEcho(resp, t_addr, value);
+    return;
+}
+
+void Modbus::writeSingleHoldingReg(uint8_t t_unit_id, uint16_t t_addr, 
+    uint16_t t_reg)
+{
+    std::vector<uint8_t> data {
+        static_cast<uint8_t>(0xFF & (t_addr >> 8)),
+        static_cast<uint8_t>(0xFF & t_addr),
+        static_cast<uint8_t>(0xFF & (t_reg >> 8)),
+        static_cast<uint8_t>(0xFF & t_reg)
+    };
+
+    DEBUG_PRINT("Writing 0x%04X to address 0x%04X (unit_id=%u)\n",
+        t_reg, t_addr, t_unit_id);
+
+    auto resp = this->transaction(t_unit_id, FC06, data);
+    checkEcho(resp, t_addr, t_reg);
+    return;
+}
+
+void Modbus::writeMultipleCoils(uint8_t t_unit_id, uint16_t t_addr, 
+    const ModbusBits& t_ena)
+{
+    if ( t_ena.empty() || (t_ena.size() > MAX_WRITE_BITS) )
+        throw BadProtocol("Quantity of coils not supported (range 1 - "
+            + std::to_string(MAX_WRITE_BITS) + ")");
+    uint16_t len = t_ena.size();
+    std::vector<uint8_t> data {
+        static_cast<uint8_t>(0xFF & (t_addr >> 8)),     // Starting address
+        static_cast<uint8_t>(0xFF & t_addr),
+        static_cast<uint8_t>(0xFF & (len >> 8)),        // Number of coils
+        static_cast<uint8_t>(0xFF & len),
+        static_cast<uint8_t>(t_ena.bytes().size())      // Number of bytes
+    };
+    data.insert(data.end(), t_ena.bytes().begin(), t_ena.bytes().end());
+
+    DEBUG_PRINT("Writing %u coils with starting address 0x%04X (unit_id=%u)\n",
+        len, t_addr, t_unit_id);
+
+    auto resp = this->transaction(t_unit_id, FC15, data);
+    checkEcho(resp, t_addr, len);
+    return;
+}
+
+void Modbus::writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr, 
+    std::vector<uint16_t> t_regs)
+{
+    if ( t_regs.empty() || (t_regs.size() > MAX_WRITE_REGS) )
+        throw BadProtocol("Quantity of registers not supported (range 1 - "
+            + std::to_string(MAX_WRITE_REGS) + ")");
+    uint16_t len = t_regs.size();
+    std::vector<uint8_t> data;
+    data.reserve(5 + 2*len);
+    data.push_back(static_cast<uint8_t>(0xFF & (t_addr >> 8)));   // Starting register
+    data.push_back(static_cast<uint8_t>(0xFF & t_addr));          // address
+    data.push_back(static_cast<uint8_t>(0xFF & (len >> 8)));    // Number of registers
+    data.push_back(static_cast<uint8_t>(0xFF & len));
+    data.push_back(static_cast<uint8_t>(0xFF & 2*len));         // Number of bytes
+    for (unsigned i = 0; i < len; i++) {
+        data.push_back(static_cast<uint8_t>(0xFF & (t_regs[i] >> 8)));
+        data.push_back(static_cast<uint8_t>(0xFF & t_regs[i]));
+    }
+
+    DEBUG_PRINT("Writing %u registers with starting address 0x%04X "
+        "(unit_id=%u)\n", len, t_addr, t_unit_id);
+
+    auto resp = this->transaction(t_unit_id, FC16, data);
+    checkEcho(resp, t_addr, len);
+    return;
+}
+
+std::vector<uint16_t> Modbus::readWriteMultipleRegs(uint8_t t_unit_id, 
+    uint16_t t_read_addr, uint16_t t_read_len, uint16_t t_write_addr,
+    const std::vector<uint16_t>& t_regs)
+{
+    if ( (t_read_len == 0) || (t_read_len > MAX_READ_REGS) )
+        throw BadProtocol("Quantity of registers to read not supported "
+            "(range 1 - " + std::to_string(MAX_READ_REGS) + ")");
+    if ( t_regs.empty() || (t_regs.size() > MAX_RW_WRITE_REGS) )
+        throw BadProtocol("Quantity of registers to write not supported "
+            "(range 1 - " + std::to_string(MAX_RW_WRITE_REGS) + ")");
+    uint16_t write_len = t_regs.size();
+    std::vector<uint8_t> data;
+    data.reserve(9 + 2*write_len);
+    data.push_back(static_cast<uint8_t>(0xFF & (t_read_addr >> 8)));  // Read
+    data.push_back(static_cast<uint8_t>(0xFF & t_read_addr));
+    data.push_back(static_cast<uint8_t>(0xFF & (t_read_len >> 8)));
+    data.push_back(static_cast<uint8_t>(0xFF & t_read_len));
+    data.push_back(static_cast<uint8_t>(0xFF & (t_write_addr >> 8))); // Write
+    data.push_back(static_cast<uint8_t>(0xFF & t_write_addr));
+    data.push_back(static_cast<uint8_t>(0xFF & (write_len >> 8)));
+    data.push_back(static_cast<uint8_t>(0xFF & write_len));
+    data.push_back(static_cast<uint8_t>(0xFF & 2*write_len));     // Number of bytes
+    for (uint16_t reg : t_regs) {
+        data.push_back(static_cast<uint8_t>(0xFF & (reg >> 8)));
+        data.push_back(static_cast<uint8_t>(0xFF & reg));
+    }
+
+    DEBUG_PRINT("Writing %u registers at 0x%04X, reading %u registers at "
+        "0x%04X (unit_id=%u)\n", write_len, t_write_addr, t_read_len, 
+        t_read_addr, t_unit_id);
+
+    auto resp = this->transaction(t_unit_id, FC23, data);
+    return decodeRegs(resp.data(), resp.size(), t_read_len);
+}
+
+std::vector<std::vector<uint16_t>> Modbus::readRegBlocks(
+    const std::vector<RegBlock>& t_blocks)
+{
+    std::vector<std::vector<uint16_t>> ret;
+    ret.reserve(t_blocks.size());
+    for (const auto& block : t_blocks) {
+        if (block.fcode == FC03)
+            ret.push_back(this->readMultipleHoldingRegs(block.unit_id, 
+                block.addr, block.len));
+        else if (block.fcode == FC04)
+            ret.push_back(this->readInputRegs(block.unit_id, block.addr, 
+                block.len));
+        else
+            throw BadProtocol("Function code " + std::to_string(block.fcode)
+                + " not supported for register blocks");
+    }
+    return ret;
+}
+
+void Modbus::broadcast(uint8_t t_function_code, const std::vector<uint8_t>& t_data)
+{
+    if ( (t_function_code != FC05) && (t_function_code != FC06) &&
+         (t_function_code != FC15) && (t_function_code != FC16) )
+        throw BadProtocol("Function code " + std::to_string(t_function_code)
+            + " cannot be broadcast");
+
+    DEBUG_PRINT("Broadcasting function code 0x%02X\n", t_function_code);
+    this->send(BROADCAST_ID, t_function_code, t_data);
+    return;
+}
+
+/*
+ *  P R O T E C T E D   M E T H O D S
+ */
+
+void Modbus::send(uint8_t t_unit_id, uint8_t t_function_code,
+    const std::vector<uint8_t>& t_data)
+{
+    throw BadProtocol("Requests without response are not supported by the protocol");
+}
+
 void Modbus::checkAndThrow(uint8_t error)
 {
     switch (error) {
     case ERR1:
-        throw BadProtocol("Function code not supported");
+        throw BadProtocol("Function code not supported", error);
         break;
     case ERR2:
-        throw BadProtocol("Starting address or last address not supported");
+        throw BadProtocol("Starting address or last address not supported", error);
         break;
     case ERR3:
-        throw BadProtocol("Quantity of registers not supported (range 1 - 125)");
+        throw BadProtocol("Quantity of registers not supported (range 1 - 125)", error);
         break;
     case ERR4:
-        throw BadProtocol("No read access to registers");
+        throw BadProtocol("No read access to registers", error);
+        break;
+    case ERR10:
+        throw BadProtocol("Gateway path unavailable", error);
+        break;
+    case ERR11:
+        throw BadProtocol("Gateway target device failed to respond", error);
         break;
     default:
-        throw BadProtocol("Unknown error code " + std::to_string(error));
+        throw BadProtocol("Unknown error code " + std::to_string(error), error);
     }
     return; 
 }    
 
+std::vector<uint16_t> Modbus::decodeRegs(const uint8_t* t_data, size_t t_size,
+    uint16_t t_len)
+{
+    size_t received_bytes = (t_size > 0) ? t_data[0] : 0;
+    if ( (received_bytes != 2u*t_len) || (t_size < 1 + received_bytes) )
+        throw BadProtocol("MODBUS response with " + std::to_string(received_bytes)
+            + " data bytes (expected " + std::to_string(2*t_len) + ")");
+
+    // Create 16-bit return vector
+    std::vector<uint16_t> ret(t_len);
+    unpackRegs(t_data + 1, ret.data(), t_len);
+
+    return ret;
+}
+
+void Modbus::unpackRegs(const uint8_t* t_data, uint16_t* t_regs, size_t t_len)
+{
+    size_t i = 0;
+#if defined(__SSE2__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    // 8 registers at once: swap the bytes of each 16 bit lane
+    for ( ; i + 8 <= t_len; i += 8) {
+        __m128i regs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t_data + 2*i));
+        regs = _mm_or_si128(_mm_slli_epi16(regs, 8), _mm_srli_epi16(regs, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(t_regs + i), regs);
+    }
+#elif defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    for ( ; i + 8 <= t_len; i += 8)
+        vst1q_u8(reinterpret_cast<uint8_t*>(t_regs + i), vrev16q_u8(vld1q_u8(t_data + 2*i)));
+#endif
+    for ( ; i < t_len; i++)
+        t_regs[i] = (t_data[2*i] << 8) | t_data[2*i + 1];
+    return;
+}
+
+/*
+ *  P R I V A T E   M E T H O D S
+ */
+
+std::vector<uint16_t> Modbus::read16BitRegs(uint8_t t_unit_id, 
+    uint8_t t_function_code, uint16_t t_start_addr, uint16_t t_len)
+{
+    std::vector<uint8_t> data {
+        static_cast<uint8_t>(0xFF & (t_start_addr >> 8)),
+        static_cast<uint8_t>(0xFF & t_start_addr),
+        static_cast<uint8_t>(0xFF & (t_len >> 8)),
+        static_cast<uint8_t>(0xFF & t_len)
+    };
+
+    DEBUG_PRINT("Reading %u registers with starting address 0x%04X "
+        "(unit_id=%u)\n", t_len, t_start_addr, t_unit_id);
+
+    auto resp = this->transaction(t_unit_id, t_function_code, data);
+    return decodeRegs(resp.data(), resp.size(), t_len);
+}
+
+ModbusBits Modbus::readBits(uint8_t t_unit_id, uint8_t t_function_code, 
+    uint16_t t_start_addr, uint16_t t_len)
+{
+    if ( (t_len == 0) || (t_len > MAX_READ_BITS) )
+        throw BadProtocol("Quantity of bits not supported (range 1 - "
+            + std::to_string(MAX_READ_BITS) + ")");
+    std::vector<uint8_t> data {
+        static_cast<uint8_t>(0xFF & (t_start_addr >> 8)),
+        static_cast<uint8_t>(0xFF & t_start_addr),
+        static_cast<uint8_t>(0xFF & (t_len >> 8)),
+        static_cast<uint8_t>(0xFF & t_len)
+    };
+
+    DEBUG_PRINT("Reading %u bits with starting address 0x%04X "
+        "(unit_id=%u)\n", t_len, t_start_addr, t_unit_id);
+
+    auto resp = this->transaction(t_unit_id, t_function_code, data);
+
+    // Packed bits are used as received
+    size_t bytes = (t_len + 7) / 8;
+    if ( resp.empty() || (resp[0] != bytes) || (resp.size() < 1 + bytes) )
+        throw BadProtocol("MODBUS response with " 
+            + std::to_string(resp.empty() ? 0 : resp[0]) 
+            + " data bytes (expected " + std::to_string(bytes) + ")");
+    return ModbusBits(resp.data() + 1, t_len);
+}
+
+void Modbus::checkEcho(const std::vector<uint8_t>& t_resp, uint16_t t_addr, 
+    uint16_t t_value)
+{
+    if ( (t_resp.size() < 4) || 
+         (((t_resp[0] << 8) | t_resp[1]) != t_addr) || 
+         (((t_resp[2] << 8) | t_resp[3]) != t_value) )
+        throw BadProtocol("MODBUS write response does not match request");
+    return;
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,160 @@
+#include <labkit/protocols/modbusdecoder.hh>
+#include <labkit/protocols/modbus.hh>
+#include <labkit/protocols/crc16.hh>
+#include <labkit/exceptions.hh>
+
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+namespace labkit
+{
+
+/*
+ *      M O D B U S   D E C O D E R
+ */
+
+ModbusDecoder::ModbusDecoder(size_t t_max_frame, size_t t_capacity) :
+    m_capacity(t_capacity), m_max_frame(t_max_frame)
+{
+    if (m_capacity < 2 * m_max_frame)
+        throw BadProtocol("Decoder buffer of " + to_string(t_capacity)
+            + " bytes is smaller than two frames");
+    m_buf.reset(new uint8_t[m_capacity]);
+}
+
+uint8_t* ModbusDecoder::prepare(size_t& t_space)
+{
+    // Move the remaining bytes to the front if a frame may not fit
+    if (m_head == m_tail) {
+        m_head = m_tail = 0;
+    } else if ( (m_capacity - m_tail < m_max_frame) && (m_head > 0) ) {
+        memmove(m_buf.get(), m_buf.get() + m_head, m_tail - m_head);
+        m_tail -= m_head;
+        m_head = 0;
+    }
+    t_space = m_capacity - m_tail;
+    return m_buf.get() + m_tail;
+}
+
+void ModbusDecoder::commit(size_t t_len)
+{
+    if (t_len > m_capacity - m_tail)
+        throw BadIo("Decoder buffer overflow (" + to_string(t_len) + " bytes)");
+    m_tail += t_len;
+    return;
+}
+
+size_t ModbusDecoder::feed(const uint8_t* t_data, size_t t_len)
+{
+    size_t space;
+    uint8_t* buf = this->prepare(space);
+    size_t len = (t_len < space) ? t_len : space;
+    memcpy(buf, t_data, len);
+    m_tail += len;
+    return len;
+}
+
+bool ModbusDecoder::next(Frame& t_frame)
+{
+    if (m_head == m_tail)
+        return false;
+    const uint8_t* data = m_buf.get() + m_head;
+    size_t len = this->frameLength(data, this->size());
+    if (len > m_max_frame) {
+        this->drop(1);
+        throw BadProtocol("MODBUS frame too long (" + to_string(len) + " bytes)");
+    }
+    if ( (len == 0) || (len > this->size()) )
+        return false;
+    if (!this->checkFrame(data, len)) {
+        this->drop(1);
+        throw BadProtocol("MODBUS frame with invalid checksum");
+    }
+
+    m_head += len;
+    t_frame = Frame {data, len};
+    return true;
+}
+
+/*
+ *      M O D B U S   T C P   D E C O D E R
+ */
+
+size_t ModbusTcpDecoder::frameLength(const uint8_t* t_data, size_t t_len)
+{
+    if (t_len < 7)
+        return 0;
+
+    // Length field counts unit ID and PDU
+    size_t len = 6 + ((t_data[4] << 8) | t_data[5]);
+    if ( (t_data[2] != 0x00) || (t_data[3] != 0x00) || (len < 8) 
+         || (len > MAX_FRAME) ) {
+        this->clear();  // Stream out of sync
+        throw BadProtocol("Invalid MBAP header");
+    }
+    return len;
+}
+
+/*
+ *      M O D B U S   R T U   D E C O D E R
+ */
+
+size_t ModbusRtuDecoder::frameLength(const uint8_t* t_data, size_t t_len)
+{
+    if (t_len < 2)
+        return 0;
+    uint8_t fcode = t_data[1];
+    size_t crc_len = m_crc ? 2 : 0;
+
+    if (m_dir == RESPONSES) {
+        if (fcode & Modbus::ERRC)
+            return 3 + crc_len;     // Exception code
+        switch (fcode) {
+        case Modbus::FC01:
+        case Modbus::FC02:
+        case Modbus::FC03:
+        case Modbus::FC04:
+        case Modbus::FC23:
+            return (t_len < 3) ? 0 : 3 + t_data[2] + crc_len;  // Byte count
+        case Modbus::FC05:
+        case Modbus::FC06:
+        case Modbus::FC15:
+        case Modbus::FC16:
+            return 6 + crc_len;     // Echo of address and value/quantity
+        default:
+            break;
+        }
+    } else {
+        switch (fcode) {
+        case Modbus::FC01:
+        case Modbus::FC02:
+        case Modbus::FC03:
+        case Modbus::FC04:
+        case Modbus::FC05:
+        case Modbus::FC06:
+            return 6 + crc_len;
+        case Modbus::FC15:
+        case Modbus::FC16:
+            return (t_len < 7) ? 0 : 7 + t_data[6] + crc_len;
+        case Modbus::FC23:
+            return (t_len < 11) ? 0 : 11 + t_data[10] + crc_len;
+        default:
+            break;
+        }
+    }
+
+    // Not a frame start; resynchronize at the next byte
+    this->drop(1);
+    throw BadProtocol("MODBUS RTU frame with unsupported function code " 
+        + to_string(fcode));
+}
+
+bool ModbusRtuDecoder::checkFrame(const uint8_t* t_data, size_t t_len) const
+{
+    // The CRC over the whole frame incl. its CRC is zero
+    return !m_crc || (Crc16::calc(t_data, t_len) == 0);
+}
+
+}
@@ -0,0 +1,270 @@
+#include <labkit/protocols/modbusgateway.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+using namespace std;
+
+namespace labkit
+{
+
+ModbusGateway::~ModbusGateway()
+{
+    this->stop();
+    return;
+}
+
+void ModbusGateway::start()
+{
+    if (!m_modbus)
+        throw BadProtocol("No MODBUS protocol set for the gateway");
+    ModbusTcpServer::start();
+    if (!m_bus_thread.joinable()) {
+        m_bus_stop = false;
+        m_bus_thread = thread(&ModbusGateway::run, this);
+    }
+    return;
+}
+
+void ModbusGateway::stop()
+{
+    // Finish the transaction on the bus, then close the connections
+    if (m_bus_thread.joinable()) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_bus_stop = true;
+        }
+        m_cv.notify_all();
+        m_bus_thread.join();
+    }
+    ModbusTcpServer::stop();
+
+    lock_guard<mutex> lock(m_mutex);
+    m_queue.clear();
+    m_pending.clear();
+    return;
+}
+
+void ModbusGateway::setCacheTime(chrono::milliseconds t_time)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_cache_time = t_time;
+    if (t_time.count() <= 0)
+        m_cache.clear();
+    return;
+}
+
+chrono::milliseconds ModbusGateway::getCacheTime() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return chrono::duration_cast<chrono::milliseconds>(m_cache_time);
+}
+
+void ModbusGateway::setMaxQueue(size_t t_max)
+{
+    if (t_max == 0)
+        throw BadProtocol("Queue size must be at least 1");
+    lock_guard<mutex> lock(m_mutex);
+    m_max_queue = t_max;
+    return;
+}
+
+ModbusGateway::Stats ModbusGateway::getGatewayStats() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return Stats {m_transactions, m_bus_errors, m_coalesced, m_cache_hits,
+        m_rejected, m_queue.size()};
+}
+
+/*
+ *  P R O T E C T E D   M E T H O D S
+ */
+
+void ModbusGateway::processRequest(const Request& t_req, const uint8_t* t_pdu,
+    size_t t_len, vector<uint8_t>& t_resp)
+{
+    // Requests to other units are not forwarded, like in the server
+    uint8_t unit_id = this->getUnitId();
+    if ( (unit_id != 0) && (t_req.unit_id != unit_id) )
+        return;
+
+    uint8_t fcode = t_pdu[0];
+    bool read = (fcode >= Modbus::FC01) && (fcode <= Modbus::FC04);
+    if (t_req.unit_id == Modbus::BROADCAST_ID) {
+        // Only writes can be broadcast; all of them start with an address
+        // and a value or quantity
+        uint8_t error = 0;
+        if ( (fcode != Modbus::FC05) && (fcode != Modbus::FC06) &&
+             (fcode != Modbus::FC15) && (fcode != Modbus::FC16) )
+            error = Modbus::ERR1;
+        else if (t_len < 5)
+            error = Modbus::ERR3;
+        if (error) {
+            t_resp.push_back(fcode | Modbus::ERRC);
+            t_resp.push_back(error);
+            return;
+        }
+    }
+    string key(1, static_cast<char>(t_req.unit_id));
+    key.append(reinterpret_cast<const char*>(t_pdu), t_len);
+
+    lock_guard<mutex> lock(m_mutex);
+    if (read) {
+        auto cached = m_cache.find(key);
+        if (cached != m_cache.end()) {
+            if (Clock::now() - cached->second.time <= m_cache_time) {
+                t_resp.insert(t_resp.end(), cached->second.pdu.begin(),
+                    cached->second.pdu.end());
+                m_cache_hits++;
+                return;
+            }
+            m_cache.erase(cached);
+        }
+        auto pending = m_pending.find(key);
+        if (pending != m_pending.end()) {
+            pending->second->waiters.push_back(t_req);
+            m_coalesced++;
+            return;
+        }
+    }
+
+    if (m_queue.size() >= m_max_queue) {
+        t_resp.push_back(fcode | Modbus::ERRC);
+        t_resp.push_back(Modbus::ERR10);
+        m_rejected++;
+        return;
+    }
+
+    // Response is sent by the bus thread
+    if (!read)
+        this->invalidate(t_req.unit_id);
+    shared_ptr<Job> job(new Job {key, {t_req}, read, false});
+    if (read)
+        m_pending[key] = job;
+    m_queue.push_back(job);
+    m_cv.notify_one();
+    return;
+}
+
+/*
+ *  P R I V A T E   M E T H O D S
+ */
+
+void ModbusGateway::run()
+{
+    unique_lock<mutex> lock(m_mutex);
+    while (true) {
+        m_cv.wait(lock, [this] { return m_bus_stop || !m_queue.empty(); });
+        if (m_bus_stop)
+            break;
+        shared_ptr<Job> job = m_queue.front();
+        m_queue.pop_front();
+
+        lock.unlock();
+        auto resp = this->execute(job->key);
+        lock.lock();
+
+        // Requests coalesced until now are answered with this response
+        m_transactions++;
+        if (job->read) {
+            auto it = m_pending.find(job->key);
+            if ( (it != m_pending.end()) && (it->second == job) )
+                m_pending.erase(it);
+            if ( !job->invalidated && !(resp[0] & Modbus::ERRC) )
+                this->store(job->key, resp);
+        }
+        vector<Request> waiters;
+        waiters.swap(job->waiters);
+
+        lock.unlock();
+        for (const Request& req : waiters)
+            this->sendResponse(req, resp);
+        lock.lock();
+    }
+    return;
+}
+
+vector<uint8_t> ModbusGateway::execute(const string& t_key)
+{
+    uint8_t unit_id = t_key[0];
+    uint8_t fcode = t_key[1];
+    vector<uint8_t> data(t_key.begin() + 2, t_key.end());
+
+    uint8_t error = 0;
+    vector<uint8_t> resp {fcode};
+    try {
+        if (unit_id == Modbus::BROADCAST_ID) {
+            // No response; answer with address and value or quantity like
+            // the slaves would
+            m_modbus->broadcast(fcode, data);
+            resp.insert(resp.end(), data.begin(), data.begin() + 4);
+        } else {
+            auto pdu = m_modbus->request(unit_id, fcode, data);
+            resp.insert(resp.end(), pdu.begin(), pdu.end());
+        }
+    } catch (const BadProtocol& e) {
+        // Exception response of the device or invalid response
+        DEBUG_PRINT("Request to unit %u failed: %s\n", unit_id, e.what());
+        if (unit_id == Modbus::BROADCAST_ID)
+            error = Modbus::ERR10;
+        else
+            error = (e.errorNumber() > 0) && (e.errorNumber() <= 0xFF) ? e.errorNumber()
+                : Modbus::ERR11;
+    } catch (const Timeout& e) {
+        DEBUG_PRINT("Request to unit %u failed: %s\n", unit_id, e.what());
+        error = Modbus::ERR11;
+    } catch (const Exception& e) {
+        DEBUG_PRINT("Request to unit %u failed: %s\n", unit_id, e.what());
+        error = Modbus::ERR10;
+    }
+
+    if (error) {
+        if ( (error == Modbus::ERR10) || (error == Modbus::ERR11) ) {
+            lock_guard<mutex> lock(m_mutex);
+            m_bus_errors++;
+        }
+        resp = {static_cast<uint8_t>(fcode | Modbus::ERRC), error};
+    }
+    return resp;
+}
+
+void ModbusGateway::invalidate(uint8_t t_unit_id)
+{
+    // Keys start with the unit ID; broadcasts write to all units
+    bool all = (t_unit_id == Modbus::BROADCAST_ID);
+    string first(1, static_cast<char>(t_unit_id));
+    string last(1, static_cast<char>(t_unit_id + 1));
+    auto begin = all ? m_cache.begin() : m_cache.lower_bound(first);
+    auto end = (all || (t_unit_id == 0xFF)) ? m_cache.end() : m_cache.lower_bound(last);
+    m_cache.erase(begin, end);
+
+    auto pending = all ? m_pending.begin() : m_pending.lower_bound(first);
+    auto pending_end = (all || (t_unit_id == 0xFF)) ? m_pending.end()
+        : m_pending.lower_bound(last);
+    for (auto it = pending; it != pending_end; it++)
+        it->second->invalidated = true;
+    m_pending.erase(pending, pending_end);
+    return;
+}
+
+void ModbusGateway::store(const string& t_key, const vector<uint8_t>& t_pdu)
+{
+    if (m_cache_time.count() <= 0)
+        return;
+
+    // Drop expired entries before the cache grows too large
+    auto now = Clock::now();
+    if (m_cache.size() >= MAX_CACHE_ENTRIES) {
+        for (auto it = m_cache.begin(); it != m_cache.end(); ) {
+            if (now - it->second.time > m_cache_time)
+                it = m_cache.erase(it);
+            else
+                it++;
+        }
+        if (m_cache.size() >= MAX_CACHE_ENTRIES)
+            m_cache.clear();
+    }
+    m_cache[t_key] = CacheEntry {t_pdu, now};
+    return;
+}
+
+}
@@ -0,0 +1,239 @@
+#include <labkit/protocols/modbuspoller.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <algorithm>
+
+using namespace std;
+
+namespace labkit
+{
+
+ModbusPoller::~ModbusPoller()
+{
+    this->stop();
+    return;
+}
+
+size_t ModbusPoller::addGroup(chrono::milliseconds t_period, uint16_t t_gap)
+{
+    if (m_image)
+        throw BadProtocol("Scan groups must be added before polling is started");
+    if (t_period.count() <= 0)
+        throw BadProtocol("Scan period must be positive");
+
+    unique_ptr<Group> group(new Group());
+    group->period = t_period;
+    group->scan.setModbus(m_modbus);
+    group->scan.setGapTolerance(t_gap);
+    m_groups.push_back(std::move(group));
+    return m_groups.size() - 1;
+}
+
+size_t ModbusPoller::addPoint(size_t t_group, uint8_t t_unit_id, uint8_t t_fcode,
+    uint16_t t_addr, uint16_t t_len)
+{
+    // Image and points are shared with readers once polling was started
+    if (m_image)
+        throw BadProtocol("Points must be added before polling is started");
+    if (t_group >= m_groups.size())
+        throw BadProtocol("Invalid scan group " + to_string(t_group));
+
+    Group& group = *m_groups[t_group];
+    group.scan.addPoint(t_unit_id, t_fcode, t_addr, t_len);
+    group.points.push_back(m_points.size());
+
+    unique_ptr<Point> point(new Point());
+    point->group = t_group;
+    point->offset = m_image_size;
+    point->len = t_len;
+    m_points.push_back(std::move(point));
+    m_image_size += t_len;
+    return m_points.size() - 1;
+}
+
+void ModbusPoller::start()
+{
+    if (this->running())
+        return;
+    if (!m_modbus)
+        throw BadProtocol("No MODBUS protocol set for polling");
+
+    // Image is allocated once; points keep their values after a restart
+    if (!m_image) {
+        m_image.reset(new atomic<uint16_t>[m_image_size]);
+        for (size_t i = 0; i < m_image_size; i++)
+            m_image[i].store(0, memory_order_relaxed);
+    }
+
+    auto now = Clock::now();
+    for (auto& group : m_groups)
+        group->deadline = now;
+    m_stop = false;
+    m_thread = thread(&ModbusPoller::run, this);
+    DEBUG_PRINT("Started polling of %zu groups, %zu points\n", m_groups.size(),
+        m_points.size());
+    return;
+}
+
+void ModbusPoller::stop()
+{
+    if (!this->running())
+        return;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    return;
+}
+
+bool ModbusPoller::read(size_t t_point, uint16_t* t_regs,
+    Clock::time_point* t_time) const
+{
+    const Point& point = this->point(t_point);
+    if (!m_image)
+        return false;
+    const Group& group = *m_groups[point.group];
+
+    // Retry while the poller thread updates the group
+    uint32_t seq_begin, seq_end;
+    int64_t time;
+    do {
+        seq_begin = group.seq.load(memory_order_acquire);
+        for (size_t i = 0; i < point.len; i++)
+            t_regs[i] = m_image[point.offset + i].load(memory_order_relaxed);
+        time = point.time.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        seq_end = group.seq.load(memory_order_relaxed);
+    } while ( (seq_begin != seq_end) || (seq_begin & 1) );
+
+    if (t_time)
+        *t_time = Clock::time_point(Clock::duration(time));
+    return time != 0;
+}
+
+vector<uint16_t> ModbusPoller::read(size_t t_point) const
+{
+    vector<uint16_t> ret(this->point(t_point).len);
+    if (!this->read(t_point, ret.data()))
+        ret.clear();
+    return ret;
+}
+
+ModbusPoller::Clock::time_point ModbusPoller::getTimestamp(size_t t_point) const
+{
+    int64_t time = this->point(t_point).time.load(memory_order_acquire);
+    return Clock::time_point(Clock::duration(time));
+}
+
+bool ModbusPoller::isStale(size_t t_point, Clock::duration t_max_age) const
+{
+    int64_t time = this->point(t_point).time.load(memory_order_acquire);
+    if (time == 0)
+        return true;
+    return Clock::now() - Clock::time_point(Clock::duration(time)) > t_max_age;
+}
+
+ModbusPoller::Stats ModbusPoller::getStats(size_t t_group) const
+{
+    if (t_group >= m_groups.size())
+        throw BadProtocol("Invalid scan group " + to_string(t_group));
+    const Group& group = *m_groups[t_group];
+    lock_guard<mutex> lock(group.stats_mutex);
+    return group.stats;
+}
+
+/*
+ *  P R I V A T E   M E T H O D S
+ */
+
+void ModbusPoller::run()
+{
+    unique_lock<mutex> lock(m_mutex);
+    while (!m_stop && !m_groups.empty()) {
+        // Earliest deadline first
+        auto it = min_element(m_groups.begin(), m_groups.end(),
+            [](const unique_ptr<Group>& a, const unique_ptr<Group>& b) {
+                return a->deadline < b->deadline;
+            });
+        Group& group = **it;
+        if (m_cv.wait_until(lock, group.deadline, [this] { return m_stop; }))
+            break;
+
+        lock.unlock();
+        this->scanGroup(group);
+
+        // Next deadline; cycles which already passed are skipped
+        auto now = Clock::now();
+        group.deadline += group.period;
+        uint64_t skipped = 0;
+        if (group.deadline <= now) {
+            skipped = (now - group.deadline) / group.period + 1;
+            group.deadline += skipped * group.period;
+        }
+        if (skipped > 0) {
+            size_t id = it - m_groups.begin();
+            {
+                lock_guard<mutex> stats_lock(group.stats_mutex);
+                group.stats.overruns += skipped;
+            }
+            DEBUG_PRINT("Scan group %zu overrun, %lu cycles skipped\n", id,
+                (unsigned long)skipped);
+            if (m_overrun_cb)
+                m_overrun_cb(id, skipped);
+        }
+        lock.lock();
+    }
+    return;
+}
+
+void ModbusPoller::scanGroup(Group& t_group)
+{
+    auto begin = Clock::now();
+    vector<vector<uint16_t>> values;
+    string error {};
+    try {
+        values = t_group.scan.scan();
+    } catch (const Exception& e) {
+        error = e.what();
+    }
+    auto end = Clock::now();
+
+    if (error.empty()) {
+        // Publish; readers retry while the sequence number is odd
+        int64_t time = end.time_since_epoch().count();
+        uint32_t seq = t_group.seq.load(memory_order_relaxed);
+        t_group.seq.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        for (size_t k = 0; k < t_group.points.size(); k++) {
+            Point& point = *m_points[t_group.points[k]];
+            for (size_t i = 0; i < point.len; i++)
+                m_image[point.offset + i].store(values[k][i], memory_order_relaxed);
+            point.time.store(time, memory_order_relaxed);
+        }
+        t_group.seq.store(seq + 2, memory_order_release);
+    }
+
+    lock_guard<mutex> lock(t_group.stats_mutex);
+    if (error.empty()) {
+        t_group.stats.scans++;
+    } else {
+        t_group.stats.errors++;
+        t_group.stats.last_error = error;
+        DEBUG_PRINT("Scan failed: %s\n", error.c_str());
+    }
+    t_group.stats.last_duration = end - begin;
+    t_group.stats.max_duration = max(t_group.stats.max_duration, end - begin);
+    return;
+}
+
+const ModbusPoller::Point& ModbusPoller::point(size_t t_point) const
+{
+    if (t_point >= m_points.size())
+        throw BadProtocol("Invalid point " + to_string(t_point));
+    return *m_points[t_point];
+}
+
+}
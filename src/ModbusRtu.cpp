@@ -1,108 +1,49 @@
 #include <labkit/protocols/modbusrtu.hh>
+#include <labkit/protocols/crc16.hh>
+#include <labkit/exceptions.hh>
 #include <labkit/debug.hh>
 
+#include <chrono>
+#include <thread>
+
 using namespace std;
 
 namespace labkit
 {
 
-std::vector<bool> ModbusRtu::readCoils(uint8_t unit_id, uint16_t addr, 
-    uint16_t len)
-{
-    vector<bool> ret;
-    // TODO -> need device that actually uses this..
-    return ret;
-}
+/*
+ *  P R O T E C T E D   M E T H O D S
+ */
 
-std::vector<bool> ModbusRtu::readDiscreteInputs(uint8_t t_unit_id, 
-    uint16_t t_addr, uint16_t t_len)
+vector<uint8_t> ModbusRtu::transaction(uint8_t t_unit_id, 
+    uint8_t t_function_code, const vector<uint8_t>& t_data)
 {
-    vector<bool> ret;
-    // TODO -> need device that actually uses this..
-    return ret;
-}
+    auto packet = this->createPacket(t_unit_id, t_function_code, t_data);
+    DEBUG_PRINT("Sending function code 0x%02X (unit_id=%u)\n", t_function_code,
+        t_unit_id);
 
-std::vector<uint16_t> ModbusRtu::readMultipleHoldingRegs(uint8_t t_unit_id, 
-    uint16_t t_addr, uint16_t t_len)
-{
-    return this->read16BitRegs(t_unit_id, FC03, t_addr, t_len);
-}
+    // Bytes left from earlier transactions (e.g. late responses) are dropped
+    m_decoder.setCrc(m_comm->type() == SERIAL);
+    m_decoder.clear();
+    m_comm->writeByte(packet);
 
-std::vector<uint16_t> ModbusRtu::readInputRegs(uint8_t t_unit_id, 
-    uint16_t t_addr, uint16_t t_len)
-{
-    return this->read16BitRegs(t_unit_id, FC04, t_addr, t_len);
-}
+    auto resp = this->receiveFrame();
+    checkResponse(resp, t_unit_id, t_function_code);
 
-void ModbusRtu::writeSingleCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena)   
-{
-    // TODO -> need device that actually uses this..
-    return;
+    // Strip unit ID, function code and CRC
+    size_t crc_len = m_decoder.getCrc() ? 2 : 0;
+    return vector<uint8_t>(resp.data + 2, resp.data + resp.len - crc_len);
 }
 
-void ModbusRtu::writeSingleHoldingReg(uint8_t t_unit_id, uint16_t t_addr, 
-    uint16_t t_reg)
+void ModbusRtu::send(uint8_t t_unit_id, uint8_t t_function_code,
+    const vector<uint8_t>& t_data)
 {
-    vector<uint8_t> data {};
-    data.push_back(static_cast<uint8_t>(0xFF & (t_addr >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_addr));
-    data.push_back(static_cast<uint8_t>(0xFF & (t_reg >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_reg));
-    auto packet = this->createPacket(t_unit_id, FC06, data);
-
-    DEBUG_PRINT("Writing 0x%04X to address 0x%04X (unit_id=%u)\n",
-        t_reg, t_addr, t_unit_id);
-
-    vector<uint8_t> resp = m_comm->queryByte(packet);
-
-    // Extract header and data from response
-    uint8_t received_fcode {0x00}, received_err {0x00};
-    received_fcode = resp.at(1);
-    received_err = resp.at(2);
-
-    // Check for errors (TODO: also check received address, register and unit_id)
-    if (received_fcode & ERRC)
-        Modbus::checkAndThrow(received_err);
-
-    return;
-}
-
-void ModbusRtu::writeMultipleCoils(uint8_t t_unit_id, uint16_t t_addr, 
-    std::vector<bool> t_ena)
-{
-    // TODO -> need device that actually uses this..
-    return;
-}
-
-void ModbusRtu::writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr, 
-    std::vector<uint16_t> t_regs)
-{
-    uint16_t len = t_regs.size();
-    vector<uint8_t> data;
-    data.push_back(static_cast<uint8_t>(0xFF & (t_addr >> 8)));   // Starting register
-    data.push_back(static_cast<uint8_t>(0xFF & t_addr));          // address
-    data.push_back(static_cast<uint8_t>(0xFF & (len >> 8)));    // Number of registers
-    data.push_back(static_cast<uint8_t>(0xFF & len));
-    data.push_back(static_cast<uint8_t>(0xFF & 2*len));         // Number of bytes
-    for (unsigned i = 0; i < len; i++) {
-        data.push_back(static_cast<uint8_t>(0xFF & (data.at(i) >> 8)));
-        data.push_back(static_cast<uint8_t>(0xFF & data.at(i)));
-    }
-    auto packet = this->createPacket(t_unit_id, FC16, data);
-
-    DEBUG_PRINT("Writing %u registers with starting address 0x%04X "
-        "(unit_id=%u)\n", len, t_addr, t_unit_id);
-
-    vector<uint8_t> resp = m_comm->queryByte(packet);
-
-    // Extract header and data from response
-    uint8_t received_fcode = resp.at(1);
-    uint8_t received_err = resp.at(2);
-    
-    // Check for errors (TODO: check received address, register and unit_id)
-    if (received_fcode & ERRC)
-        Modbus::checkAndThrow(received_err);
+    auto packet = this->createPacket(t_unit_id, t_function_code, t_data);
+    m_decoder.clear();
+    m_comm->writeByte(packet);
 
+    // No response; the next request must not arrive while slaves are busy
+    this_thread::sleep_for(chrono::milliseconds(m_turnaround_ms));
     return;
 }
 
@@ -110,25 +51,6 @@ void ModbusRtu::writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr,
  *  P R I V A T E   M E T H O D S
  */
 
-uint16_t ModbusRtu::calcCrc16(const vector<uint8_t> &t_data)
-{
-    uint16_t crc = 0xFFFF;  // Start value
-    for (auto pos : t_data) {
-        crc ^= static_cast<uint16_t>(pos);  // XOR byte into least sig. byte of crc
-        for (int i = 8; i != 0; i--) {      // Loop over each bit
-            if ( (crc & 0x0001) != 0) {     // If the LSB is set
-                crc >>= 1;                  // Shift right and XOR 0xA001
-                crc ^= 0xA001;
-            } else {                        // Else LSB is not set
-                crc >>= 1;                  // Just shift right
-            }
-        }
-    }
-    // Note: this number has low and high bytes swapped, so use it accordingly 
-    // (or swap bytes)
-    return crc;
-}
-
 vector<uint8_t> ModbusRtu::createPacket(uint8_t t_unit_id, 
     uint8_t t_function_code, const vector<uint8_t> &t_data)
 {
@@ -141,7 +63,7 @@ vector<uint8_t> ModbusRtu::createPacket(uint8_t t_unit_id,
 
     // MODBUS RTU: Append CRC checksum
     if (m_comm->type() == SERIAL) {
-        uint16_t crc = this->calcCrc16(packet);
+        uint16_t crc = Crc16::calc(packet);
         packet.push_back(static_cast<uint8_t>(0xFF & crc));
         packet.push_back(static_cast<uint8_t>(0xFF & (crc >> 8)));
     }
@@ -149,40 +71,51 @@ vector<uint8_t> ModbusRtu::createPacket(uint8_t t_unit_id,
     return packet;
 }
 
-vector<uint16_t> ModbusRtu::read16BitRegs(uint8_t t_unit_id, 
-    uint8_t t_function_code, uint16_t t_start_addr, uint16_t t_len)
+ModbusDecoder::Frame ModbusRtu::receiveFrame()
+{
+    ModbusDecoder::Frame frame;
+    string error {};
+    while (true) {
+        try {
+            if (m_decoder.next(frame))
+                return frame;
+        } catch (const BadProtocol& e) {
+            // Skip invalid bytes; reported only if no valid frame follows
+            error = e.what();
+            continue;
+        }
+
+        // Receive directly into the decoder
+        size_t space;
+        uint8_t* buf = m_decoder.prepare(space);
+        int nbytes;
+        try {
+            nbytes = m_comm->readRaw(buf, space, m_timeout_ms);
+        } catch (const Timeout&) {
+            if (error.empty())
+                throw;
+            throw BadProtocol(m_comm->getInfo() + " - " + error);
+        }
+        if (nbytes <= 0)
+            throw BadIo(m_comm->getInfo() + " - No data received");
+        m_decoder.commit(nbytes);
+    }
+}
+
+void ModbusRtu::checkResponse(const ModbusDecoder::Frame &t_resp, 
+    uint8_t t_unit_id, uint8_t t_function_code)
 {
-    // Create packet with payload
-    vector<uint8_t> data {};
-    data.push_back(static_cast<uint8_t>(0xFF & (t_start_addr >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_start_addr));
-    data.push_back(static_cast<uint8_t>(0xFF & (t_len >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_len));
-    vector<uint8_t> packet = this->createPacket(t_unit_id, t_function_code, data);
-
-    DEBUG_PRINT("Reading %u registers with starting address 0x%04X "
-        "(unit_id=%u)\n", t_len, t_start_addr, t_unit_id);
-
-    auto resp = m_comm->queryByte(packet);
-
-    // Extract header and data from response
-    vector<uint8_t> received_data {};
-    uint8_t received_fcode = resp.at(1);
-    uint8_t received_bytes = resp.at(2);
-    received_data.insert(received_data.begin(), resp.begin() + 3, resp.end() - 2);
-
-    // Check for errors (TODO: check received bytes and unit_id)
-    if (received_fcode & ERRC)
-        Modbus::checkAndThrow(received_bytes);
-
-    // Create 16-bit return vector
-    vector<uint16_t> ret;
-    if (received_data.size() % 2) // 0-padding if number of bytes is not even
-        received_data.push_back(0x00);
-    for (unsigned i = 0; i < t_len; i++)
-        ret.push_back((received_data.at(2*i) << 8) | received_data.at(2*i+1));
-
-    return ret;
+    // Length and CRC have been verified by the decoder
+    const uint8_t* resp = t_resp.data;
+    if (resp[0] != t_unit_id)
+        throw BadProtocol("MODBUS RTU response from wrong unit ID " 
+            + to_string(resp[0]) + " (expected " + to_string(t_unit_id) + ")");
+    if (resp[1] == (t_function_code | ERRC))
+        Modbus::checkAndThrow(resp[2]);
+    if (resp[1] != t_function_code)
+        throw BadProtocol("MODBUS RTU response with wrong function code " 
+            + to_string(resp[1]));
+    return;
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,192 @@
+#include <labkit/protocols/modbusscan.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+
+using namespace std;
+
+namespace labkit
+{
+
+size_t ModbusScan::addPoint(uint8_t t_unit_id, uint8_t t_fcode, uint16_t t_addr,
+    uint16_t t_len)
+{
+    if ( (t_fcode != Modbus::FC03) && (t_fcode != Modbus::FC04) )
+        throw BadProtocol("Function code " + to_string(t_fcode) 
+            + " not supported for register scans");
+    if ( (t_len == 0) || ((uint32_t)t_addr + t_len > 0x10000) )
+        throw BadProtocol("Invalid register range (address " + to_string(t_addr)
+            + ", length " + to_string(t_len) + ")");
+
+    m_points.push_back( {t_unit_id, t_fcode, t_addr, t_len} );
+    m_planned = false;
+    return m_points.size() - 1;
+}
+
+void ModbusScan::addForbiddenRange(uint8_t t_unit_id, uint8_t t_fcode, 
+    uint16_t t_addr, uint16_t t_len)
+{
+    if (t_len == 0)
+        return;
+    m_forbidden[{t_unit_id, t_fcode}].push_back( 
+        {t_addr, (uint32_t)t_addr + t_len - 1} );
+    m_planned = false;
+    return;
+}
+
+void ModbusScan::clear()
+{
+    m_points.clear();
+    m_forbidden.clear();
+    m_planned = false;
+    return;
+}
+
+void ModbusScan::setGapTolerance(uint16_t t_gap)
+{
+    m_gap = t_gap;
+    m_planned = false;
+    return;
+}
+
+void ModbusScan::setMaxBlockLen(uint16_t t_len)
+{
+    if ( (t_len == 0) || (t_len > MAX_REGS) )
+        throw BadProtocol("Block length must be within 1 - " 
+            + to_string(MAX_REGS));
+    m_max_len = t_len;
+    m_planned = false;
+    return;
+}
+
+const vector<Modbus::RegBlock>& ModbusScan::getBlocks()
+{
+    if (!m_planned)
+        this->plan();
+    return m_blocks;
+}
+
+vector<vector<uint16_t>> ModbusScan::scan()
+{
+    if (!m_modbus)
+        throw BadProtocol("No MODBUS protocol set for scan");
+    if (!m_planned)
+        this->plan();
+
+    auto regs = m_modbus->readRegBlocks(m_blocks);
+
+    // Scatter block registers to the points
+    vector<vector<uint16_t>> ret(m_points.size());
+    for (size_t i = 0; i < m_points.size(); i++) {
+        ret[i].resize(m_points[i].len);
+        for (const auto& slice : m_slices[i]) {
+            const auto& src = regs.at(slice.block);
+            copy(src.begin() + slice.offset, src.begin() + slice.offset + slice.len,
+                ret[i].begin() + slice.pos);
+        }
+    }
+    return ret;
+}
+
+/*
+ *  P R I V A T E   M E T H O D S
+ */
+
+void ModbusScan::plan()
+{
+    m_blocks.clear();
+    m_slices.assign(m_points.size(), {});
+
+    // Points sorted by unit ID, function code and address
+    vector<size_t> order(m_points.size());
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        const auto& pa = m_points[a];
+        const auto& pb = m_points[b];
+        return tie(pa.unit_id, pa.fcode, pa.addr) < tie(pb.unit_id, pb.fcode, pb.addr);
+    });
+
+    // Greedy merge; block covers registers [start, end)
+    bool open = false;
+    uint8_t unit_id = 0, fcode = 0;
+    uint32_t start = 0, end = 0;
+    for (size_t idx : order) {
+        const auto& point = m_points[idx];
+        uint32_t first = point.addr, last = (uint32_t)point.addr + point.len;
+
+        if ( open && (point.unit_id == unit_id) && (point.fcode == fcode) ) {
+            first = max(first, end);    // Overlapping part is already read
+            if (first >= last)
+                continue;
+            bool bridge = (first == end) || ( (first - end <= m_gap) &&
+                !this->isForbidden(unit_id, fcode, end, first - 1) );
+            if ( bridge && (last - start <= m_max_len) ) {
+                end = last;
+                continue;
+            }
+        }
+        if (open)
+            m_blocks.push_back( {unit_id, fcode, (uint16_t)start, 
+                (uint16_t)(end - start)} );
+
+        // New block; points longer than a request are split
+        unit_id = point.unit_id;
+        fcode = point.fcode;
+        while (last - first > m_max_len) {
+            m_blocks.push_back( {unit_id, fcode, (uint16_t)first, m_max_len} );
+            first += m_max_len;
+        }
+        start = first;
+        end = last;
+        open = true;
+    }
+    if (open)
+        m_blocks.push_back( {unit_id, fcode, (uint16_t)start, 
+            (uint16_t)(end - start)} );
+
+    // Blocks are sorted like the points; find the blocks holding each point
+    auto less = [](const Modbus::RegBlock& a, const Modbus::RegBlock& b) {
+        return tie(a.unit_id, a.fcode, a.addr) < tie(b.unit_id, b.fcode, b.addr);
+    };
+    for (size_t i = 0; i < m_points.size(); i++) {
+        const auto& point = m_points[i];
+        uint32_t last = (uint32_t)point.addr + point.len;
+        auto it = upper_bound(m_blocks.begin(), m_blocks.end(), point, less);
+        if (it != m_blocks.begin())
+            it--;
+        for (; it != m_blocks.end(); it++) {
+            if ( (it->unit_id != point.unit_id) || (it->fcode != point.fcode) 
+                 || (it->addr >= last) )
+                break;
+            uint32_t first = max<uint32_t>(point.addr, it->addr);
+            uint32_t stop = min<uint32_t>(last, (uint32_t)it->addr + it->len);
+            if (first >= stop)
+                continue;
+            m_slices[i].push_back( {(size_t)(it - m_blocks.begin()), 
+                (uint16_t)(first - it->addr), (uint16_t)(first - point.addr), 
+                (uint16_t)(stop - first)} );
+        }
+    }
+
+    m_planned = true;
+    DEBUG_PRINT("Planned %zu register blocks for %zu points\n", m_blocks.size(),
+        m_points.size());
+    return;
+}
+
+bool ModbusScan::isForbidden(uint8_t t_unit_id, uint8_t t_fcode, 
+    uint32_t t_first, uint32_t t_last) const
+{
+    auto it = m_forbidden.find({t_unit_id, t_fcode});
+    if (it == m_forbidden.end())
+        return false;
+    for (const auto& range : it->second)
+        if ( (range.first <= t_last) && (t_first <= range.second) )
+            return true;
+    return false;
+}
+
+}
@@ -2,115 +2,85 @@
 #include <labkit/exceptions.hh>
 #include <labkit/debug.hh>
 
+#include <map>
+
 using namespace std;
 
 namespace labkit
 {
 
-vector<bool> ModbusTcp::readCoils(uint8_t t_unit_id, uint16_t t_addr, 
-    uint16_t t_len)
+vector<vector<uint16_t>> ModbusTcp::readRegBlocks(const vector<RegBlock>& t_blocks)
 {
-    vector<bool> ret;
-    // TODO -> need device that actually uses this..
-    return ret;
-}
+    vector<vector<uint16_t>> ret(t_blocks.size());
+    map<uint16_t, size_t> in_flight;    // Transaction ID -> block index
+    size_t next = 0, done = 0;
+
+    while (done < t_blocks.size()) {
+        // Fill the window; requests are sent with a single write
+        vector<uint8_t> out {};
+        while ( (next < t_blocks.size()) && (in_flight.size() < m_window) ) {
+            const RegBlock& block = t_blocks[next];
+            if ( (block.fcode != FC03) && (block.fcode != FC04) )
+                throw BadProtocol("Function code " + to_string(block.fcode)
+                    + " not supported for register blocks");
+            vector<uint8_t> data {
+                static_cast<uint8_t>(0xFF & (block.addr >> 8)),
+                static_cast<uint8_t>(0xFF & block.addr),
+                static_cast<uint8_t>(0xFF & (block.len >> 8)),
+                static_cast<uint8_t>(0xFF & block.len)
+            };
+            auto packet = this->createPacket(block.unit_id, block.fcode, data);
+            out.insert(out.end(), packet.begin(), packet.end());
+            in_flight[m_tid++] = next++;
+        }
+        if (!out.empty())
+            m_comm->writeRaw(out.data(), out.size());
+
+        // Responses may arrive in any order
+        auto resp = this->receiveFrame();
+        uint16_t tid = (resp.data[0] << 8) | resp.data[1];
+        auto it = in_flight.find(tid);
+        if (it == in_flight.end()) {
+            DEBUG_PRINT("Dropped response with unknown transaction ID %u\n", tid);
+            continue;
+        }
+        const RegBlock& block = t_blocks[it->second];
+        checkResponse(resp, block.unit_id, block.fcode);
+        ret[it->second] = decodeRegs(resp.data + MBAP_LEN + 1, 
+            resp.len - MBAP_LEN - 1, block.len);
+        in_flight.erase(it);
+        done++;
+    }
+    DEBUG_PRINT("Read %zu register blocks (window %zu)\n", t_blocks.size(), 
+        m_window);
 
-vector<bool> ModbusTcp::readDiscreteInputs(uint8_t t_unit_id, 
-    uint16_t t_addr, uint16_t t_len)
-{
-    vector<bool> ret;
-    // TODO -> need device that actually uses this..
     return ret;
 }
 
-vector<uint16_t> ModbusTcp::readMultipleHoldingRegs(uint8_t t_unit_id, 
-    uint16_t t_addr, uint16_t t_len)
+void ModbusTcp::setWindowSize(size_t t_size)
 {
-    return this->read16BitRegs(t_unit_id, FC03, t_addr, t_len);
-}
-
-vector<uint16_t> ModbusTcp::readInputRegs(uint8_t unit_id, 
-    uint16_t addr, uint16_t len)
-{
-    return this->read16BitRegs(unit_id, FC04, addr, len);
-}
-
-void ModbusTcp::writeSingleCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena)   
-{
-    // TODO -> need device that actually uses this..
+    if (t_size == 0)
+        throw BadProtocol("Window size must be at least 1");
+    m_window = t_size;
     return;
 }
 
-void ModbusTcp::writeSingleHoldingReg(uint8_t t_unit_id, uint16_t t_addr, 
-    uint16_t t_reg)
-{
-    vector<uint8_t> data {};
-    data.push_back(static_cast<uint8_t>(0xFF & (t_addr >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_addr));
-    data.push_back(static_cast<uint8_t>(0xFF & (t_reg >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_reg));
-    auto packet = this->createPacket(t_unit_id, FC06, data);
-
-    DEBUG_PRINT("Writing 0x%04X to address 0x%04X (tid=%u, unit_id=%u)\n",
-        t_reg, t_addr, m_tid, t_unit_id);
-
-    vector<uint8_t> resp = m_comm->queryByte(packet);
-
-    // Extract header and data from response
-    uint8_t received_fcode {0x00}, received_err {0x00};
-    received_fcode = resp.at(7);
-    received_err = resp.at(8);
-
-    // Check for errors (TODO: also check received address, register and unit_id)
-    if (received_fcode & ERRC)
-        Modbus::checkAndThrow(received_err);
-    
-    // Increase transaction ID after each transaction
-    m_tid++;
-
-    return;
-}
-
-void ModbusTcp::writeMultipleCoils(uint8_t t_unit_id, uint16_t t_addr, 
-    vector<bool> t_ena)
-{
-    // TODO -> need device that actually uses this..
-    return;
-}
+/*
+ *  P R O T E C T E D   M E T H O D S
+ */
 
-void ModbusTcp::writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr, 
-    vector<uint16_t> t_regs)
+vector<uint8_t> ModbusTcp::transaction(uint8_t t_unit_id, 
+    uint8_t t_function_code, const vector<uint8_t>& t_data)
 {
-    uint16_t len = t_regs.size();
-    vector<uint8_t> data;
-    data.push_back(static_cast<uint8_t>(0xFF & (t_addr >> 8)));   // Starting register
-    data.push_back(static_cast<uint8_t>(0xFF & t_addr));          // address
-    data.push_back(static_cast<uint8_t>(0xFF & (len >> 8)));    // Number of registers
-    data.push_back(static_cast<uint8_t>(0xFF & len));
-    data.push_back(static_cast<uint8_t>(0xFF & 2*len));         // Number of bytes
-    for (unsigned i = 0; i < len; i++) {
-        data.push_back(static_cast<uint8_t>(0xFF & (data.at(i) >> 8)));
-        data.push_back(static_cast<uint8_t>(0xFF & data.at(i)));
-    }
-    auto packet = this->createPacket(t_unit_id, FC16, data);
-
-    DEBUG_PRINT("Writing %u registers with starting address 0x%04X "
-        "(tid=%u, unit_id=%u)\n", len, t_addr, m_tid, t_unit_id);
+    auto packet = this->createPacket(t_unit_id, t_function_code, t_data);
+    DEBUG_PRINT("Sending function code 0x%02X (tid=%u, unit_id=%u)\n",
+        t_function_code, m_tid, t_unit_id);
 
-    vector<uint8_t> resp = m_comm->queryByte(packet);
+    auto resp = this->exchange(packet);
+    checkResponse(resp, t_unit_id, t_function_code);
 
-    // Extract header and data from response
-    uint8_t received_fcode {0x00}, received_err {0x00};
-    received_fcode = resp.at(7);
-    received_err = resp.at(8);
-    
-    // Check for errors (TODO: check received address, register and unit_id)
-    if (received_fcode & ERRC)
-        Modbus::checkAndThrow(received_err);
-    
-    // Increase transaction ID after each transaction
-    m_tid++;
-    return;
+    // Strip MBAP header and function code
+    return vector<uint8_t>(resp.data + MBAP_LEN + 1, resp.data + resp.len);
 }
 
 /*
@@ -118,7 +88,7 @@ void ModbusTcp::writeMultipleHoldingRegs(uint8_t t_unit_id, uint16_t t_addr,
  */
 
 vector<uint8_t> ModbusTcp::createPacket(uint8_t t_unit_id, 
-    uint8_t t_function_code, vector<uint8_t> &t_data)
+    uint8_t t_function_code, const vector<uint8_t> &t_data)
 {
     vector<uint8_t> packet {};
 
@@ -139,44 +109,59 @@ vector<uint8_t> ModbusTcp::createPacket(uint8_t t_unit_id,
     return packet;
 }
 
-vector<uint16_t> ModbusTcp::read16BitRegs(uint8_t t_unit_id, 
-    uint8_t t_function_code, uint16_t t_start_addr, uint16_t t_len)
+ModbusDecoder::Frame ModbusTcp::exchange(const vector<uint8_t> &t_packet)
+{
+    // Transaction ID is used up even if the transaction fails
+    uint16_t tid = m_tid++;
+    m_comm->writeByte(t_packet);
+
+    while (true) {
+        auto resp = this->receiveFrame();
+        uint16_t received_tid = (resp.data[0] << 8) | resp.data[1];
+        if (received_tid == tid)
+            return resp;
+        DEBUG_PRINT("Dropped response with transaction ID %u (expected %u)\n",
+            received_tid, tid);
+    }
+}
+
+ModbusDecoder::Frame ModbusTcp::receiveFrame()
 {
-    // Create packet with payload
-    vector<uint8_t> data {};
-    data.push_back(static_cast<uint8_t>(0xFF & (t_start_addr >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_start_addr));
-    data.push_back(static_cast<uint8_t>(0xFF & (t_len >> 8)));
-    data.push_back(static_cast<uint8_t>(0xFF & t_len));
-    vector<uint8_t> packet = this->createPacket(t_unit_id, t_function_code, data);
-
-    DEBUG_PRINT("Reading %u registers with starting address 0x%04X "
-        "(tid=%u, unit_id=%u)\n", t_len, t_start_addr, m_tid, t_unit_id);
-
-    auto resp = m_comm->queryByte(packet);
-
-    // Extract header and data from response
-    vector<uint8_t> received_data {};
-    uint8_t received_fcode {0x00}, received_bytes {0x00};
-    received_fcode = resp.at(7);
-    received_bytes = resp.at(8);
-    received_data.insert(received_data.begin(), resp.begin() + 9, resp.end());
-
-    // Check for errors (TODO: check received bytes and unit_id)
-    if (received_fcode & ERRC)
-        Modbus::checkAndThrow(received_bytes);
-
-    // Create 16-bit return vector
-    vector<uint16_t> ret;
-    if (received_data.size() % 2) // 0-padding if number of bytes is not even
-        received_data.push_back(0x00);
-    for (unsigned i = 0; i < t_len; i++)
-        ret.push_back((received_data.at(2*i) << 8) | received_data.at(2*i+1));
-
-    // MODBUS TCP: increase transaction id counter
-    m_tid++;
+    ModbusDecoder::Frame frame;
+    while (true) {
+        try {
+            if (m_decoder.next(frame))
+                return frame;
+        } catch (const BadProtocol& e) {
+            throw BadProtocol(m_comm->getInfo() + " - " + e.what());
+        }
+
+        // Receive directly into the decoder
+        size_t space;
+        uint8_t* buf = m_decoder.prepare(space);
+        int nbytes = m_comm->readRaw(buf, space, m_timeout_ms);
+        if (nbytes <= 0)
+            throw BadConnection(m_comm->getInfo() + " - Connection closed");
+        m_decoder.commit(nbytes);
+    }
+}
 
-    return ret;
+void ModbusTcp::checkResponse(const ModbusDecoder::Frame &t_resp, 
+    uint8_t t_unit_id, uint8_t t_function_code)
+{
+    const uint8_t* resp = t_resp.data;
+    if (resp[6] != t_unit_id)
+        throw BadProtocol("MODBUS TCP response from wrong unit ID " 
+            + to_string(resp[6]) + " (expected " + to_string(t_unit_id) + ")");
+    if (resp[7] == (t_function_code | ERRC)) {
+        if (t_resp.len < MBAP_LEN + 2)
+            throw BadProtocol("MODBUS TCP exception response too short");
+        Modbus::checkAndThrow(resp[8]);
+    }
+    if (resp[7] != t_function_code)
+        throw BadProtocol("MODBUS TCP response with wrong function code " 
+            + to_string(resp[7]));
+    return;
 }
     
 }
\ No newline at end of file
@@ -0,0 +1,808 @@
+#include <labkit/protocols/modbustcpserver.hh>
+#include <labkit/protocols/modbustcp.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+namespace labkit
+{
+
+/// Returns big endian 16 bit value
+static inline uint16_t get16(const uint8_t* t_data)
+{
+    return (t_data[0] << 8) | t_data[1];
+}
+
+/// Append big endian 16 bit value
+static inline void put16(vector<uint8_t>& t_data, uint16_t t_value)
+{
+    t_data.push_back(static_cast<uint8_t>(0xFF & (t_value >> 8)));
+    t_data.push_back(static_cast<uint8_t>(0xFF & t_value));
+}
+
+ModbusTcpServer::~ModbusTcpServer()
+{
+    this->stop();
+    if (m_listen_fd >= 0)
+        ::close(m_listen_fd);
+    return;
+}
+
+void ModbusTcpServer::listen(unsigned t_port, const string& t_ip_addr)
+{
+    if (m_listen_fd >= 0)
+        throw BadConnection("MODBUS TCP server is already listening on port "
+            + to_string(m_port));
+    m_ip_addr = t_ip_addr;
+    m_port = t_port;
+
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(t_port);
+    if (inet_aton(t_ip_addr.c_str(), &addr.sin_addr) == 0)
+        throw BadConnection("Address " + t_ip_addr + " is not supported.");
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    checkAndThrow(fd, "Could not open socket.");
+
+    int one = 1;
+    int stat = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (stat == 0)
+        stat = ::bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (stat == 0)
+        stat = ::listen(fd, SOMAXCONN);
+    if (stat < 0) {
+        int error = errno;
+        ::close(fd);
+        errno = error;
+        checkAndThrow(stat, "Failed to listen.");
+    }
+
+    // Port may have been chosen by the system
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) == 0)
+        m_port = ntohs(addr.sin_port);
+    m_listen_fd = fd;
+    DEBUG_PRINT("Listening on %s:%u\n", m_ip_addr.c_str(), m_port);
+    return;
+}
+
+void ModbusTcpServer::start()
+{
+    if (this->running())
+        return;
+    if (m_listen_fd < 0)
+        throw BadConnection("MODBUS TCP server is not listening");
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    {
+        lock_guard<mutex> lock(m_resp_mutex);
+        m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    int stat = ( (m_epoll_fd < 0) || (m_event_fd < 0) ) ? -1 : 0;
+    for (int fd : {m_listen_fd, m_event_fd}) {
+        if (stat < 0)
+            break;
+        struct epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        stat = epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (stat < 0) {
+        int error = errno;
+        this->shutdown();
+        errno = error;
+        checkAndThrow(stat, "Failed to set up event loop.");
+    }
+
+    // Without the reserve fd, accepting pauses when out of fds
+    m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    m_stop = false;
+    m_thread = thread(&ModbusTcpServer::run, this);
+    return;
+}
+
+void ModbusTcpServer::stop()
+{
+    if (!this->running())
+        return;
+    m_stop = true;
+    uint64_t one = 1;
+    if (write(m_event_fd, &one, sizeof(one)) < 0)
+        DEBUG_PRINT("Failed to wake server thread (%s)\n", strerror(errno));
+    m_thread.join();
+    this->shutdown();
+    return;
+}
+
+void ModbusTcpServer::resize(Table t_table, size_t t_size)
+{
+    if (t_size > 0x10000)
+        throw BadProtocol("Table size " + to_string(t_size)
+            + " exceeds MODBUS address range");
+    lock_guard<mutex> lock(m_map_mutex);
+    if (t_table >= HOLDING_REGS)
+        m_regs[t_table - HOLDING_REGS].resize(t_size, 0);
+    else
+        m_bits[t_table].resize(t_size, 0);
+    return;
+}
+
+size_t ModbusTcpServer::size(Table t_table) const
+{
+    lock_guard<mutex> lock(m_map_mutex);
+    if (t_table >= HOLDING_REGS)
+        return m_regs[t_table - HOLDING_REGS].size();
+    return m_bits[t_table].size();
+}
+
+vector<uint16_t> ModbusTcpServer::getRegs(Table t_table, uint16_t t_addr,
+    uint16_t t_len) const
+{
+    lock_guard<mutex> lock(m_map_mutex);
+    this->checkRange(t_table, true, t_addr, t_len);
+    const uint16_t* regs = m_regs[t_table - HOLDING_REGS].data() + t_addr;
+    return vector<uint16_t>(regs, regs + t_len);
+}
+
+void ModbusTcpServer::setRegs(Table t_table, uint16_t t_addr,
+    const vector<uint16_t>& t_regs)
+{
+    lock_guard<mutex> lock(m_map_mutex);
+    this->checkRange(t_table, true, t_addr, t_regs.size());
+    copy(t_regs.begin(), t_regs.end(),
+        m_regs[t_table - HOLDING_REGS].begin() + t_addr);
+    return;
+}
+
+ModbusBits ModbusTcpServer::getBits(Table t_table, uint16_t t_addr,
+    uint16_t t_len) const
+{
+    lock_guard<mutex> lock(m_map_mutex);
+    this->checkRange(t_table, false, t_addr, t_len);
+    ModbusBits ret(t_len);
+    const uint8_t* bits = m_bits[t_table].data() + t_addr;
+    for (size_t i = 0; i < t_len; i++)
+        if (bits[i])
+            ret.set(i);
+    return ret;
+}
+
+void ModbusTcpServer::setBits(Table t_table, uint16_t t_addr, const ModbusBits& t_bits)
+{
+    lock_guard<mutex> lock(m_map_mutex);
+    this->checkRange(t_table, false, t_addr, t_bits.size());
+    uint8_t* bits = m_bits[t_table].data() + t_addr;
+    for (size_t i = 0; i < t_bits.size(); i++)
+        bits[i] = t_bits[i];
+    return;
+}
+
+void ModbusTcpServer::setReadHook(Hook t_hook)
+{
+    lock_guard<mutex> lock(m_map_mutex);
+    m_read_hook = t_hook;
+    return;
+}
+
+void ModbusTcpServer::setWriteHook(Hook t_hook)
+{
+    lock_guard<mutex> lock(m_map_mutex);
+    m_write_hook = t_hook;
+    return;
+}
+
+ModbusTcpServer::Stats ModbusTcpServer::getStats() const
+{
+    return Stats {m_requests, m_exceptions, m_accepted, m_rejected, m_conn_count};
+}
+
+/*
+ *  P R O T E C T E D   M E T H O D S
+ */
+
+void ModbusTcpServer::processRequest(const Request& t_req, const uint8_t* t_pdu,
+    size_t t_len, vector<uint8_t>& t_resp)
+{
+    // Requests to other units are not answered, like on a serial line
+    uint8_t unit_id = m_unit_id;
+    if ( (unit_id != 0) && (t_req.unit_id != unit_id) )
+        return;
+
+    size_t start = t_resp.size();
+    t_resp.push_back(t_pdu[0]);
+    uint8_t error = 0;
+    {
+        lock_guard<mutex> lock(m_map_mutex);
+        switch (t_pdu[0]) {
+        case Modbus::FC01:
+            error = this->readBits(t_req.unit_id, COILS, t_pdu, t_len, t_resp);
+            break;
+        case Modbus::FC02:
+            error = this->readBits(t_req.unit_id, DISCRETE_INPUTS, t_pdu, t_len, t_resp);
+            break;
+        case Modbus::FC03:
+            error = this->readRegs(t_req.unit_id, HOLDING_REGS, t_pdu, t_len, t_resp);
+            break;
+        case Modbus::FC04:
+            error = this->readRegs(t_req.unit_id, INPUT_REGS, t_pdu, t_len, t_resp);
+            break;
+        case Modbus::FC05:
+        case Modbus::FC15:
+            error = this->writeBits(t_req.unit_id, t_pdu, t_len, t_resp);
+            break;
+        case Modbus::FC06:
+        case Modbus::FC16:
+            error = this->writeRegs(t_req.unit_id, t_pdu, t_len, t_resp);
+            break;
+        case Modbus::FC23:
+            error = this->readWriteRegs(t_req.unit_id, t_pdu, t_len, t_resp);
+            break;
+        default:
+            error = Modbus::ERR1;
+        }
+    }
+
+    if (error) {
+        t_resp.resize(start);
+        t_resp.push_back(t_pdu[0] | Modbus::ERRC);
+        t_resp.push_back(error);
+    }
+    return;
+}
+
+void ModbusTcpServer::sendResponse(const Request& t_req, const vector<uint8_t>& t_pdu)
+{
+    if (t_pdu.empty())
+        return;
+    lock_guard<mutex> lock(m_resp_mutex);
+    if (m_event_fd < 0)
+        return;     // Not running
+    m_responses.emplace_back(t_req, t_pdu);
+    uint64_t one = 1;
+    if (write(m_event_fd, &one, sizeof(one)) < 0)
+        DEBUG_PRINT("Failed to wake server thread (%s)\n", strerror(errno));
+    return;
+}
+
+/*
+ *  P R I V A T E   M E T H O D S
+ */
+
+void ModbusTcpServer::run()
+{
+    struct epoll_event events[MAX_EVENTS];
+    while (!m_stop) {
+        int nfds = epoll_wait(m_epoll_fd, events, MAX_EVENTS, -1);
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            DEBUG_PRINT("epoll_wait() failed (%s)\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            int fd = events[i].data.fd;
+            if (fd == m_listen_fd) {
+                this->acceptConnections();
+            } else if (fd == m_event_fd) {
+                uint64_t value;
+                if (read(m_event_fd, &value, sizeof(value)) < 0)
+                    DEBUG_PRINT("Failed to read event (%s)\n", strerror(errno));
+                this->deliverResponses();
+            } else {
+                // Connection may have been closed by an earlier event
+                auto it = m_conns.find(fd);
+                if (it == m_conns.end())
+                    continue;
+                if (events[i].events & EPOLLERR)
+                    this->closeConnection(fd);
+                else
+                    this->serviceConnection(it->second,
+                        events[i].events & (EPOLLIN | EPOLLHUP));
+            }
+        }
+    }
+    return;
+}
+
+void ModbusTcpServer::acceptConnections()
+{
+    while (true) {
+        int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if ( (errno == EMFILE) || (errno == ENFILE) ) {
+                if (this->refuseConnection())
+                    continue;
+                return;
+            }
+            if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) )
+                DEBUG_PRINT("Failed to accept connection (%s)\n", strerror(errno));
+            return;
+        }
+        if (m_conns.size() >= m_max_conns) {
+            ::close(fd);
+            m_rejected++;
+            DEBUG_PRINT("Refused connection, %zu connections open\n", m_conns.size());
+            continue;
+        }
+
+        // Responses are sent at once; do not wait for more data
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            DEBUG_PRINT("Failed to add connection (%s)\n", strerror(errno));
+            ::close(fd);
+            continue;
+        }
+        Connection& conn = m_conns[fd];
+        conn.fd = fd;
+        conn.id = ++m_next_conn_id;
+        conn.events = EPOLLIN;
+        m_accepted++;
+        m_conn_count = m_conns.size();
+    }
+}
+
+bool ModbusTcpServer::refuseConnection()
+{
+    // The listening socket stays readable while a connection is pending, so
+    // it is accepted with the reserve fd and closed at once
+    if (m_reserve_fd >= 0) {
+        ::close(m_reserve_fd);
+        int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0)
+            ::close(fd);
+        m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            m_rejected++;
+            DEBUG_PRINT("%s\n", "Refused connection, out of file descriptors");
+            return true;
+        }
+        if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+            return false;
+    }
+
+    // No spare fd; wait until a connection is closed
+    DEBUG_PRINT("%s\n", "Out of file descriptors, accepting paused");
+    this->pauseAccept(true);
+    return false;
+}
+
+void ModbusTcpServer::pauseAccept(bool t_pause)
+{
+    struct epoll_event ev {};
+    ev.events = t_pause ? 0u : static_cast<uint32_t>(EPOLLIN);
+    ev.data.fd = m_listen_fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, m_listen_fd, &ev) == 0)
+        m_accept_paused = t_pause;
+    return;
+}
+
+void ModbusTcpServer::serviceConnection(Connection& t_conn, bool t_readable)
+{
+    // Receive directly into the decoder; full while requests are held back
+    size_t space;
+    uint8_t* buf = t_conn.rx.prepare(space);
+    if (t_readable && (space > 0)) {
+        ssize_t nbytes = recv(t_conn.fd, buf, space, 0);
+        if (nbytes == 0) {
+            this->closeConnection(t_conn.fd);
+            return;
+        }
+        if (nbytes < 0) {
+            if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) ) {
+                this->closeConnection(t_conn.fd);
+                return;
+            }
+        } else {
+            t_conn.rx.commit(nbytes);
+        }
+    }
+
+    // Answer requests until done or the client stops reading responses
+    bool more = true;
+    while (more) {
+        if (!this->processFrames(t_conn)) {
+            this->closeConnection(t_conn.fd);
+            return;
+        }
+        more = t_conn.tx.size() - t_conn.tx_pos >= MAX_TX_BACKLOG;
+        if (!this->flush(t_conn)) {
+            this->closeConnection(t_conn.fd);
+            return;
+        }
+        more = more && (t_conn.tx.size() - t_conn.tx_pos < MAX_TX_BACKLOG);
+    }
+
+    // Read only while the backlog is small; wait for writable on backlog
+    size_t backlog = t_conn.tx.size() - t_conn.tx_pos;
+    uint32_t events = (backlog < MAX_TX_BACKLOG) ? static_cast<uint32_t>(EPOLLIN) : 0u;
+    if (backlog > 0)
+        events |= EPOLLOUT;
+    if (events != t_conn.events) {
+        struct epoll_event ev {};
+        ev.events = events;
+        ev.data.fd = t_conn.fd;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, t_conn.fd, &ev) < 0) {
+            this->closeConnection(t_conn.fd);
+            return;
+        }
+        t_conn.events = events;
+    }
+    return;
+}
+
+bool ModbusTcpServer::processFrames(Connection& t_conn)
+{
+    ModbusDecoder::Frame req_frame;
+    while (t_conn.tx.size() - t_conn.tx_pos < MAX_TX_BACKLOG) {
+        try {
+            if (!t_conn.rx.next(req_frame))
+                break;
+        } catch (const BadProtocol& e) {
+            DEBUG_PRINT("Connection %d: %s\n", t_conn.fd, e.what());
+            return false;
+        }
+        const uint8_t* frame = req_frame.data;
+        size_t len = req_frame.len;
+
+        // Transaction ID, protocol ID and unit ID are returned as received
+        Request req {t_conn.fd, t_conn.id, get16(frame), frame[6]};
+        size_t start = t_conn.tx.size();
+        t_conn.tx.insert(t_conn.tx.end(), frame, frame + ModbusTcp::MBAP_LEN);
+        this->processRequest(req, frame + ModbusTcp::MBAP_LEN,
+            len - ModbusTcp::MBAP_LEN, t_conn.tx);
+
+        if (t_conn.tx.size() == start + ModbusTcp::MBAP_LEN)
+            t_conn.tx.resize(start);    // No response (yet)
+        else
+            this->finishResponse(t_conn, start);
+    }
+    return true;
+}
+
+bool ModbusTcpServer::flush(Connection& t_conn)
+{
+    while (t_conn.tx_pos < t_conn.tx.size()) {
+        ssize_t nbytes = send(t_conn.fd, t_conn.tx.data() + t_conn.tx_pos,
+            t_conn.tx.size() - t_conn.tx_pos, MSG_NOSIGNAL);
+        if (nbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+                break;
+            DEBUG_PRINT("Failed to send on connection %d (%s)\n", t_conn.fd,
+                strerror(errno));
+            return false;
+        }
+        t_conn.tx_pos += nbytes;
+    }
+
+    // Drop sent bytes
+    if (t_conn.tx_pos == t_conn.tx.size()) {
+        t_conn.tx.clear();
+        t_conn.tx_pos = 0;
+    } else if (t_conn.tx_pos >= MAX_TX_BACKLOG) {
+        t_conn.tx.erase(t_conn.tx.begin(), t_conn.tx.begin() + t_conn.tx_pos);
+        t_conn.tx_pos = 0;
+    }
+    return true;
+}
+
+void ModbusTcpServer::deliverResponses()
+{
+    vector<pair<Request, vector<uint8_t>>> responses;
+    {
+        lock_guard<mutex> lock(m_resp_mutex);
+        responses.swap(m_responses);
+    }
+
+    vector<int> fds;
+    for (auto& resp : responses) {
+        const Request& req = resp.first;
+        auto it = m_conns.find(req.fd);
+        if ( (it == m_conns.end()) || (it->second.id != req.conn_id) )
+            continue;   // Connection closed meanwhile
+        Connection& conn = it->second;
+        size_t start = conn.tx.size();
+        put16(conn.tx, req.tid);
+        put16(conn.tx, 0x0000);     // Protocol ID
+        put16(conn.tx, 0x0000);     // Length, set by finishResponse()
+        conn.tx.push_back(req.unit_id);
+        conn.tx.insert(conn.tx.end(), resp.second.begin(), resp.second.end());
+        this->finishResponse(conn, start);
+        if (find(fds.begin(), fds.end(), req.fd) == fds.end())
+            fds.push_back(req.fd);
+    }
+
+    // Send; may also answer requests held back by a backlog
+    for (int fd : fds) {
+        auto it = m_conns.find(fd);
+        if (it != m_conns.end())
+            this->serviceConnection(it->second, false);
+    }
+    return;
+}
+
+void ModbusTcpServer::finishResponse(Connection& t_conn, size_t t_start)
+{
+    // Length field counts unit ID and PDU
+    size_t len = t_conn.tx.size() - t_start - 6;
+    t_conn.tx[t_start + 4] = static_cast<uint8_t>(0xFF & (len >> 8));
+    t_conn.tx[t_start + 5] = static_cast<uint8_t>(0xFF & len);
+    m_requests++;
+    if (t_conn.tx[t_start + ModbusTcp::MBAP_LEN] & Modbus::ERRC)
+        m_exceptions++;
+    return;
+}
+
+void ModbusTcpServer::closeConnection(int t_fd)
+{
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, t_fd, nullptr);
+    ::close(t_fd);
+    m_conns.erase(t_fd);
+    m_conn_count = m_conns.size();
+
+    if (m_accept_paused) {
+        if (m_reserve_fd < 0)
+            m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        this->pauseAccept(false);
+    }
+    return;
+}
+
+void ModbusTcpServer::shutdown()
+{
+    for (auto& conn : m_conns)
+        ::close(conn.first);
+    m_conns.clear();
+    m_conn_count = 0;
+    if (m_epoll_fd >= 0)
+        ::close(m_epoll_fd);
+    m_epoll_fd = -1;
+    if (m_reserve_fd >= 0)
+        ::close(m_reserve_fd);
+    m_reserve_fd = -1;
+    m_accept_paused = false;
+
+    // Deferred responses may be sent concurrently
+    lock_guard<mutex> lock(m_resp_mutex);
+    m_responses.clear();
+    if (m_event_fd >= 0)
+        ::close(m_event_fd);
+    m_event_fd = -1;
+    return;
+}
+
+uint8_t ModbusTcpServer::readBits(uint8_t t_unit_id, Table t_table,
+    const uint8_t* t_pdu, size_t t_len, vector<uint8_t>& t_resp)
+{
+    if (t_len != 5)
+        return Modbus::ERR3;
+    uint16_t addr = get16(t_pdu + 1), qty = get16(t_pdu + 3);
+    if ( (qty == 0) || (qty > Modbus::MAX_READ_BITS) )
+        return Modbus::ERR3;
+    if (static_cast<size_t>(addr) + qty > m_bits[t_table].size())
+        return Modbus::ERR2;
+    uint8_t error = this->callHook(m_read_hook, t_unit_id, t_table, addr, qty);
+    if (error)
+        return error;
+
+    // Pack bits; bit 0 is the LSB of the first byte
+    const uint8_t* bits = m_bits[t_table].data() + addr;
+    size_t pos = t_resp.size() + 1;
+    t_resp.push_back(static_cast<uint8_t>((qty + 7) / 8));
+    t_resp.resize(pos + (qty + 7) / 8, 0);
+    for (size_t i = 0; i < qty; i++)
+        t_resp[pos + (i >> 3)] |= bits[i] << (i & 0x07);
+    return 0;
+}
+
+uint8_t ModbusTcpServer::readRegs(uint8_t t_unit_id, Table t_table,
+    const uint8_t* t_pdu, size_t t_len, vector<uint8_t>& t_resp)
+{
+    if (t_len != 5)
+        return Modbus::ERR3;
+    uint16_t addr = get16(t_pdu + 1), qty = get16(t_pdu + 3);
+    if ( (qty == 0) || (qty > Modbus::MAX_READ_REGS) )
+        return Modbus::ERR3;
+    const vector<uint16_t>& table = m_regs[t_table - HOLDING_REGS];
+    if (static_cast<size_t>(addr) + qty > table.size())
+        return Modbus::ERR2;
+    uint8_t error = this->callHook(m_read_hook, t_unit_id, t_table, addr, qty);
+    if (error)
+        return error;
+
+    t_resp.push_back(static_cast<uint8_t>(2 * qty));
+    for (size_t i = 0; i < qty; i++)
+        put16(t_resp, table[addr + i]);
+    return 0;
+}
+
+uint8_t ModbusTcpServer::writeBits(uint8_t t_unit_id, const uint8_t* t_pdu,
+    size_t t_len, vector<uint8_t>& t_resp)
+{
+    uint16_t qty = 1;
+    const uint8_t* packed = nullptr;
+    uint8_t single = 0;
+    if (t_pdu[0] == Modbus::FC05) {
+        if ( (t_len != 5) || ((get16(t_pdu + 3) != 0xFF00) && (get16(t_pdu + 3) != 0)) )
+            return Modbus::ERR3;
+        single = t_pdu[3] ? 1 : 0;
+    } else {
+        if (t_len < 6)
+            return Modbus::ERR3;
+        qty = get16(t_pdu + 3);
+        if ( (qty == 0) || (qty > Modbus::MAX_WRITE_BITS)
+             || (t_pdu[5] != (qty + 7) / 8) || (t_len != 6u + t_pdu[5]) )
+            return Modbus::ERR3;
+        packed = t_pdu + 6;
+    }
+    uint16_t addr = get16(t_pdu + 1);
+    if (static_cast<size_t>(addr) + qty > m_bits[COILS].size())
+        return Modbus::ERR2;
+
+    // Keep old values to undo rejected writes
+    uint8_t* bits = m_bits[COILS].data() + addr;
+    uint8_t old[Modbus::MAX_WRITE_BITS];
+    copy(bits, bits + qty, old);
+    for (size_t i = 0; i < qty; i++)
+        bits[i] = packed ? (packed[i >> 3] >> (i & 0x07)) & 0x01 : single;
+    uint8_t error = this->callHook(m_write_hook, t_unit_id, COILS, addr, qty);
+    if (error) {
+        copy(old, old + qty, bits);
+        return error;
+    }
+
+    // Response echoes address and value/quantity
+    t_resp.insert(t_resp.end(), t_pdu + 1, t_pdu + 5);
+    return 0;
+}
+
+uint8_t ModbusTcpServer::writeRegs(uint8_t t_unit_id, const uint8_t* t_pdu,
+    size_t t_len, vector<uint8_t>& t_resp)
+{
+    uint16_t qty = 1;
+    const uint8_t* data = t_pdu + 3;
+    if (t_pdu[0] == Modbus::FC06) {
+        if (t_len != 5)
+            return Modbus::ERR3;
+    } else {
+        if (t_len < 6)
+            return Modbus::ERR3;
+        qty = get16(t_pdu + 3);
+        if ( (qty == 0) || (qty > Modbus::MAX_WRITE_REGS)
+             || (t_pdu[5] != 2 * qty) || (t_len != 6u + t_pdu[5]) )
+            return Modbus::ERR3;
+        data = t_pdu + 6;
+    }
+    uint16_t addr = get16(t_pdu + 1);
+    if (static_cast<size_t>(addr) + qty > m_regs[0].size())
+        return Modbus::ERR2;
+
+    // Keep old values to undo rejected writes
+    uint16_t* regs = m_regs[0].data() + addr;
+    uint16_t old[Modbus::MAX_WRITE_REGS];
+    copy(regs, regs + qty, old);
+    for (size_t i = 0; i < qty; i++)
+        regs[i] = get16(data + 2*i);
+    uint8_t error = this->callHook(m_write_hook, t_unit_id, HOLDING_REGS, addr, qty);
+    if (error) {
+        copy(old, old + qty, regs);
+        return error;
+    }
+
+    // Response echoes address and value/quantity
+    t_resp.insert(t_resp.end(), t_pdu + 1, t_pdu + 5);
+    return 0;
+}
+
+uint8_t ModbusTcpServer::readWriteRegs(uint8_t t_unit_id, const uint8_t* t_pdu,
+    size_t t_len, vector<uint8_t>& t_resp)
+{
+    if (t_len < 10)
+        return Modbus::ERR3;
+    uint16_t read_addr = get16(t_pdu + 1), read_qty = get16(t_pdu + 3);
+    uint16_t write_addr = get16(t_pdu + 5), write_qty = get16(t_pdu + 7);
+    if ( (read_qty == 0) || (read_qty > Modbus::MAX_READ_REGS)
+         || (write_qty == 0) || (write_qty > Modbus::MAX_RW_WRITE_REGS)
+         || (t_pdu[9] != 2 * write_qty) || (t_len != 10u + t_pdu[9]) )
+        return Modbus::ERR3;
+    vector<uint16_t>& table = m_regs[0];
+    if ( (static_cast<size_t>(read_addr) + read_qty > table.size())
+         || (static_cast<size_t>(write_addr) + write_qty > table.size()) )
+        return Modbus::ERR2;
+
+    // Write first; undone if the write or the read is rejected
+    uint16_t* regs = table.data() + write_addr;
+    uint16_t old[Modbus::MAX_RW_WRITE_REGS];
+    copy(regs, regs + write_qty, old);
+    for (size_t i = 0; i < write_qty; i++)
+        regs[i] = get16(t_pdu + 10 + 2*i);
+    uint8_t error = this->callHook(m_write_hook, t_unit_id, HOLDING_REGS,
+        write_addr, write_qty);
+    if (!error)
+        error = this->callHook(m_read_hook, t_unit_id, HOLDING_REGS,
+            read_addr, read_qty);
+    if (error) {
+        copy(old, old + write_qty, regs);
+        return error;
+    }
+
+    t_resp.push_back(static_cast<uint8_t>(2 * read_qty));
+    for (size_t i = 0; i < read_qty; i++)
+        put16(t_resp, table[read_addr + i]);
+    return 0;
+}
+
+uint8_t ModbusTcpServer::callHook(const Hook& t_hook, uint8_t t_unit_id,
+    Table t_table, uint16_t t_addr, uint16_t t_len)
+{
+    if (!t_hook)
+        return 0;
+
+    Access access {t_unit_id, t_table, t_addr, t_len, nullptr, nullptr};
+    if (t_table >= HOLDING_REGS)
+        access.regs = m_regs[t_table - HOLDING_REGS].data() + t_addr;
+    else
+        access.bits = m_bits[t_table].data() + t_addr;
+
+    // Failing hooks are reported as device failure
+    try {
+        return t_hook(access);
+    } catch (const exception& e) {
+        DEBUG_PRINT("Hook failed: %s\n", e.what());
+        return Modbus::ERR4;
+    }
+}
+
+void ModbusTcpServer::checkRange(Table t_table, bool t_regs, uint16_t t_addr,
+    size_t t_len) const
+{
+    if ( (t_table >= HOLDING_REGS) != t_regs )
+        throw BadProtocol(string("Table ") + to_string(t_table) + " is not a "
+            + (t_regs ? "register" : "bit") + " table");
+    size_t size = t_regs ? m_regs[t_table - HOLDING_REGS].size() : m_bits[t_table].size();
+    if (static_cast<size_t>(t_addr) + t_len > size)
+        throw BadProtocol("Range " + to_string(t_addr) + " - "
+            + to_string(t_addr + t_len) + " exceeds table size " + to_string(size));
+    return;
+}
+
+void ModbusTcpServer::checkAndThrow(int t_stat, const string& t_msg) const
+{
+    if (t_stat < 0) {
+        int error = errno;
+        stringstream err_msg;
+        err_msg << "modbus-tcp-server;" << m_ip_addr << ";" << m_port << " - "
+            << t_msg << " (" << strerror(error) << ", " << error << ")";
+        DEBUG_PRINT("%s\n", err_msg.str().c_str());
+        throw BadConnection(err_msg.str(), error);
+    }
+    return;
+}
+
+}
@@ -0,0 +1,171 @@
+#include <labkit/protocols/modbuswritebatch.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+#include <utility>
+
+using namespace std;
+
+namespace labkit
+{
+
+void ModbusWriteBatch::writeReg(uint8_t t_unit_id, uint16_t t_addr, 
+    uint16_t t_value)
+{
+    m_writes.push_back( {t_unit_id, false, t_addr, t_value, m_segment} );
+    return;
+}
+
+void ModbusWriteBatch::writeCoil(uint8_t t_unit_id, uint16_t t_addr, bool t_ena)
+{
+    m_writes.push_back( {t_unit_id, true, t_addr, t_ena, m_segment} );
+    return;
+}
+
+void ModbusWriteBatch::barrier()
+{
+    if ( !m_writes.empty() && (m_writes.back().segment == m_segment) )
+        m_segment++;
+    return;
+}
+
+void ModbusWriteBatch::clear()
+{
+    m_writes.clear();
+    m_segment = 0;
+    return;
+}
+
+void ModbusWriteBatch::setMaxRegs(uint16_t t_len)
+{
+    if ( (t_len == 0) || (t_len > Modbus::MAX_WRITE_REGS) )
+        throw BadProtocol("Registers per request must be within 1 - " 
+            + to_string(Modbus::MAX_WRITE_REGS));
+    m_max_regs = t_len;
+    return;
+}
+
+void ModbusWriteBatch::setMaxCoils(uint16_t t_len)
+{
+    if ( (t_len == 0) || (t_len > Modbus::MAX_WRITE_BITS) )
+        throw BadProtocol("Coils per request must be within 1 - " 
+            + to_string(Modbus::MAX_WRITE_BITS));
+    m_max_coils = t_len;
+    return;
+}
+
+vector<ModbusWriteBatch::Result> ModbusWriteBatch::execute()
+{
+    if (!m_modbus)
+        throw BadProtocol("No MODBUS protocol set for write batch");
+
+    vector<Result> results;
+    results.reserve(m_writes.size());
+    for (const auto& w : m_writes)
+        results.push_back( {w.unit_id, w.coil, w.addr, false, ""} );
+    m_transactions = 0;
+
+    // Sort within segments; stable, so repeated writes keep their order
+    vector<size_t> order(m_writes.size());
+    iota(order.begin(), order.end(), 0);
+    auto key = [this](size_t i) {
+        const Write& w = m_writes[i];
+        return make_tuple(w.segment, w.unit_id, w.coil, w.addr);
+    };
+    stable_sort(order.begin(), order.end(), [&key](size_t a, size_t b) {
+        return key(a) < key(b);
+    });
+
+    // Only the last write to an address is sent; earlier ones get its result
+    vector<size_t> unique;
+    vector<pair<size_t, size_t>> superseded;
+    for (size_t i : order) {
+        if ( !unique.empty() && (key(unique.back()) == key(i)) ) {
+            superseded.push_back( {unique.back(), i} );
+            unique.back() = i;
+        } else {
+            unique.push_back(i);
+        }
+    }
+
+    // Split into runs of consecutive addresses within the protocol limits
+    size_t first = 0;
+    for (size_t k = 1; k <= unique.size(); k++) {
+        bool split = (k == unique.size());
+        if (!split) {
+            const Write& prev = m_writes[unique[k-1]];
+            const Write& cur = m_writes[unique[k]];
+            split = (cur.segment != prev.segment) || (cur.unit_id != prev.unit_id)
+                || (cur.coil != prev.coil) || (cur.addr != prev.addr + 1)
+                || (k - first >= (cur.coil ? m_max_coils : m_max_regs));
+        }
+        if (split) {
+            this->writeRun(unique, first, k, results);
+            first = k;
+        }
+    }
+    for (auto it = superseded.rbegin(); it != superseded.rend(); it++) {
+        results[it->first].ok = results[it->second].ok;
+        results[it->first].error = results[it->second].error;
+    }
+
+    DEBUG_PRINT("Wrote %zu values with %zu transactions\n", m_writes.size(), 
+        m_transactions);
+    this->clear();
+    return results;
+}
+
+/*
+ *  P R I V A T E   M E T H O D S
+ */
+
+void ModbusWriteBatch::writeRun(const vector<size_t>& t_order, size_t t_first,
+    size_t t_last, vector<Result>& t_results)
+{
+    const Write& head = m_writes[t_order[t_first]];
+    size_t len = t_last - t_first;
+    try {
+        m_transactions++;
+        if (head.coil) {
+            if (len == 1) {
+                m_modbus->writeSingleCoil(head.unit_id, head.addr, head.value != 0);
+            } else {
+                ModbusBits ena(len);
+                for (size_t k = t_first; k < t_last; k++)
+                    ena.set(k - t_first, m_writes[t_order[k]].value != 0);
+                m_modbus->writeMultipleCoils(head.unit_id, head.addr, ena);
+            }
+        } else {
+            if (len == 1) {
+                m_modbus->writeSingleHoldingReg(head.unit_id, head.addr, head.value);
+            } else {
+                vector<uint16_t> regs;
+                for (size_t k = t_first; k < t_last; k++)
+                    regs.push_back(m_writes[t_order[k]].value);
+                m_modbus->writeMultipleHoldingRegs(head.unit_id, head.addr, regs);
+            }
+        }
+        for (size_t k = t_first; k < t_last; k++)
+            t_results[t_order[k]].ok = true;
+    } catch (const BadConnection&) {
+        throw;
+    } catch (const BadProtocol& e) {
+        // Rejected; bisect to find the failing addresses
+        if (len > 1) {
+            size_t mid = t_first + len / 2;
+            this->writeRun(t_order, t_first, mid, t_results);
+            this->writeRun(t_order, mid, t_last, t_results);
+            return;
+        }
+        t_results[t_order[t_first]].error = e.what();
+    } catch (const Exception& e) {
+        for (size_t k = t_first; k < t_last; k++)
+            t_results[t_order[k]].error = e.what();
+    }
+    return;
+}
+
+}
@@ -0,0 +1,435 @@
+#include <labkit/comms/rfc2217comm.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <string>
+#include <sstream>
+#include <string.h>
+
+using namespace std;
+
+namespace labkit {
+
+Rfc2217Comm::Rfc2217Comm(std::string t_ip_addr, unsigned t_port,
+    BaudRate t_baud, CharSize t_csize, Parity t_par, StopBits t_sbits)
+      : Rfc2217Comm()
+{
+    this->open(t_ip_addr, t_port, t_baud, t_csize, t_par, t_sbits);
+    return;
+}
+
+Rfc2217Comm::~Rfc2217Comm()
+{
+    if (this->good())
+        this->close();
+    return;
+}
+
+void Rfc2217Comm::open()
+{
+    this->open(m_ip_addr, m_port, m_baud, m_csize, m_par, m_sbits);
+    return;
+}
+
+void Rfc2217Comm::open(std::string t_ip_addr, unsigned t_port,
+    BaudRate t_baud, CharSize t_csize, Parity t_par, StopBits t_sbits)
+{
+    this->setIp(t_ip_addr);
+    this->setPort(t_port);
+    m_tcpip.open(m_ip_addr, m_port);
+
+    // Reset telnet parser, drop data of previous connections
+    m_rx_state = RX_DATA;
+    m_rx_sb.clear();
+
+    // Transparent 8-bit channel and com port control
+    this->sendNegotiation(WILL, BINARY);
+    this->sendNegotiation(DO, BINARY);
+    this->sendNegotiation(WILL, SGA);
+    this->sendNegotiation(DO, SGA);
+    this->sendNegotiation(WILL, COM_PORT_OPT);
+
+    this->disableRtsCts();
+    this->setBaud(t_baud);
+    this->setCharSize(t_csize);
+    this->setParity(t_par);
+    this->setStopBits(t_sbits);
+    this->applySettings();
+
+    m_good = m_tcpip.good();
+    return;
+}
+
+void Rfc2217Comm::close()
+{
+    m_tcpip.close();
+    m_good = m_tcpip.good();
+    return;
+}
+
+int Rfc2217Comm::writeRaw(const uint8_t* t_data, size_t t_len)
+{
+    if (m_update_settings)
+        this->applySettings();
+
+    // Fast path: nothing to escape
+    if ( memchr(t_data, IAC, t_len) == NULL )
+        return m_tcpip.writeRaw(t_data, t_len);
+
+    // Data bytes equal to IAC have to be doubled
+    m_tx_buf.clear();
+    m_tx_buf.reserve(2*t_len);
+    for (size_t i = 0; i < t_len; i++) {
+        m_tx_buf.push_back(t_data[i]);
+        if (t_data[i] == IAC)
+            m_tx_buf.push_back(IAC);
+    }
+    m_tcpip.writeRaw(m_tx_buf.data(), m_tx_buf.size());
+    return t_len;
+}
+
+int Rfc2217Comm::readRaw(uint8_t* t_data, size_t t_max_len, unsigned t_timeout_ms)
+{
+    if (m_update_settings)
+        this->applySettings();
+
+    // Telnet commands are removed from the stream, keep reading until actual
+    // data was received
+    int nbytes = 0;
+    size_t len = 0;
+    do {
+        nbytes = m_tcpip.readRaw(t_data, t_max_len, t_timeout_ms);
+        len = this->filterTelnet(t_data, nbytes);
+    } while ( (len == 0) && (nbytes > 0) );
+
+    return len;
+}
+
+std::string Rfc2217Comm::getInfo() const noexcept
+{
+    // Format example: rfc2217;192.168.1.100:2217;9600;8N1
+    stringstream ret {""};
+    ret  << "rfc2217;" << m_ip_addr << ":" << m_port << ";"
+         << baudToInt(m_baud) << ";";
+    ret << cSizeToInt(m_csize) << parToChar(m_par) << m_sbits;
+    return ret.str();
+}
+
+void Rfc2217Comm::setIp(std::string t_ip_addr)
+{
+    m_ip_addr = t_ip_addr;
+    m_tcpip.setIp(m_ip_addr);
+    DEBUG_PRINT("Set ip address to %s\n", m_ip_addr.c_str());
+    return;
+}
+
+void Rfc2217Comm::setPort(unsigned t_port)
+{
+    m_port = t_port;
+    m_tcpip.setPort(m_port);
+    DEBUG_PRINT("Set port to %u\n", m_port);
+    return;
+}
+
+void Rfc2217Comm::setBaud(BaudRate t_baud)
+{
+    DEBUG_PRINT("Set baudrate to %u\n", baudToInt(t_baud));
+    m_baud = t_baud;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::setCharSize(CharSize t_csize)
+{
+    DEBUG_PRINT("Set number of bits to %i\n", cSizeToInt(t_csize));
+    m_csize = t_csize;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::setStopBits(StopBits t_sbits)
+{
+    DEBUG_PRINT("Set number of stop bits to %i\n", t_sbits);
+    m_sbits = t_sbits;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::setParity(Parity t_par)
+{
+    DEBUG_PRINT("Set parity to %s\n", parToStr(t_par).c_str());
+    m_par = t_par;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::applySettings()
+{
+    DEBUG_PRINT("%s\n", "Applying settings to server");
+
+    // Baud rate is sent as 4 byte integer in network byte order
+    uint32_t baud = baudToInt(m_baud);
+    uint8_t val[4] = {
+        static_cast<uint8_t>(0xFF & (baud >> 24)),
+        static_cast<uint8_t>(0xFF & (baud >> 16)),
+        static_cast<uint8_t>(0xFF & (baud >> 8)),
+        static_cast<uint8_t>(0xFF & baud)
+    };
+    this->sendComPortCmd(SET_BAUDRATE, val, 4);
+
+    val[0] = static_cast<uint8_t>(cSizeToInt(m_csize));
+    this->sendComPortCmd(SET_DATASIZE, val, 1);
+
+    switch (m_par)
+    {
+        case PAR_NONE: val[0] = 1; break;
+        case PAR_ODD:  val[0] = 2; break;
+        case PAR_EVEN: val[0] = 3; break;
+    }
+    this->sendComPortCmd(SET_PARITY, val, 1);
+
+    switch (m_sbits)
+    {
+        case STOP_1: val[0] = 1; break;
+        case STOP_2: val[0] = 2; break;
+    }
+    this->sendComPortCmd(SET_STOPSIZE, val, 1);
+
+    this->sendComPortCmd(SET_CONTROL, &m_flc, 1);
+
+    // No need to wait for the acknowledgements; the server processes the
+    // commands in order before any subsequent data
+    m_update_settings = false;
+    return;
+}
+
+void Rfc2217Comm::enableRtsCts()
+{
+    DEBUG_PRINT("%s\n", "Enabled RTS/CTS flow control");
+    m_flc = FLOW_HARDWARE;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::disableRtsCts()
+{
+    DEBUG_PRINT("%s\n", "Disabled hardware flow control");
+    m_flc = FLOW_NONE;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::enableDtrDsr()
+{
+    DEBUG_PRINT("%s\n", "Enabled DSR flow control");
+    m_flc = FLOW_DSR;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::disableDtrDsr()
+{
+    DEBUG_PRINT("%s\n", "Disabled hardware flow control");
+    m_flc = FLOW_NONE;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::enableXOnXOff(char t_xon, char t_xoff)
+{
+    // RFC 2217 does not allow to configure the XON/XOFF characters
+    if ( (t_xon != 0x11) || (t_xoff != 0x13) )
+        throw DeviceError("Custom XON/XOFF characters are not supported by "
+            "RFC 2217");
+    DEBUG_PRINT("%s\n", "Enabled XON/XOFF flow control");
+    m_flc = FLOW_XONXOFF;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::disableXOnXOff()
+{
+    DEBUG_PRINT("%s\n", "Disabled XON/XOFF flow control");
+    m_flc = FLOW_NONE;
+    m_update_settings = true;
+    return;
+}
+
+void Rfc2217Comm::setDtr()
+{
+    DEBUG_PRINT("%s\n", "Setting DTR");
+    uint8_t val = DTR_ON;
+    this->sendComPortCmd(SET_CONTROL, &val, 1);
+    return;
+}
+
+void Rfc2217Comm::clearDtr()
+{
+    DEBUG_PRINT("%s\n", "Clearing DTR");
+    uint8_t val = DTR_OFF;
+    this->sendComPortCmd(SET_CONTROL, &val, 1);
+    return;
+}
+
+void Rfc2217Comm::setRts()
+{
+    DEBUG_PRINT("%s\n", "Setting RTS");
+    uint8_t val = RTS_ON;
+    this->sendComPortCmd(SET_CONTROL, &val, 1);
+    return;
+}
+
+void Rfc2217Comm::clearRts()
+{
+    DEBUG_PRINT("%s\n", "Clearing RTS");
+    uint8_t val = RTS_OFF;
+    this->sendComPortCmd(SET_CONTROL, &val, 1);
+    return;
+}
+
+/*
+ *      P R I V A T E   M E T H O D S
+ */
+
+void Rfc2217Comm::sendNegotiation(uint8_t t_cmd, uint8_t t_opt)
+{
+    uint8_t msg[3] = {IAC, t_cmd, t_opt};
+    m_tcpip.writeRaw(msg, sizeof(msg));
+    return;
+}
+
+void Rfc2217Comm::sendComPortCmd(uint8_t t_cmd, const uint8_t* t_val,
+    size_t t_len)
+{
+    // IAC SB COM-PORT-OPTION <cmd> <value...> IAC SE
+    vector<uint8_t> msg {IAC, SB, COM_PORT_OPT, t_cmd};
+    for (size_t i = 0; i < t_len; i++) {
+        msg.push_back(t_val[i]);
+        if (t_val[i] == IAC)
+            msg.push_back(IAC);
+    }
+    msg.push_back(IAC);
+    msg.push_back(SE);
+    DEBUG_PRINT_BYTE_DATA(msg.data(), msg.size(), "COM-PORT-OPTION command %u: ",
+        t_cmd);
+    m_tcpip.writeRaw(msg.data(), msg.size());
+    return;
+}
+
+size_t Rfc2217Comm::filterTelnet(uint8_t* t_data, size_t t_len)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < t_len; i++) {
+        uint8_t c = t_data[i];
+        switch (m_rx_state)
+        {
+            case RX_DATA:
+            if (c == IAC)
+                m_rx_state = RX_IAC;
+            else
+                t_data[len++] = c;
+            break;
+
+            case RX_IAC:
+            if (c == IAC) {             // Escaped data byte 0xFF
+                t_data[len++] = c;
+                m_rx_state = RX_DATA;
+            } else if ( (c >= WILL) && (c <= DONT) ) {
+                m_rx_cmd = c;
+                m_rx_state = RX_OPT;
+            } else if (c == SB) {
+                m_rx_sb.clear();
+                m_rx_state = RX_SB;
+            } else {                    // NOP, GA, ... are ignored
+                m_rx_state = RX_DATA;
+            }
+            break;
+
+            case RX_OPT:
+            this->handleNegotiation(m_rx_cmd, c);
+            m_rx_state = RX_DATA;
+            break;
+
+            case RX_SB:
+            if (c == IAC)
+                m_rx_state = RX_SB_IAC;
+            else
+                m_rx_sb.push_back(c);
+            break;
+
+            case RX_SB_IAC:
+            if (c == IAC) {
+                m_rx_sb.push_back(c);
+                m_rx_state = RX_SB;
+            } else {
+                if (c == SE)
+                    this->handleSubnegotiation();
+                m_rx_state = RX_DATA;
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+void Rfc2217Comm::handleNegotiation(uint8_t t_cmd, uint8_t t_opt)
+{
+    DEBUG_PRINT("Received telnet negotiation %u %u\n", t_cmd, t_opt);
+    bool supported = (t_opt == BINARY) || (t_opt == SGA) ||
+        (t_opt == COM_PORT_OPT);
+
+    switch (t_cmd)
+    {
+        // Options we support have already been offered/requested in open()
+        case DO:
+        if (!supported)
+            this->sendNegotiation(WONT, t_opt);
+        break;
+
+        case WILL:
+        if (!supported)
+            this->sendNegotiation(DONT, t_opt);
+        break;
+
+        case DONT:
+        if (t_opt == COM_PORT_OPT)
+            throw BadProtocol(this->getInfo() + " - Server does not support "
+                "RFC 2217 com port control");
+        break;
+
+        default:
+        break;
+    }
+    return;
+}
+
+void Rfc2217Comm::handleSubnegotiation()
+{
+    // Subnegotiation: <option> <cmd> <value...>
+    if ( (m_rx_sb.size() < 2) || (m_rx_sb.at(0) != COM_PORT_OPT) )
+        return;
+
+    uint8_t cmd = m_rx_sb.at(1);
+    switch (cmd)
+    {
+        case SERVER_OFFSET + NOTIFY_LINESTATE:
+        if (m_rx_sb.size() > 2)
+            m_line_state = m_rx_sb.at(2);
+        DEBUG_PRINT("Line state 0x%02X\n", m_line_state);
+        break;
+
+        case SERVER_OFFSET + NOTIFY_MODEMSTATE:
+        if (m_rx_sb.size() > 2)
+            m_modem_state = m_rx_sb.at(2);
+        DEBUG_PRINT("Modem state 0x%02X\n", m_modem_state);
+        break;
+
+        default:    // Acknowledgements of our settings
+        DEBUG_PRINT_BYTE_DATA(m_rx_sb.data(), m_rx_sb.size(),
+            "Server response %u: ", cmd);
+        break;
+    }
+    return;
+}
+
+}
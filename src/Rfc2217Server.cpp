@@ -0,0 +1,457 @@
+#include <labkit/comms/rfc2217server.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <sstream>
+
+using namespace std;
+
+namespace labkit
+{
+
+namespace
+{
+
+// Telnet definitions (RFC 854 & RFC 2217), local to the server
+enum Telnet : uint8_t {
+    SE   = 240,
+    SB   = 250,
+    WILL = 251,
+    WONT = 252,
+    DO   = 253,
+    DONT = 254,
+    IAC  = 255
+};
+
+enum TelnetOption : uint8_t {
+    BINARY       = 0,
+    SGA          = 3,
+    COM_PORT_OPT = 44
+};
+
+enum ComPortCmd : uint8_t {
+    SET_BAUDRATE        = 1,
+    SET_DATASIZE        = 2,
+    SET_PARITY          = 3,
+    SET_STOPSIZE        = 4,
+    SET_CONTROL         = 5,
+    NOTIFY_LINESTATE    = 6,
+    NOTIFY_MODEMSTATE   = 7,
+    SERVER_OFFSET       = 100
+};
+
+enum ControlValue : uint8_t {
+    FLOW_QUERY    = 0,
+    FLOW_NONE     = 1,
+    FLOW_XONXOFF  = 2,
+    FLOW_HARDWARE = 3,
+    DTR_QUERY     = 7,
+    DTR_ON        = 8,
+    DTR_OFF       = 9,
+    RTS_QUERY     = 10,
+    RTS_ON        = 11,
+    RTS_OFF       = 12,
+    FLOW_DSR      = 19
+};
+
+}
+
+Rfc2217Server::~Rfc2217Server()
+{
+    this->stop();
+    if (m_listen_fd >= 0)
+        ::close(m_listen_fd);
+    return;
+}
+
+void Rfc2217Server::listen(unsigned t_port, const string& t_ip_addr)
+{
+    if (m_listen_fd >= 0)
+        throw BadConnection("RFC 2217 server is already listening on port "
+            + to_string(m_port));
+    m_port = t_port;
+
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(t_port);
+    if (inet_aton(t_ip_addr.c_str(), &addr.sin_addr) == 0)
+        throw BadConnection("Address " + t_ip_addr + " is not supported.");
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    checkAndThrow(fd, "Could not open socket.");
+
+    int one = 1;
+    int stat = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (stat == 0)
+        stat = ::bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (stat == 0)
+        stat = ::listen(fd, 4);
+    if (stat < 0) {
+        int error = errno;
+        ::close(fd);
+        errno = error;
+        checkAndThrow(stat, "Failed to listen.");
+    }
+
+    // Port may have been chosen by the system
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &addr_len) == 0)
+        m_port = ntohs(addr.sin_port);
+    m_listen_fd = fd;
+    DEBUG_PRINT("RFC 2217 server listening on %s:%u\n", t_ip_addr.c_str(), m_port);
+    return;
+}
+
+void Rfc2217Server::start()
+{
+    if (this->running())
+        return;
+    if (m_listen_fd < 0)
+        throw BadConnection("RFC 2217 server is not listening");
+
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    checkAndThrow(m_event_fd, "Failed to create event.");
+    m_stop = false;
+    m_thread = thread(&Rfc2217Server::run, this);
+    return;
+}
+
+void Rfc2217Server::stop()
+{
+    if (!this->running())
+        return;
+    m_stop = true;
+    uint64_t one = 1;
+    if (write(m_event_fd, &one, sizeof(one)) < 0)
+        DEBUG_PRINT("Failed to wake server thread (%s)\n", strerror(errno));
+    m_thread.join();
+    ::close(m_event_fd);
+    m_event_fd = -1;
+    return;
+}
+
+Rfc2217Server::Settings Rfc2217Server::getSettings() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_settings;
+}
+
+void Rfc2217Server::notifyLineState(uint8_t t_state)
+{
+    lock_guard<mutex> lock(m_mutex);
+    this->queueComPortCmd(SERVER_OFFSET + NOTIFY_LINESTATE, &t_state, 1);
+    this->flush();
+    return;
+}
+
+void Rfc2217Server::notifyModemState(uint8_t t_state)
+{
+    lock_guard<mutex> lock(m_mutex);
+    this->queueComPortCmd(SERVER_OFFSET + NOTIFY_MODEMSTATE, &t_state, 1);
+    this->flush();
+    return;
+}
+
+/*
+ *  P R I V A T E   M E T H O D S
+ */
+
+void Rfc2217Server::run()
+{
+    uint8_t buf[4096];
+    while (!m_stop) {
+        struct pollfd fds[3] = {
+            {m_event_fd, POLLIN, 0},
+            {m_listen_fd, POLLIN, 0},
+            {m_conn_fd, POLLIN, 0}
+        };
+        nfds_t nfds = (m_conn_fd >= 0) ? 3 : 2;
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            DEBUG_PRINT("poll() failed (%s)\n", strerror(errno));
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        if (fds[1].revents & POLLIN)
+            this->acceptConnection();
+
+        // Connection may have been replaced
+        if ( (nfds < 3) || !fds[2].revents || (fds[2].fd != m_conn_fd) )
+            continue;
+        ssize_t nbytes = recv(m_conn_fd, buf, sizeof(buf), 0);
+        if (nbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            this->closeConnection();
+            continue;
+        }
+        if (nbytes == 0) {
+            this->closeConnection();
+            continue;
+        }
+        lock_guard<mutex> lock(m_mutex);
+        this->handleData(buf, nbytes);
+        this->flush();
+    }
+    this->closeConnection();
+    return;
+}
+
+void Rfc2217Server::acceptConnection()
+{
+    int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+        DEBUG_PRINT("Failed to accept connection (%s)\n", strerror(errno));
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    this->closeConnection();
+    lock_guard<mutex> lock(m_mutex);
+    m_conn_fd = fd;
+    m_rx_state = RX_DATA;
+    m_rx_sb.clear();
+    m_tx_buf.clear();
+    DEBUG_PRINT("%s\n", "RFC 2217 client connected");
+    return;
+}
+
+void Rfc2217Server::closeConnection()
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (m_conn_fd < 0)
+        return;
+    ::close(m_conn_fd);
+    m_conn_fd = -1;
+    return;
+}
+
+void Rfc2217Server::handleData(const uint8_t* t_data, size_t t_len)
+{
+    for (size_t i = 0; i < t_len; i++) {
+        uint8_t c = t_data[i];
+        switch (m_rx_state)
+        {
+            case RX_DATA:
+            if (c == IAC) {
+                m_rx_state = RX_IAC;
+            } else {
+                m_tx_buf.push_back(c);      // Loopback
+                m_bytes_rx++;
+            }
+            break;
+
+            case RX_IAC:
+            if (c == IAC) {                 // Escaped data byte 0xFF
+                m_tx_buf.push_back(IAC);
+                m_tx_buf.push_back(IAC);
+                m_bytes_rx++;
+                m_rx_state = RX_DATA;
+            } else if ( (c >= WILL) && (c <= DONT) ) {
+                m_rx_cmd = c;
+                m_rx_state = RX_OPT;
+            } else if (c == SB) {
+                m_rx_sb.clear();
+                m_rx_state = RX_SB;
+            } else {
+                m_rx_state = RX_DATA;
+            }
+            break;
+
+            case RX_OPT:
+            this->handleNegotiation(m_rx_cmd, c);
+            m_rx_state = RX_DATA;
+            break;
+
+            case RX_SB:
+            if (c == IAC)
+                m_rx_state = RX_SB_IAC;
+            else
+                m_rx_sb.push_back(c);
+            break;
+
+            case RX_SB_IAC:
+            if (c == IAC) {
+                m_rx_sb.push_back(c);
+                m_rx_state = RX_SB;
+            } else {
+                if (c == SE)
+                    this->handleComPortCmd();
+                m_rx_state = RX_DATA;
+            }
+            break;
+        }
+    }
+    return;
+}
+
+void Rfc2217Server::handleNegotiation(uint8_t t_cmd, uint8_t t_opt)
+{
+    bool supported = (t_opt == BINARY) || (t_opt == SGA) || (t_opt == COM_PORT_OPT);
+    uint8_t reply = 0;
+    if (t_cmd == WILL)
+        reply = supported ? DO : DONT;
+    else if (t_cmd == DO)
+        reply = ( supported && (t_opt != COM_PORT_OPT) ) ? WILL : WONT;
+    if (reply) {
+        m_tx_buf.push_back(IAC);
+        m_tx_buf.push_back(reply);
+        m_tx_buf.push_back(t_opt);
+    }
+    return;
+}
+
+void Rfc2217Server::handleComPortCmd()
+{
+    // Subnegotiation: <option> <cmd> <value...>
+    if ( (m_rx_sb.size() < 3) || (m_rx_sb[0] != COM_PORT_OPT) )
+        return;
+    m_commands++;
+
+    uint8_t cmd = m_rx_sb[1];
+    uint8_t* val = m_rx_sb.data() + 2;
+    size_t len = m_rx_sb.size() - 2;
+    uint8_t ack = val[0];
+    switch (cmd)
+    {
+        case SET_BAUDRATE: {
+        if (len < 4)
+            return;
+        uint32_t baud = (val[0] << 24) | (val[1] << 16) | (val[2] << 8) | val[3];
+        if (baud != 0)
+            m_settings.baud = baud;
+        uint8_t cur[4] = {
+            static_cast<uint8_t>(0xFF & (m_settings.baud >> 24)),
+            static_cast<uint8_t>(0xFF & (m_settings.baud >> 16)),
+            static_cast<uint8_t>(0xFF & (m_settings.baud >> 8)),
+            static_cast<uint8_t>(0xFF & m_settings.baud)
+        };
+        this->queueComPortCmd(SERVER_OFFSET + cmd, cur, 4);
+        return;
+        }
+
+        case SET_DATASIZE:
+        if ( (ack >= 5) && (ack <= 8) )
+            m_settings.datasize = ack;
+        ack = m_settings.datasize;
+        break;
+
+        case SET_PARITY:
+        if ( (ack >= 1) && (ack <= 5) )
+            m_settings.parity = ack;
+        ack = m_settings.parity;
+        break;
+
+        case SET_STOPSIZE:
+        if ( (ack >= 1) && (ack <= 3) )
+            m_settings.stopsize = ack;
+        ack = m_settings.stopsize;
+        break;
+
+        case SET_CONTROL:
+        switch (ack)
+        {
+            case FLOW_NONE:
+            case FLOW_XONXOFF:
+            case FLOW_HARDWARE:
+            case FLOW_DSR:
+            m_settings.flow = ack;
+            break;
+
+            case FLOW_QUERY:
+            ack = m_settings.flow;
+            break;
+
+            case DTR_ON:
+            case DTR_OFF:
+            m_settings.dtr = (ack == DTR_ON);
+            break;
+
+            case DTR_QUERY:
+            ack = m_settings.dtr ? DTR_ON : DTR_OFF;
+            break;
+
+            case RTS_ON:
+            case RTS_OFF:
+            m_settings.rts = (ack == RTS_ON);
+            break;
+
+            case RTS_QUERY:
+            ack = m_settings.rts ? RTS_ON : RTS_OFF;
+            break;
+
+            default:
+            break;
+        }
+        break;
+
+        default:    // Masks, purge, ...: acknowledged only
+        break;
+    }
+    this->queueComPortCmd(SERVER_OFFSET + cmd, &ack, 1);
+    return;
+}
+
+void Rfc2217Server::queueComPortCmd(uint8_t t_cmd, const uint8_t* t_val, size_t t_len)
+{
+    uint8_t head[4] = {IAC, SB, COM_PORT_OPT, t_cmd};
+    m_tx_buf.insert(m_tx_buf.end(), head, head + 4);
+    for (size_t i = 0; i < t_len; i++) {
+        m_tx_buf.push_back(t_val[i]);
+        if (t_val[i] == IAC)
+            m_tx_buf.push_back(IAC);
+    }
+    m_tx_buf.push_back(IAC);
+    m_tx_buf.push_back(SE);
+    return;
+}
+
+void Rfc2217Server::flush()
+{
+    if (m_conn_fd < 0) {
+        m_tx_buf.clear();
+        return;
+    }
+    size_t pos = 0;
+    while (pos < m_tx_buf.size()) {
+        ssize_t nbytes = send(m_conn_fd, m_tx_buf.data() + pos,
+            m_tx_buf.size() - pos, MSG_NOSIGNAL);
+        if (nbytes < 0) {
+            if (errno == EINTR)
+                continue;
+            DEBUG_PRINT("Failed to send to client (%s)\n", strerror(errno));
+            break;
+        }
+        pos += nbytes;
+    }
+    m_tx_buf.clear();
+    return;
+}
+
+void Rfc2217Server::checkAndThrow(int t_stat, const string& t_msg) const
+{
+    if (t_stat < 0) {
+        int error = errno;
+        stringstream err_msg;
+        err_msg << "rfc2217-server;" << m_port << " - " << t_msg << " ("
+            << strerror(error) << ", " << error << ")";
+        DEBUG_PRINT("%s\n", err_msg.str().c_str());
+        throw BadConnection(err_msg.str(), error);
+    }
+    return;
+}
+
+}
@@ -1,4 +1,5 @@
 #include <labkit/protocols/scpi.hh>
+#include <labkit/comms/usbtmccomm.hh>
 #include <labkit/exceptions.hh>
 #include <labkit/utils.hh>
 
@@ -57,14 +58,20 @@ void Scpi::setSre(uint8_t service_request)
 
 uint8_t Scpi::getSre()
 {
-    string resp = m_comm->query("*OPC?\n");
+    string resp = m_comm->query("*SRE?\n");
     uint8_t sre = convertTo<uint8_t>(resp);
     return sre;
 }
 
 uint8_t Scpi::getStb()
 {
-    string resp = m_comm->query("*OPC?\n");
+    // USB488 devices provide the status byte via control endpoint
+    if (m_comm->type() == USBTMC) {
+        UsbTmcComm* usbtmc = static_cast<UsbTmcComm*>(m_comm.get());
+        if (usbtmc->getCapabilities().bcd_usb488 != 0)
+            return usbtmc->readStatusByte();
+    }
+    string resp = m_comm->query("*STB?\n");
     uint8_t stb = convertTo<uint8_t>(resp);
     return stb;
 }
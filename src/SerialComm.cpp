@@ -328,6 +328,32 @@ int SerialComm::cSizeToInt(CharSize t_csize)
     }
     return -1;  // never reached
 }
+unsigned SerialComm::baudToInt(BaudRate t_baud)
+{
+    switch (t_baud)
+    {
+        case BAUD_0:      return 0;
+        case BAUD_50:     return 50;
+        case BAUD_75:     return 75;
+        case BAUD_110:    return 110;
+        case BAUD_134:    return 134;
+        case BAUD_150:    return 150;
+        case BAUD_200:    return 200;
+        case BAUD_300:    return 300;
+        case BAUD_600:    return 600;
+        case BAUD_1200:   return 1200;
+        case BAUD_1800:   return 1800;
+        case BAUD_2400:   return 2400;
+        case BAUD_4800:   return 4800;
+        case BAUD_9600:   return 9600;
+        case BAUD_19200:  return 19200;
+        case BAUD_38400:  return 38400;
+        case BAUD_57600:  return 57600;
+        case BAUD_115200: return 115200;
+        case BAUD_230400: return 230400;
+    }
+    return 0;   // never reached
+}
 std::string SerialComm::parToStr(Parity t_par)
 {
     switch (t_par) 
@@ -10,6 +10,9 @@ using namespace std;
 
 namespace labkit {
 
+std::map<std::string, TcpipSerialComm::Config> TcpipSerialComm::s_applied_cfg {};
+std::mutex TcpipSerialComm::s_cfg_mutex {};
+
 TcpipSerialComm::TcpipSerialComm(std::string t_ip_addr, unsigned t_port, 
     BaudRate t_baud, CharSize t_csize, Parity t_par, StopBits t_sbits) 
       : TcpipSerialComm()
@@ -38,10 +41,8 @@ void TcpipSerialComm::open(std::string ip_addr, unsigned port, BaudRate t_baud,
     this->setIp(ip_addr);
     this->setPort(port);
 
-    // Config via http
-    m_tcpip_cfg.open(m_ip_addr, HTTP_PORT);
-
-    // Serial communication via "raw" tcpip
+    // Serial communication via "raw" tcpip; the http config connection is
+    // only opened if the settings actually have to be changed
     m_tcpip_ser.open(m_ip_addr, m_port);
 
     this->disableRtsCts();
@@ -49,14 +50,16 @@ void TcpipSerialComm::open(std::string ip_addr, unsigned port, BaudRate t_baud,
     this->setCharSize(t_csize);
     this->setParity(t_par);
     this->setStopBits(t_sbits);
-    this->applySettings();
+    this->updateSettings();
 
-    m_good = m_tcpip_ser.good() && m_tcpip_ser.good();
+    m_good = m_tcpip_ser.good();
     return;
 }
 
 void TcpipSerialComm::close()
 {
+    if (m_tcpip_cfg.good())
+        m_tcpip_cfg.close();
     m_tcpip_ser.close();
     m_good = m_tcpip_ser.good();
     return;
@@ -65,14 +68,14 @@ void TcpipSerialComm::close()
 int TcpipSerialComm::writeRaw(const uint8_t* data, size_t len)
 {
     if (m_update_settings) 
-        this->applySettings();
+        this->updateSettings();
     return m_tcpip_ser.writeRaw(data, len);
 }
 
 int TcpipSerialComm::readRaw(uint8_t* data, size_t max_len, unsigned timeout_ms)
 {
     if (m_update_settings) 
-        this->applySettings();
+        this->updateSettings();
     return m_tcpip_ser.readRaw(data, max_len, timeout_ms);
 }
 
@@ -123,6 +126,7 @@ void TcpipSerialComm::setBaud(BaudRate t_baud)
 {
     m_baud = t_baud;
     DEBUG_PRINT("Set baudrate to %i\n", m_baud);
+    m_update_settings = true;
     return;
 }
 
@@ -163,33 +167,39 @@ void TcpipSerialComm::applySettings()
     body += "stb=" + to_string(this->getStb(m_sbits)) + "&";
     body += "flc=" + to_string(m_flc) + "&";
     body += "rtp=&post=Submit";
-    // http header
-    string head = "POST /ok.html HTTP/1.1\r\n"
-                  "Content-Length: " + to_string(body.size()) + "\r\n"
-                  "\r\n";
 
-    // TCP/IP server needs to restart
-    m_tcpip_ser.close();
+    // Configuration is unknown until the converter confirmed it
+    this->invalidateConfig();
 
-    m_tcpip_cfg.write(head + body);
-    string ret = m_tcpip_cfg.readUntil("</SCRIPT>");   // End of message
-    if ( ret.find("OK") == string::npos )
-        throw BadProtocol("Did not receive 'HTTP/1.1 200 OK'");
-    m_tcpip_cfg.close();
+    // TCP/IP server needs to restart
+    if (m_tcpip_ser.good())
+        m_tcpip_ser.close();
+    this->postConfig(body);
+    {
+        lock_guard<mutex> lock(s_cfg_mutex);
+        s_applied_cfg[m_ip_addr] = Config {m_baud, m_csize, m_par, m_sbits, m_flc};
+    }
 
     // Reconnect to server
     usleep(100e3);
     m_tcpip_ser.open();
-    m_tcpip_cfg.open();
 
     m_update_settings = false;
     return;
 }
 
+void TcpipSerialComm::invalidateConfig()
+{
+    lock_guard<mutex> lock(s_cfg_mutex);
+    s_applied_cfg.erase(m_ip_addr);
+    return;
+}
+
 void TcpipSerialComm::enableRtsCts()
 {
     DEBUG_PRINT("%s\n", "Enabled RTS/CTS flow control");
     m_flc = 1;
+    m_update_settings = true;
     return;
 }
 
@@ -197,6 +207,7 @@ void TcpipSerialComm::disableRtsCts()
 {
     DEBUG_PRINT("%s\n", "Disabled hardware flow control");
     m_flc = 0;
+    m_update_settings = true;
     return;
 }
 
@@ -204,6 +215,7 @@ void TcpipSerialComm::enableDtrDsr()
 {
     DEBUG_PRINT("%s\n", "Enabled DTR/DSR flow control");
     m_flc = 2;
+    m_update_settings = true;
     return;
 }
 
@@ -211,6 +223,7 @@ void TcpipSerialComm::disableDtrDsr()
 {
     DEBUG_PRINT("%s\n", "Disabled hardware flow control");
     m_flc = 0;
+    m_update_settings = true;
     return;
 }
 
@@ -224,6 +237,7 @@ void TcpipSerialComm::disableXOnXOff()
 {
     DEBUG_PRINT("%s\n", "Disabled hardware flow control");
     m_flc = 0;
+    m_update_settings = true;
     return;
 }
 
@@ -255,6 +269,64 @@ void TcpipSerialComm::clearRts()
  *      P R I V A T E   M E T H O D S
  */
 
+void TcpipSerialComm::updateSettings()
+{
+    // Skip reconfiguration (and server restart) if nothing changed
+    bool configured = false;
+    {
+        lock_guard<mutex> lock(s_cfg_mutex);
+        auto applied = s_applied_cfg.find(m_ip_addr);
+        configured = (applied != s_applied_cfg.end()) && (applied->second
+            == Config {m_baud, m_csize, m_par, m_sbits, m_flc});
+    }
+    if (configured) {
+        DEBUG_PRINT("%s\n", "Converter already configured, skipping");
+        m_update_settings = false;
+        return;
+    }
+    this->applySettings();
+    return;
+}
+
+bool TcpipSerialComm::Config::operator==(const Config& t_other) const
+{
+    return (baud == t_other.baud) && (csize == t_other.csize) && 
+        (par == t_other.par) && (sbits == t_other.sbits) && 
+        (flc == t_other.flc);
+}
+
+void TcpipSerialComm::postConfig(const string& t_body)
+{
+    // http header; ask the converter to keep the connection open
+    string head = "POST /ok.html HTTP/1.1\r\n"
+                  "Connection: keep-alive\r\n"
+                  "Content-Length: " + to_string(t_body.size()) + "\r\n"
+                  "\r\n";
+
+    // Reuse the config connection; if the converter has dropped it in the
+    // meantime, reconnect once and try again
+    string ret {};
+    bool reused = m_tcpip_cfg.good();
+    if (!reused)
+        m_tcpip_cfg.open(m_ip_addr, HTTP_PORT);
+    try {
+        m_tcpip_cfg.write(head + t_body);
+        ret = m_tcpip_cfg.readUntil("</SCRIPT>");   // End of message
+    } catch (const Exception& ex) {
+        m_tcpip_cfg.close();
+        if (!reused)
+            throw;
+        DEBUG_PRINT("Config connection lost (%s), reconnecting\n", ex.what());
+        m_tcpip_cfg.open(m_ip_addr, HTTP_PORT);
+        m_tcpip_cfg.write(head + t_body);
+        ret = m_tcpip_cfg.readUntil("</SCRIPT>");
+    }
+
+    if ( ret.find("OK") == string::npos )
+        throw BadProtocol("Did not receive 'HTTP/1.1 200 OK'");
+    return;
+}
+
 string TcpipSerialComm::getBdr(BaudRate t_baud)
 {
     string bdr = "0";
@@ -0,0 +1,102 @@
+#include <labkit/comms/usbbackend.hh>
+#include <labkit/comms/usbregistry.hh>
+#include <labkit/debug.hh>
+
+using namespace std;
+
+namespace labkit {
+
+int LibusbBackend::open(uint16_t t_vid, uint16_t t_pid, const string& t_serno)
+{
+    // Device lookup in cached registry, no enumeration required. Without
+    // hotplug events, an entry may be stale after the device was replugged;
+    // enumerate again and retry once.
+    int stat = LIBUSB_ERROR_NOT_FOUND;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt > 0)
+            UsbRegistry::instance().refresh();
+        libusb_device* dev = UsbRegistry::instance().find(t_vid, t_pid, t_serno);
+        if (!dev)
+            return LIBUSB_ERROR_NOT_FOUND;
+
+        stat = libusb_open(dev, &m_handle);
+        libusb_unref_device(dev);
+        if (stat != LIBUSB_ERROR_NO_DEVICE)
+            break;
+    }
+    if (stat < 0) {
+        m_handle = NULL;
+        return stat;
+    }
+    m_pool = UsbBufferPool::create(m_handle);
+    return LIBUSB_SUCCESS;
+}
+
+void LibusbBackend::close()
+{
+    // Handle is closed by the pool once all lent buffers are returned
+    m_pool.reset();
+    m_handle = NULL;
+    return;
+}
+
+int LibusbBackend::claimInterface(int t_iface)
+{
+    if ( libusb_kernel_driver_active(m_handle, t_iface) == 1 ) {
+        int stat = libusb_detach_kernel_driver(m_handle, t_iface);
+        if (stat < 0)
+            return stat;
+        DEBUG_PRINT("Detached kernel driver from interface %i\n", t_iface);
+    }
+    return libusb_claim_interface(m_handle, t_iface);
+}
+
+int LibusbBackend::releaseInterface(int t_iface)
+{
+    return libusb_release_interface(m_handle, t_iface);
+}
+
+int LibusbBackend::setAltSetting(int t_iface, int t_alt)
+{
+    return libusb_set_interface_alt_setting(m_handle, t_iface, t_alt);
+}
+
+int LibusbBackend::getConfigDescriptor(libusb_config_descriptor** t_cfg)
+{
+    return libusb_get_active_config_descriptor(libusb_get_device(m_handle), t_cfg);
+}
+
+void LibusbBackend::freeConfigDescriptor(libusb_config_descriptor* t_cfg)
+{
+    libusb_free_config_descriptor(t_cfg);
+    return;
+}
+
+int LibusbBackend::controlTransfer(uint8_t t_request_type, uint8_t t_request,
+    uint16_t t_value, uint16_t t_index, uint8_t* t_data, uint16_t t_len,
+    unsigned t_timeout_ms)
+{
+    return libusb_control_transfer(m_handle, t_request_type, t_request, t_value,
+        t_index, t_data, t_len, t_timeout_ms);
+}
+
+int LibusbBackend::bulkTransfer(uint8_t t_ep_addr, uint8_t* t_data, int t_len,
+    int* t_transferred, unsigned t_timeout_ms)
+{
+    return libusb_bulk_transfer(m_handle, t_ep_addr, t_data, t_len,
+        t_transferred, t_timeout_ms);
+}
+
+int LibusbBackend::interruptTransfer(uint8_t t_ep_addr, uint8_t* t_data,
+    int t_len, int* t_transferred, unsigned t_timeout_ms)
+{
+    return libusb_interrupt_transfer(m_handle, t_ep_addr, t_data, t_len,
+        t_transferred, t_timeout_ms);
+}
+
+int LibusbBackend::clearHalt(uint8_t t_ep_addr)
+{
+    return libusb_clear_halt(m_handle, t_ep_addr);
+}
+
+}
@@ -0,0 +1,160 @@
+#include <labkit/comms/usbbuffer.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <cstdlib>
+
+using namespace std;
+
+namespace labkit {
+
+/*
+ *      U S B   B U F F E R
+ */
+
+UsbBuffer::~UsbBuffer()
+{
+    this->release();
+    return;
+}
+
+UsbBuffer::UsbBuffer(UsbBuffer&& t_other) noexcept
+{
+    *this = std::move(t_other);
+    return;
+}
+
+UsbBuffer& UsbBuffer::operator=(UsbBuffer&& t_other) noexcept
+{
+    if (this == &t_other)
+        return *this;
+    this->release();
+    m_pool = std::move(t_other.m_pool);
+    m_mem = t_other.m_mem;
+    m_capacity = t_other.m_capacity;
+    m_offset = t_other.m_offset;
+    m_size = t_other.m_size;
+    m_dma = t_other.m_dma;
+    t_other.m_mem = NULL;
+    t_other.m_capacity = t_other.m_offset = t_other.m_size = 0;
+    return *this;
+}
+
+void UsbBuffer::trim(size_t t_offset, size_t t_len)
+{
+    if (t_offset + t_len > m_capacity)
+        throw BadIo("USB buffer too small (" + to_string(t_offset + t_len)
+            + " > " + to_string(m_capacity) + " bytes)");
+    m_offset = t_offset;
+    m_size = t_len;
+    return;
+}
+
+void UsbBuffer::release() noexcept
+{
+    if (m_pool && m_mem)
+        m_pool->put(m_mem, m_capacity, m_dma);
+    m_pool.reset();
+    m_mem = NULL;
+    m_capacity = m_offset = m_size = 0;
+    return;
+}
+
+/*
+ *      U S B   B U F F E R   P O O L
+ */
+
+shared_ptr<UsbBufferPool> UsbBufferPool::create(libusb_device_handle* t_handle)
+{
+    return shared_ptr<UsbBufferPool>(new UsbBufferPool(t_handle));
+}
+
+UsbBufferPool::~UsbBufferPool()
+{
+    this->shrink();
+    if (m_handle)
+        libusb_close(m_handle);
+    return;
+}
+
+UsbBuffer UsbBufferPool::acquire(size_t t_size)
+{
+    // Round up to whole pages; device memory is mapped page-wise anyway
+    size_t size = (t_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    if (size == 0)
+        size = PAGE_SIZE;
+
+    UsbBuffer buf;
+    {
+        // Reuse the smallest sufficient idle block
+        lock_guard<mutex> lock(m_mutex);
+        auto best = m_idle.end();
+        for (auto it = m_idle.begin(); it != m_idle.end(); it++)
+            if ( (it->size >= size) &&
+                 ((best == m_idle.end()) || (it->size < best->size)) )
+                best = it;
+        if (best != m_idle.end()) {
+            buf.m_mem = best->mem;
+            buf.m_capacity = best->size;
+            buf.m_dma = best->dma;
+            m_idle.erase(best);
+        }
+    }
+
+    if (!buf.m_mem && m_dma && m_handle) {
+        buf.m_mem = libusb_dev_mem_alloc(m_handle, size);
+        buf.m_dma = (buf.m_mem != NULL);
+        if (!buf.m_dma) {
+            // Not supported by kernel or platform; don't try again
+            DEBUG_PRINT("%s\n", "Device memory not available, using heap");
+            m_dma = false;
+        }
+        buf.m_capacity = size;
+    }
+    if (!buf.m_mem) {
+        buf.m_mem = static_cast<uint8_t*>(aligned_alloc(PAGE_SIZE, size));
+        if (!buf.m_mem)
+            throw BadIo("Failed to allocate USB buffer (" + to_string(size)
+                + " bytes)");
+        buf.m_capacity = size;
+    }
+
+    buf.m_pool = this->shared_from_this();
+    buf.m_size = t_size;
+    return buf;
+}
+
+void UsbBufferPool::shrink()
+{
+    lock_guard<mutex> lock(m_mutex);
+    for (auto& block : m_idle)
+        this->free(block);
+    m_idle.clear();
+    return;
+}
+
+/*
+ *      P R I V A T E   M E T H O D S
+ */
+
+void UsbBufferPool::put(uint8_t* t_mem, size_t t_size, bool t_dma) noexcept
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (m_idle.size() < MAX_IDLE) {
+        m_idle.push_back( {t_mem, t_size, t_dma} );
+        return;
+    }
+    this->free( {t_mem, t_size, t_dma} );
+    return;
+}
+
+void UsbBufferPool::free(const Block& t_block) noexcept
+{
+    if (t_block.dma)
+        libusb_dev_mem_free(m_handle, t_block.mem, t_block.size);
+    else
+        std::free(t_block.mem);
+    return;
+}
+
+}
@@ -1,4 +1,5 @@
 #include <labkit/comms/usbcomm.hh>
+#include <labkit/comms/usbregistry.hh>
 #include <labkit/exceptions.hh>
 #include <labkit/debug.hh>
 
@@ -7,13 +8,14 @@
 #include <iostream>
 #include <cstdint>
 #include <cstdio>
+#include <chrono>
 
 using namespace std;
 
 namespace labkit {
 
-libusb_context* UsbComm::s_default_ctx = NULL;
-int UsbComm::s_dev_count = 0;
+std::function<void(int, short)> UsbComm::s_pollfd_added {};
+std::function<void(int)> UsbComm::s_pollfd_removed {};
 
 UsbComm::UsbComm(uint16_t t_vid, uint16_t t_pid, string t_serno) : UsbComm() 
 {
@@ -100,86 +102,37 @@ void UsbComm::open()
 
 void UsbComm::open(uint16_t t_vid, uint16_t t_pid, string t_serno)
 {
-    int stat;
-    // If first device, start new libusb session
-    if (s_dev_count == 0) {
-        stat = libusb_init(&s_default_ctx);
-        check_and_throw(stat, "libusb init failed");
-        DEBUG_PRINT("new libusb session initialized (%i)\n", stat);
-    }
-
-    // Search for deivce with given VID & PID
-    libusb_device** dev_list;
-    int ndev = libusb_get_device_list(s_default_ctx, &dev_list);
-    check_and_throw(ndev, "Failed to get device list");
-
-    for (int idev = 0; idev < ndev; idev++) {
-        // Get dev descriptor for vid, pid, bus, and port
-        libusb_device* tmp_dev = dev_list[idev];
-        libusb_device_descriptor desc;
-        stat = libusb_get_device_descriptor(tmp_dev, &desc);
-        check_and_throw(stat, "Failed to get device descriptor");
-
-        DEBUG_PRINT("device %i: VID:PID=0x%04X:0x%04X\n", 
-            idev, desc.idVendor, desc.idProduct);
-
-        // Check for VID and PID
-        if ( (desc.idVendor == t_vid) && (desc.idProduct == t_pid) ) {
-            // Also check for serial number, if specified
-            if ( !t_serno.empty() ) {
-                libusb_device_handle* tmp_handle;
-                stat = libusb_open(tmp_dev, &tmp_handle);
-                check_and_throw(stat, "Failed to get usb handle");
-
-                uint8_t serial_cstr[126];
-                stat = libusb_get_string_descriptor_ascii(tmp_handle,
-                    desc.iSerialNumber, serial_cstr, 126);
-                check_and_throw(stat, "Failed to get string descriptor");
-                DEBUG_PRINT("SerialNumber %s\n", serial_cstr);
-                string serial_str( (char*)serial_cstr );
-
-                // If serial number does not match, skip rest
-                if (t_serno != serial_str) continue;
-            }
-            m_usb_dev = tmp_dev;
-            m_vid = t_vid;
-            m_pid = t_pid;
-            m_serno = t_serno;
-            break;
-        }
-    }
-
-    // Get I/O handle
-    if (m_usb_dev) {
-        stat = libusb_open(m_usb_dev, &m_usb_handle);
-        check_and_throw(stat, "Failed to get usb handle");
-    } else {
-        fprintf(stderr, "Device ID 0x%04X:0x%04X not found\n", t_vid, t_pid);
-        abort();
+    int stat = m_backend->open(t_vid, t_pid, t_serno);
+    if (stat == LIBUSB_ERROR_NOT_FOUND) {
+        char msg[64];
+        snprintf(msg, 64, "Device ID 0x%04X:0x%04X not found", t_vid, t_pid);
+        throw BadConnection(msg + (t_serno.empty() ? "" : " (" + t_serno + ")"));
     }
-    s_dev_count++;
-    DEBUG_PRINT("Opened device, new device count = %i\n", s_dev_count);
+    check_and_throw(stat, "Failed to get usb handle");
+    m_usb_handle = m_backend->handle();
+    m_vid = t_vid;
+    m_pid = t_pid;
+    m_serno = t_serno;
+    DEBUG_PRINT("Opened device 0x%04X:0x%04X\n", m_vid, m_pid);
 
-    libusb_free_device_list(dev_list, 1);
     m_good = true;
     return;
 }
 
 void UsbComm::close()
 {
+    // Retire asynchronous transfers before the handle is closed
+    cancelStream(m_bulk_stream);
+    cancelStream(m_int_stream);
+    this->cancelTransfers();
+
     // Release claimed interfaces and device
     if (m_cur_iface != -1)
-        libusb_release_interface(m_usb_handle, m_cur_iface);
-    if (m_usb_handle)
-        libusb_close(m_usb_handle);
-
-    // Close context if last device released
-    s_dev_count--;
-    DEBUG_PRINT("Closed device, new device count = %i\n", s_dev_count);
-    if (s_dev_count == 0) {
-        DEBUG_PRINT("%s\n", "Last device closed, exiting libusb\n");
-        libusb_exit(s_default_ctx);
-    }
+        m_backend->releaseInterface(m_cur_iface);
+    m_backend->close();
+    m_cur_iface = -1;
+    m_usb_handle = NULL;
+    DEBUG_PRINT("Closed device 0x%04X:0x%04X\n", m_vid, m_pid);
 
     m_good = false;
     return;
@@ -197,8 +150,18 @@ string UsbComm::getInfo() const noexcept
 
 void UsbComm::clear()
 {
-    libusb_clear_halt(m_usb_handle, m_ep_in_addr);
-    libusb_clear_halt(m_usb_handle, m_ep_out_addr);
+    m_backend->clearHalt(m_ep_in_addr);
+    m_backend->clearHalt(m_ep_out_addr);
+    return;
+}
+
+void UsbComm::setBackend(unique_ptr<UsbBackend> t_backend)
+{
+    if (this->good())
+        throw BadIo(this->getInfo() + " - Backend cannot be changed while open");
+    if (!t_backend)
+        throw BadIo(this->getInfo() + " - Invalid backend");
+    m_backend = std::move(t_backend);
     return;
 }
 
@@ -208,8 +171,7 @@ int UsbComm::controlTransfer(uint8_t t_request_type, uint8_t t_request, uint16_t
     if (m_cur_iface == -1)
         throw BadIo(this->getInfo() + " - No USB interface claimed");
 
-    int nbytes = libusb_control_transfer(
-        m_usb_handle,
+    int nbytes = m_backend->controlTransfer(
         t_request_type,
         t_request,
         t_value,
@@ -222,43 +184,64 @@ int UsbComm::controlTransfer(uint8_t t_request_type, uint8_t t_request, uint16_t
     return nbytes;
 }
 
-int UsbComm::writeBulk(const uint8_t* t_data, int t_len) 
+int UsbComm::writeBulk(const uint8_t* t_data, int t_len, int t_timeout_ms) 
 {
     if (m_cur_iface == -1)
         throw BadIo(this->getInfo() + " - No USB interface claimed");
 
+    char msg[128];
+    snprintf(msg, 128, "Bulk transfer (write) to endpoint 0x%02X failed", 
+        m_ep_out_addr);
+
+    // The timeout applies to the whole write, not to each transfer
+    auto deadline = chrono::steady_clock::now() 
+        + chrono::milliseconds(t_timeout_ms);
+    auto time_left = [&]() -> unsigned {
+        if (t_timeout_ms == 0)
+            return 0;   // no timeout
+        long left = chrono::duration_cast<chrono::milliseconds>(
+            deadline - chrono::steady_clock::now()).count();
+        return (left > 0) ? left : 1;
+    };
+
     int stat, nbytes = 0;
     size_t bytes_left = t_len;
     size_t bytes_written = 0;
 
     while ( bytes_left > 0 ) {
-        // Packets can be max wMaxPacketSize
-        stat = libusb_bulk_transfer(
-            m_usb_handle,
+        // Host controller splits the transfer into wMaxPacketSize packets
+        stat = m_backend->bulkTransfer(
             m_ep_out_addr,
             (uint8_t*)&t_data[bytes_written],
-            min(bytes_left, m_max_pkt_size_out),
+            min(bytes_left, MAX_TRANSFER_SIZE),
             &nbytes,
-            1000);
-        char msg[128];
-        snprintf(msg, 128, "Bulk transfer (write) to endpoint 0x%02X failed", 
-            m_ep_out_addr);
+            time_left());
         check_and_throw(stat, string(msg));
+        DEBUG_PRINT_BYTE_DATA(&t_data[bytes_written], nbytes, 
+            "Written %zu bytes: ", nbytes);
         bytes_left -= nbytes;
         bytes_written += nbytes;
-        DEBUG_PRINT_BYTE_DATA(t_data, nbytes, "Written %zu bytes: ", nbytes);
     }
-    return nbytes;
+
+    // A full last packet does not end the transfer; send zero-length packet
+    if ( m_zlp_out && (t_len > 0) && (t_len % m_max_pkt_size_out == 0) ) {
+        stat = m_backend->bulkTransfer(m_ep_out_addr, NULL, 0, &nbytes, 
+            time_left());
+        check_and_throw(stat, string(msg));
+        DEBUG_PRINT("%s\n", "Written zero-length packet");
+    }
+    return bytes_written;
 }
 
 int UsbComm::readBulk(uint8_t* t_data, int t_max_len, int t_timeout_ms) 
 {
     if (m_cur_iface == -1)
         throw BadIo(this->getInfo() + " - No USB interface claimed");
+    if (this->streaming())
+        throw BadIo(this->getInfo() + " - Bulk endpoint (IN) is streaming");
 
     int nbytes = 0;
-    int stat = libusb_bulk_transfer(
-        m_usb_handle,
+    int stat = m_backend->bulkTransfer(
         m_ep_in_addr,
         t_data,
         t_max_len,
@@ -272,17 +255,204 @@ int UsbComm::readBulk(uint8_t* t_data, int t_max_len, int t_timeout_ms)
     return nbytes;
 }
 
-int UsbComm::writeInterrupt(const uint8_t* t_data, int t_len) 
+int UsbComm::readBulk(UsbBuffer& t_buf, int t_timeout_ms)
+{
+    t_buf.resize(0);
+    int nbytes = this->readBulk(t_buf.raw(), t_buf.capacity(), t_timeout_ms);
+    t_buf.resize(nbytes);
+    return nbytes;
+}
+
+UsbBuffer UsbComm::acquireBuffer(size_t t_size)
+{
+    std::shared_ptr<UsbBufferPool> pool = m_backend->bufferPool();
+    if (!pool)
+        throw BadIo(this->getInfo() + " - Device not open");
+    return pool->acquire(t_size);
+}
+
+void UsbComm::startBulkStream(StreamCallback t_callback, unsigned t_num_transfers,
+    size_t t_transfer_size, unsigned t_timeout_ms)
+{
+    if (m_cur_iface == -1)
+        throw BadIo(this->getInfo() + " - No USB interface claimed");
+
+    this->startStream(m_bulk_stream, m_ep_in_addr, LIBUSB_TRANSFER_TYPE_BULK,
+        t_callback, t_num_transfers, t_transfer_size, t_timeout_ms);
+    DEBUG_PRINT("Started bulk stream on endpoint 0x%02X (%u x %zu bytes)\n",
+        m_ep_in_addr, t_num_transfers, t_transfer_size);
+    return;
+}
+
+void UsbComm::stopBulkStream()
+{
+    DEBUG_PRINT("Stopping bulk stream on endpoint 0x%02X\n", m_ep_in_addr);
+    this->stopStream(m_bulk_stream);
+    return;
+}
+
+void UsbComm::submitBulkRead(size_t t_max_len, TransferCallback t_callback,
+    unsigned t_timeout_ms)
+{
+    if (m_cur_iface == -1)
+        throw BadIo(this->getInfo() + " - No USB interface claimed");
+    this->submitTransfer(m_ep_in_addr, this->acquireBuffer(t_max_len), t_callback,
+        t_timeout_ms);
+    return;
+}
+
+void UsbComm::submitBulkWrite(const uint8_t* t_data, size_t t_len, 
+    TransferCallback t_callback, unsigned t_timeout_ms)
+{
+    if (m_cur_iface == -1)
+        throw BadIo(this->getInfo() + " - No USB interface claimed");
+    UsbBuffer buf = this->acquireBuffer(t_len);
+    std::copy(t_data, t_data + t_len, buf.data());
+    this->submitTransfer(m_ep_out_addr, std::move(buf), t_callback, t_timeout_ms);
+    return;
+}
+
+void UsbComm::submitBulkWrite(UsbBuffer&& t_buf, TransferCallback t_callback,
+    unsigned t_timeout_ms)
 {
-    // TODO
-    return 0;
+    if (m_cur_iface == -1)
+        throw BadIo(this->getInfo() + " - No USB interface claimed");
+    this->submitTransfer(m_ep_out_addr, std::move(t_buf), t_callback, t_timeout_ms);
+    return;
+}
+
+void UsbComm::checkTransfers()
+{
+    if (m_transfer_ex) {
+        std::exception_ptr ex = m_transfer_ex;
+        m_transfer_ex = nullptr;
+        std::rethrow_exception(ex);
+    }
+    return;
 }
 
-int UsbComm::readInterrupt(uint8_t* t_data, int t_max_len,
-    int timeout_ms) 
+void UsbComm::handleEvents(unsigned t_timeout_ms)
 {
-    // TODO
-    return 0;
+    struct timeval tv;
+    tv.tv_sec = t_timeout_ms / 1000;
+    tv.tv_usec = 1000 * (t_timeout_ms % 1000);
+    int stat = libusb_handle_events_timeout_completed(
+        UsbRegistry::instance().context(), &tv, NULL);
+    if ( (stat < 0) && (stat != LIBUSB_ERROR_INTERRUPTED) )
+        throw BadIo(string("Failed to handle USB events (") + 
+            libusb_error_name(stat) + ")", stat);
+    return;
+}
+
+vector<pollfd> UsbComm::getPollFds()
+{
+    vector<pollfd> ret {};
+    const libusb_pollfd** fds = libusb_get_pollfds(UsbRegistry::instance().context());
+    if (!fds)
+        return ret;
+    for (size_t i = 0; fds[i] != NULL; i++)
+        ret.push_back( {fds[i]->fd, fds[i]->events, 0} );
+    libusb_free_pollfds(fds);
+    return ret;
+}
+
+int UsbComm::getNextTimeout()
+{
+    libusb_context* ctx = UsbRegistry::instance().context();
+
+    // Timeouts are handled via timerfd (part of the poll fds)
+    if ( libusb_pollfds_handle_timeouts(ctx) )
+        return -1;
+
+    struct timeval tv;
+    int stat = libusb_get_next_timeout(ctx, &tv);
+    if (stat < 0)
+        throw BadIo(string("Failed to get next USB timeout (") + 
+            libusb_error_name(stat) + ")", stat);
+    if (stat == 0)
+        return -1;
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+void UsbComm::setPollFdNotifiers(std::function<void(int, short)> t_added,
+    std::function<void(int)> t_removed)
+{
+    s_pollfd_added = t_added;
+    s_pollfd_removed = t_removed;
+    libusb_set_pollfd_notifiers(UsbRegistry::instance().context(),
+        [](int t_fd, short t_events, void*) { 
+            if (s_pollfd_added) s_pollfd_added(t_fd, t_events); },
+        [](int t_fd, void*) { 
+            if (s_pollfd_removed) s_pollfd_removed(t_fd); },
+        NULL);
+    return;
+}
+
+int UsbComm::writeInterrupt(const uint8_t* t_data, int t_len, int t_timeout_ms) 
+{
+    if (m_cur_iface == -1)
+        throw BadIo(this->getInfo() + " - No USB interface claimed");
+    if (m_ep_out_type != INTERRUPT)
+        throw BadIo(this->getInfo() + " - No interrupt endpoint (OUT) configured");
+
+    int nbytes = 0;
+    int stat = m_backend->interruptTransfer(
+        m_ep_out_addr,
+        (uint8_t*)t_data,
+        t_len,
+        &nbytes,
+        t_timeout_ms);
+    char msg[128];
+    snprintf(msg, 128, "Interrupt transfer (write) to endpoint 0x%02X failed", 
+        m_ep_out_addr);
+    check_and_throw(stat, string(msg));
+    DEBUG_PRINT_BYTE_DATA(t_data, nbytes, "Written %zu bytes: ", nbytes);
+    return nbytes;
+}
+
+int UsbComm::readInterrupt(uint8_t* t_data, int t_max_len, int t_timeout_ms) 
+{
+    if (m_cur_iface == -1)
+        throw BadIo(this->getInfo() + " - No USB interface claimed");
+    if (m_ep_int_in_addr == 0x00)
+        throw BadIo(this->getInfo() + " - No interrupt endpoint (IN) configured");
+    if (this->listening())
+        throw BadIo(this->getInfo() + " - Interrupt endpoint (IN) is listening");
+
+    int nbytes = 0;
+    int stat = m_backend->interruptTransfer(
+        m_ep_int_in_addr,
+        t_data,
+        t_max_len,
+        &nbytes,
+        t_timeout_ms);
+    char msg[128];
+    snprintf(msg, 128, "Interrupt transfer (read) to endpoint 0x%02X failed", 
+        m_ep_int_in_addr);
+    check_and_throw(stat, string(msg));
+    DEBUG_PRINT_BYTE_DATA(t_data, nbytes, "Read %zu bytes: ", nbytes);
+    return nbytes;
+}
+
+void UsbComm::startInterruptListener(StreamCallback t_callback)
+{
+    if (m_cur_iface == -1)
+        throw BadIo(this->getInfo() + " - No USB interface claimed");
+    if (m_ep_int_in_addr == 0x00)
+        throw BadIo(this->getInfo() + " - No interrupt endpoint (IN) configured");
+
+    // A single transfer of wMaxPacketSize; notifications are one packet
+    this->startStream(m_int_stream, m_ep_int_in_addr, 
+        LIBUSB_TRANSFER_TYPE_INTERRUPT, t_callback, 1, m_max_pkt_size_int_in, 0);
+    DEBUG_PRINT("Listening on interrupt endpoint 0x%02X\n", m_ep_int_in_addr);
+    return;
+}
+
+void UsbComm::stopInterruptListener()
+{
+    DEBUG_PRINT("Stop listening on interrupt endpoint 0x%02X\n", m_ep_int_in_addr);
+    this->stopStream(m_int_stream);
+    return;
 }
 
 void UsbComm::configInterface(int t_iface, int t_alt) 
@@ -293,21 +463,14 @@ void UsbComm::configInterface(int t_iface, int t_alt)
     // Release current interface (-1 = no interface claimed)
     if (m_cur_iface != -1)
     {
-        stat = libusb_release_interface(m_usb_handle, m_cur_iface);
+        stat = m_backend->releaseInterface(m_cur_iface);
         msg = "Failed to release interface " + to_string(m_cur_iface);
         check_and_throw(stat, msg);
         m_cur_iface = -1;
     }
 
-    // Detach kernel drivers if active
-    if ( libusb_kernel_driver_active(m_usb_handle, t_iface) ) 
-    {
-        stat = libusb_detach_kernel_driver(m_usb_handle, t_iface);
-        check_and_throw(stat, "Failed to detach kernel driver from interface");
-    }
-
-    // Claim new interface
-    stat = libusb_claim_interface(m_usb_handle, t_iface);
+    // Claim new interface; kernel drivers are detached if active
+    stat = m_backend->claimInterface(t_iface);
     msg = "Failed to claim interface " + to_string(t_iface);
     check_and_throw(stat, msg);
     m_cur_iface = t_iface;
@@ -316,11 +479,59 @@ void UsbComm::configInterface(int t_iface, int t_alt)
     // Apply alternate settingsm if specified
     if (t_alt) 
     {
-        stat = libusb_set_interface_alt_setting(m_usb_handle, m_cur_iface, t_alt);
+        stat = m_backend->setAltSetting(m_cur_iface, t_alt);
         msg = "Failed to apply alternate settings " + to_string(t_alt);
         check_and_throw(stat, msg);
         DEBUG_PRINT("Applied alternate settings %i\n", t_alt);
     }
+
+    // Configure endpoints according to the interface descriptor
+    libusb_config_descriptor* cfg;
+    stat = m_backend->getConfigDescriptor(&cfg);
+    check_and_throw(stat, "Failed to get configuration descriptor");
+    for (int i = 0; i < cfg->bNumInterfaces; i++) {
+        const libusb_interface& iface = cfg->interface[i];
+        for (int j = 0; j < iface.num_altsetting; j++) {
+            const libusb_interface_descriptor* desc = &iface.altsetting[j];
+            if ( (desc->bInterfaceNumber == t_iface) && 
+                 (desc->bAlternateSetting == t_alt) )
+                this->configEndpoints(desc);
+        }
+    }
+    m_backend->freeConfigDescriptor(cfg);
+    return;
+}
+
+void UsbComm::configInterfaceByClass(uint8_t t_class, uint8_t t_subclass)
+{
+    libusb_config_descriptor* cfg;
+    int stat = m_backend->getConfigDescriptor(&cfg);
+    check_and_throw(stat, "Failed to get configuration descriptor");
+
+    int iface_no {-1}, alt_no {0};
+    for (int i = 0; (i < cfg->bNumInterfaces) && (iface_no == -1); i++) {
+        const libusb_interface& iface = cfg->interface[i];
+        for (int j = 0; j < iface.num_altsetting; j++) {
+            const libusb_interface_descriptor& desc = iface.altsetting[j];
+            if ( (desc.bInterfaceClass == t_class) && 
+                 (desc.bInterfaceSubClass == t_subclass) ) {
+                iface_no = desc.bInterfaceNumber;
+                alt_no = desc.bAlternateSetting;
+                break;
+            }
+        }
+    }
+    m_backend->freeConfigDescriptor(cfg);
+
+    if (iface_no == -1) {
+        char msg[128];
+        snprintf(msg, 128, " - No interface with class 0x%02X, subclass 0x%02X",
+            t_class, t_subclass);
+        throw BadConnection(this->getInfo() + msg);
+    }
+    DEBUG_PRINT("Found interface %i (class 0x%02X, subclass 0x%02X)\n", 
+        iface_no, t_class, t_subclass);
+    this->configInterface(iface_no, alt_no);
     return;
 }
 
@@ -336,6 +547,10 @@ void UsbComm::configEndpointIn(uint8_t t_ep_addr, EndpointType t_type,
     m_ep_in_type = t_type;
     m_ep_in_addr = t_ep_addr;
     m_max_pkt_size_in = t_max_size;
+    if (t_type == INTERRUPT) {
+        m_ep_int_in_addr = t_ep_addr;
+        m_max_pkt_size_int_in = t_max_size;
+    }
     DEBUG_PRINT("Setting endpoint (IN): addr 0x%02X, wMaxPacketSize %lu\n", 
         m_ep_in_addr, m_max_pkt_size_in);
 
@@ -364,6 +579,274 @@ void UsbComm::configEndpointOut(uint8_t t_ep_addr, EndpointType t_type,
  *      P R I V A T E   M E T H O D S
  */
 
+void UsbComm::startStream(Stream& t_stream, uint8_t t_ep_addr, uint8_t t_type,
+    StreamCallback t_callback, unsigned t_num_transfers, size_t t_transfer_size, 
+    unsigned t_timeout_ms)
+{
+    this->checkAsync();
+    if (t_stream.active > 0)
+        throw BadIo(this->getInfo() + " - Stream already running");
+    releaseStream(t_stream);
+    if ( (t_num_transfers == 0) || (t_transfer_size == 0) )
+        throw BadIo(this->getInfo() + " - Invalid stream configuration");
+
+    t_stream.cb = t_callback;
+    t_stream.stop = false;
+    t_stream.status = LIBUSB_TRANSFER_COMPLETED;
+    t_stream.ex = nullptr;
+    t_stream.bufs.clear();
+    for (unsigned i = 0; i < t_num_transfers; i++)
+        t_stream.bufs.push_back( this->acquireBuffer(t_transfer_size) );
+
+    for (unsigned i = 0; i < t_num_transfers; i++) {
+        libusb_transfer* xfer = libusb_alloc_transfer(0);
+        if (!xfer) {
+            cancelStream(t_stream);
+            check_and_throw(LIBUSB_ERROR_NO_MEM, "Failed to allocate transfer");
+        }
+        t_stream.xfers.push_back(xfer);
+        libusb_fill_bulk_transfer(xfer, m_usb_handle, t_ep_addr,
+            t_stream.bufs.at(i).data(), t_transfer_size, 
+            &UsbComm::streamCallback, &t_stream, t_timeout_ms);
+        xfer->type = t_type;
+    }
+
+    for (auto xfer : t_stream.xfers) {
+        int stat = libusb_submit_transfer(xfer);
+        if (stat < 0) {
+            cancelStream(t_stream);
+            check_and_throw(stat, "Failed to submit stream transfer");
+        }
+        t_stream.active++;
+    }
+    return;
+}
+
+void UsbComm::stopStream(Stream& t_stream)
+{
+    cancelStream(t_stream);
+    int status = t_stream.status;
+    std::exception_ptr ex = t_stream.ex;
+    t_stream.status = LIBUSB_TRANSFER_COMPLETED;
+    t_stream.ex = nullptr;
+
+    // Report errors that stopped the stream
+    if (ex)
+        std::rethrow_exception(ex);
+    switch (status) 
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+        case LIBUSB_TRANSFER_CANCELLED:
+        break;
+
+        case LIBUSB_TRANSFER_NO_DEVICE:
+        throw BadConnection(this->getInfo() + " - Device lost while streaming");
+
+        default:
+        throw BadIo(this->getInfo() + " - Stream failed (transfer status " 
+            + to_string(status) + ")", status);
+    }
+    return;
+}
+
+void LIBUSB_CALL UsbComm::streamCallback(libusb_transfer* t_transfer)
+{
+    Stream* stream = static_cast<Stream*>(t_transfer->user_data);
+    bool resubmit = false;
+
+    switch (t_transfer->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+        case LIBUSB_TRANSFER_TIMED_OUT:     // Deliver partial data, continue
+        if (stream->stop)
+            break;
+        try {
+            resubmit = stream->cb(t_transfer->buffer, t_transfer->actual_length);
+        } catch (...) {
+            // Exceptions must not propagate through libusb
+            stream->ex = std::current_exception();
+            resubmit = false;
+        }
+        break;
+
+        case LIBUSB_TRANSFER_CANCELLED:
+        break;
+
+        default:
+        stream->status = t_transfer->status;
+        break;
+    }
+
+    if (resubmit) {
+        int stat = libusb_submit_transfer(t_transfer);
+        if (stat == 0)
+            return;
+        // Reported by stopStream()
+        stream->status = (stat == LIBUSB_ERROR_NO_DEVICE) ?
+            LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+    }
+
+    // Transfer retired; a single stopped transfer stops the stream
+    if (!stream->stop) {
+        stream->stop = true;
+        for (auto xfer : stream->xfers)
+            if (xfer != t_transfer)
+                libusb_cancel_transfer(xfer);
+    }
+    // Last transfer retired; the stream can be started again
+    if (--stream->active == 0)
+        releaseStream(*stream);
+    return;
+}
+
+void UsbComm::cancelStream(Stream& t_stream) noexcept
+{
+    if (t_stream.xfers.empty())
+        return;
+
+    t_stream.stop = true;
+    for (auto xfer : t_stream.xfers)
+        libusb_cancel_transfer(xfer);
+    
+    // Callbacks are only invoked while handling events. Cancelled transfers
+    // always complete; they must not be freed before their callbacks ran,
+    // so events are handled until then, also after errors (e.g. interrupted)
+    while (t_stream.active > 0) {
+        struct timeval tv {0, 100000};
+        libusb_handle_events_timeout_completed(
+            UsbRegistry::instance().context(), &tv, NULL);
+    }
+
+    releaseStream(t_stream);
+    return;
+}
+
+void UsbComm::releaseStream(Stream& t_stream) noexcept
+{
+    for (auto xfer : t_stream.xfers)
+        libusb_free_transfer(xfer);
+    t_stream.xfers.clear();
+    t_stream.bufs.clear();
+    t_stream.cb = nullptr;
+    return;
+}
+
+// Buffer and callback live until the transfer has completed
+struct UsbComm::PendingTransfer {
+    UsbComm* comm;
+    UsbBuffer buf;
+    TransferCallback cb;
+};
+
+void UsbComm::submitTransfer(uint8_t t_ep_addr, UsbBuffer&& t_buf,
+    TransferCallback t_callback, unsigned t_timeout_ms)
+{
+    this->checkAsync();
+    PendingTransfer* pending = new PendingTransfer {this, std::move(t_buf), t_callback};
+
+    libusb_transfer* xfer = libusb_alloc_transfer(0);
+    if (!xfer) {
+        delete pending;
+        check_and_throw(LIBUSB_ERROR_NO_MEM, "Failed to allocate transfer");
+    }
+    libusb_fill_bulk_transfer(xfer, m_usb_handle, t_ep_addr, pending->buf.data(),
+        pending->buf.size(), &UsbComm::transferCallback, pending, t_timeout_ms);
+
+    int stat = libusb_submit_transfer(xfer);
+    if (stat < 0) {
+        libusb_free_transfer(xfer);
+        delete pending;
+        check_and_throw(stat, "Failed to submit transfer");
+    }
+    m_async_xfers.insert(xfer);
+    return;
+}
+
+void LIBUSB_CALL UsbComm::transferCallback(libusb_transfer* t_transfer)
+{
+    PendingTransfer* pending = static_cast<PendingTransfer*>(t_transfer->user_data);
+    pending->comm->m_async_xfers.erase(t_transfer);
+
+    try {
+        if (pending->cb)
+            pending->cb(t_transfer->status, t_transfer->buffer, 
+                t_transfer->actual_length);
+    } catch (...) {
+        // Exceptions must not propagate through libusb; kept by the device
+        // as the callback may run on another device's event thread
+        if (!pending->comm->m_transfer_ex)
+            pending->comm->m_transfer_ex = std::current_exception();
+    }
+
+    libusb_free_transfer(t_transfer);
+    delete pending;
+    return;
+}
+
+void UsbComm::cancelTransfers() noexcept
+{
+    for (auto xfer : m_async_xfers)
+        libusb_cancel_transfer(xfer);
+    while ( !m_async_xfers.empty() ) {
+        struct timeval tv {0, 100000};
+        if (libusb_handle_events_timeout_completed(
+                UsbRegistry::instance().context(), &tv, NULL) < 0)
+            break;
+    }
+    return;
+}
+
+void UsbComm::configEndpoints(const libusb_interface_descriptor* t_desc)
+{
+    bool bulk_in {false}, bulk_out {false}, int_in {false};
+    m_ep_int_in_addr = 0x00;
+    m_max_pkt_size_int_in = 0;
+
+    for (int i = 0; i < t_desc->bNumEndpoints; i++) {
+        const libusb_endpoint_descriptor& ep = t_desc->endpoint[i];
+        uint8_t type = ep.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+        bool dir_in = (ep.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) 
+            == LIBUSB_ENDPOINT_IN;
+        size_t max_size = ep.wMaxPacketSize & 0x07FF;   // Bits 10..0
+
+        if ( (type == LIBUSB_TRANSFER_TYPE_BULK) && dir_in && !bulk_in ) {
+            m_ep_in_type = BULK;
+            m_ep_in_addr = ep.bEndpointAddress;
+            m_max_pkt_size_in = max_size;
+            bulk_in = true;
+        } else if ( (type == LIBUSB_TRANSFER_TYPE_BULK) && !dir_in && !bulk_out ) {
+            m_ep_out_type = BULK;
+            m_ep_out_addr = ep.bEndpointAddress;
+            m_max_pkt_size_out = max_size;
+            bulk_out = true;
+        } else if ( (type == LIBUSB_TRANSFER_TYPE_INTERRUPT) && dir_in && !int_in ) {
+            m_ep_int_in_addr = ep.bEndpointAddress;
+            m_max_pkt_size_int_in = max_size;
+            int_in = true;
+        }
+    }
+
+    // Interfaces without bulk endpoint (IN) are read via interrupt transfers
+    if (!bulk_in && int_in) {
+        m_ep_in_type = INTERRUPT;
+        m_ep_in_addr = m_ep_int_in_addr;
+        m_max_pkt_size_in = m_max_pkt_size_int_in;
+    }
+
+    DEBUG_PRINT("Endpoints: IN 0x%02X (%zu), OUT 0x%02X (%zu), INT 0x%02X (%zu)\n",
+        m_ep_in_addr, m_max_pkt_size_in, m_ep_out_addr, m_max_pkt_size_out,
+        m_ep_int_in_addr, m_max_pkt_size_int_in);
+    return;
+}
+
+void UsbComm::checkAsync() const
+{
+    if (!m_usb_handle)
+        throw BadIo(this->getInfo() + " - Asynchronous transfers require the "
+            "libusb backend");
+    return;
+}
+
 void UsbComm::check_and_throw(int t_stat, const string& t_msg) const 
 {
     if (t_stat < 0) {
@@ -379,6 +862,7 @@ void UsbComm::check_and_throw(int t_stat, const string& t_msg) const
             break;
 
         case LIBUSB_ERROR_OVERFLOW:
+        case LIBUSB_ERROR_PIPE:     // Endpoint stalled or request not supported
         case LIBUSB_ERROR_IO:
         case LIBUSB_ERROR_NO_MEM:
         case LIBUSB_ERROR_OTHER:
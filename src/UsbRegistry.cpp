@@ -0,0 +1,237 @@
+#include <labkit/comms/usbregistry.hh>
+#include <labkit/exceptions.hh>
+#include <labkit/debug.hh>
+
+#include <unordered_set>
+
+using namespace std;
+
+namespace labkit {
+
+UsbRegistry& UsbRegistry::instance()
+{
+    static UsbRegistry registry;
+    return registry;
+}
+
+UsbRegistry::UsbRegistry()
+{
+    int stat = libusb_init(&m_ctx);
+    if (stat < 0)
+        throw BadIo(string("libusb init failed (") + libusb_error_name(stat)
+            + ")", stat);
+    DEBUG_PRINT("new libusb session initialized (%i)\n", stat);
+
+    // Hotplug with LIBUSB_HOTPLUG_ENUMERATE reports all connected devices
+    // as arrived during registration
+    m_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+    if (m_hotplug) {
+        stat = libusb_hotplug_register_callback(m_ctx,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            &UsbRegistry::hotplugCallback, this, &m_hotplug_handle);
+        m_hotplug = (stat == LIBUSB_SUCCESS);
+        DEBUG_PRINT("Hotplug registration %s\n", m_hotplug ? "done" : "failed");
+    }
+
+    if (!m_hotplug)
+        this->refresh();
+    return;
+}
+
+UsbRegistry::~UsbRegistry()
+{
+    if (m_hotplug)
+        libusb_hotplug_deregister_callback(m_ctx, m_hotplug_handle);
+    this->clearDevices();
+    DEBUG_PRINT("%s\n", "Registry released, exiting libusb");
+    libusb_exit(m_ctx);
+    return;
+}
+
+libusb_device* UsbRegistry::find(uint16_t t_vid, uint16_t t_pid,
+    const string& t_serno)
+{
+    // Hotplug events are delivered by whichever thread handles libusb events
+    // (see UsbComm::handleEvents()); they are not processed here, as that
+    // would run transfer callbacks of other devices on the calling thread.
+    // A device which is not listed (yet) is searched by enumerating again.
+    libusb_device* dev = this->findListed(t_vid, t_pid, t_serno);
+    if (!dev) {
+        this->refresh();
+        dev = this->findListed(t_vid, t_pid, t_serno);
+    }
+    if (!dev)
+        DEBUG_PRINT("Device ID 0x%04X:0x%04X not found\n", t_vid, t_pid);
+    return dev;
+}
+
+void UsbRegistry::refresh()
+{
+    libusb_device** dev_list;
+    ssize_t ndev = libusb_get_device_list(m_ctx, &dev_list);
+    if (ndev < 0)
+        throw BadIo(string("Failed to get device list (") +
+            libusb_error_name(ndev) + ")", ndev);
+
+    // Devices still connected keep their entries and cached serial numbers
+    lock_guard<mutex> lock(m_mutex);
+    unordered_set<libusb_device*> present(dev_list, dev_list + ndev);
+    for (auto& bucket : m_devices) {
+        auto& entries = bucket.second;
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            if ( present.count(it->dev) ) {
+                it++;
+                continue;
+            }
+            DEBUG_PRINT("Removed device VID:PID=0x%04X:0x%04X\n",
+                it->desc.idVendor, it->desc.idProduct);
+            libusb_unref_device(it->dev);
+            it = entries.erase(it);
+        }
+    }
+    for (ssize_t idev = 0; idev < ndev; idev++)
+        this->addDevice(dev_list[idev]);
+    libusb_free_device_list(dev_list, 1);
+    return;
+}
+
+/*
+ *      P R I V A T E   M E T H O D S
+ */
+
+libusb_device* UsbRegistry::findListed(uint16_t t_vid, uint16_t t_pid,
+    const string& t_serno)
+{
+    // Entries are copied and their devices referenced, so serial numbers
+    // can be read without holding the lock; reading opens the device and
+    // would block the hotplug callback
+    vector<Entry> entries;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_devices.find( (uint32_t(t_vid) << 16) | t_pid );
+        if ( it == m_devices.end() )
+            return NULL;
+        entries = it->second;
+        for (Entry& entry : entries)
+            libusb_ref_device(entry.dev);
+    }
+
+    libusb_device* found = NULL;
+    for (Entry& entry : entries) {
+        // Serial numbers are read once and cached; failed reads (e.g.
+        // device busy) are tried again
+        if ( !found && !t_serno.empty() && !entry.serno_read ) {
+            entry.serno_read = readSerial(entry.dev, entry.desc, entry.serno);
+            if (entry.serno_read)
+                this->storeSerial(entry);
+        }
+        if ( !found && (t_serno.empty() || (entry.serno == t_serno)) )
+            found = entry.dev;
+        else
+            libusb_unref_device(entry.dev);
+    }
+    return found;
+}
+
+void UsbRegistry::storeSerial(const Entry& t_entry)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto it = m_devices.find( (uint32_t(t_entry.desc.idVendor) << 16)
+        | t_entry.desc.idProduct );
+    if ( it == m_devices.end() )
+        return;
+    for (Entry& listed : it->second) {
+        if (listed.dev != t_entry.dev)
+            continue;
+        listed.serno = t_entry.serno;
+        listed.serno_read = true;
+    }
+    return;
+}
+
+void UsbRegistry::addDevice(libusb_device* t_dev)
+{
+    Entry entry {t_dev, {}, "", false};
+    int stat = libusb_get_device_descriptor(t_dev, &entry.desc);
+    if (stat < 0)
+        return;
+
+    // Hotplug may report devices already listed by an enumeration
+    auto& entries = m_devices[(uint32_t(entry.desc.idVendor) << 16)
+        | entry.desc.idProduct];
+    for (const Entry& listed : entries)
+        if (listed.dev == t_dev)
+            return;
+
+    // Registry holds a reference as long as the device is listed
+    libusb_ref_device(t_dev);
+    entries.push_back(entry);
+    DEBUG_PRINT("Added device VID:PID=0x%04X:0x%04X\n",
+        entry.desc.idVendor, entry.desc.idProduct);
+    return;
+}
+
+void UsbRegistry::removeDevice(libusb_device* t_dev)
+{
+    for (auto& bucket : m_devices) {
+        auto& entries = bucket.second;
+        for (auto it = entries.begin(); it != entries.end(); it++) {
+            if (it->dev != t_dev)
+                continue;
+            DEBUG_PRINT("Removed device VID:PID=0x%04X:0x%04X\n",
+                it->desc.idVendor, it->desc.idProduct);
+            libusb_unref_device(it->dev);
+            entries.erase(it);
+            return;
+        }
+    }
+    return;
+}
+
+void UsbRegistry::clearDevices()
+{
+    for (auto& bucket : m_devices)
+        for (auto& entry : bucket.second)
+            libusb_unref_device(entry.dev);
+    m_devices.clear();
+    return;
+}
+
+int LIBUSB_CALL UsbRegistry::hotplugCallback(libusb_context* t_ctx,
+    libusb_device* t_dev, libusb_hotplug_event t_event, void* t_user_data)
+{
+    UsbRegistry* self = static_cast<UsbRegistry*>(t_user_data);
+    lock_guard<mutex> lock(self->m_mutex);
+    if (t_event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        self->addDevice(t_dev);
+    else if (t_event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+        self->removeDevice(t_dev);
+    return 0;   // Stay registered
+}
+
+bool UsbRegistry::readSerial(libusb_device* t_dev,
+    const libusb_device_descriptor& t_desc, string& t_serno)
+{
+    t_serno.clear();
+    if (t_desc.iSerialNumber == 0)
+        return true;
+
+    libusb_device_handle* handle;
+    if (libusb_open(t_dev, &handle) < 0)
+        return false;
+
+    unsigned char serial_cstr[126];
+    int stat = libusb_get_string_descriptor_ascii(handle, t_desc.iSerialNumber,
+        serial_cstr, sizeof(serial_cstr));
+    libusb_close(handle);
+    if (stat < 0)
+        return false;
+
+    t_serno.assign((char*)serial_cstr, stat);
+    DEBUG_PRINT("SerialNumber %s\n", t_serno.c_str());
+    return true;
+}
+
+}
@@ -2,6 +2,9 @@
 #include <labkit/exceptions.hh>
 #include <labkit/debug.hh>
 
+#include <chrono>
+#include <thread>
+
 using namespace std;
 
 namespace labkit 
@@ -17,139 +20,658 @@ int UsbTmcComm::readRaw(uint8_t* t_data, size_t t_max_len, unsigned t_timeout_ms
     return this->readDevDepMsg(t_data, t_max_len, t_timeout_ms);
 }
 
-int UsbTmcComm::writeDevDepMsg(const uint8_t* t_msg, size_t t_len,
-    uint8_t transfer_attr) 
-{
-    // add space for header + total length must be multiple of 4
-    size_t tot_len = HEADER_LEN + t_len;
-    if (tot_len%4 > 0)
-        tot_len += 4 - tot_len%4;
-    uint8_t* usbtmc_message = new uint8_t[tot_len];
-    this->createUsbTmcHeader(usbtmc_message, DEV_DEP_MSG_OUT,
-        transfer_attr, t_len);
-
-    // Append data
-    for (size_t i = HEADER_LEN; i < tot_len; i++) {
-        usbtmc_message[i] = t_msg[i-HEADER_LEN];
-        if (i > t_len+HEADER_LEN)
-            usbtmc_message[i] = 0x00;   // zero padding
+void UsbTmcComm::configTmcInterface()
+{
+    this->configInterfaceByClass(LIBUSB_CLASS_APPLICATION, LIBUSB_SUBCLASS_TMC);
+    this->readCapabilities();
+    return;
+}
+
+void UsbTmcComm::readCapabilities()
+{
+    uint8_t resp[24] = {0x00};
+    m_caps = Capabilities();
+    try {
+        uint8_t status = this->controlRequest(GET_CAPABILITIES, 0x0000, 
+            m_cur_iface, resp, sizeof(resp));
+        if (status != STATUS_SUCCESS)
+            return;
+    } catch (const BadIo& e) {
+        // Request not supported (stall); keep defaults
+        DEBUG_PRINT("GET_CAPABILITIES failed: %s\n", e.what());
+        return;
     }
-    DEBUG_PRINT("%s\n", "Sending device dependent message");
-    int nbytes = this->writeBulk((const uint8_t*)usbtmc_message, tot_len);
-    DEBUG_PRINT_BYTE_DATA(usbtmc_message, nbytes, "Written %zu bytes: ", nbytes);
 
-    // cleanup
-    delete[] usbtmc_message;
+    m_caps.valid = true;
+    m_caps.bcd_usbtmc = resp[2] | (resp[3] << 8);
+    m_caps.indicator_pulse = resp[4] & 0x04;
+    m_caps.talk_only = resp[4] & 0x02;
+    m_caps.listen_only = resp[4] & 0x01;
+    m_caps.term_char = resp[5] & 0x01;
+    m_caps.bcd_usb488 = resp[12] | (resp[13] << 8);
+    m_caps.usb4882 = resp[14] & 0x04;
+    m_caps.ren_control = resp[14] & 0x02;
+    m_caps.trigger = resp[14] & 0x01;
+    m_caps.scpi = resp[15] & 0x08;
+    m_caps.sr1 = resp[15] & 0x04;
+    m_caps.rl1 = resp[15] & 0x02;
+    m_caps.dt1 = resp[15] & 0x01;
+    DEBUG_PRINT("USBTMC %X.%02X, USB488 %X.%02X, caps 0x%02X 0x%02X 0x%02X 0x%02X\n",
+        m_caps.bcd_usbtmc >> 8, m_caps.bcd_usbtmc & 0xFF, m_caps.bcd_usb488 >> 8,
+        m_caps.bcd_usb488 & 0xFF, resp[4], resp[5], resp[14], resp[15]);
+    return;
+}
+
+uint8_t UsbTmcComm::readStatusByte(unsigned t_timeout_ms)
+{
+    if (m_caps.valid && (m_caps.bcd_usb488 == 0))
+        throw BadProtocol(this->getInfo() + " - READ_STATUS_BYTE requires USB488");
+
+    // bTag 1 is not used since 0x81 denotes a service request notification
+    m_stb_tag = ( (m_stb_tag < 2) || (m_stb_tag >= 127) ) ? 2 : m_stb_tag + 1;
+    m_stb_received = false;
+    uint8_t resp[3] = {0x00};
+    uint8_t status = this->controlRequest(READ_STATUS_BYTE, m_stb_tag, 
+        m_cur_iface, resp, sizeof(resp));
+    if (status != STATUS_SUCCESS)
+        throw BadProtocol(this->getInfo() + " - READ_STATUS_BYTE failed (status "
+            + to_string(status) + ")");
+
+    // Without interrupt endpoint the status byte is part of the response
+    if (m_ep_int_in_addr == 0x00)
+        return resp[2];
+
+    auto deadline = chrono::steady_clock::now() 
+        + chrono::milliseconds(t_timeout_ms);
+    while (!m_stb_received) {
+        long left = chrono::duration_cast<chrono::milliseconds>(
+            deadline - chrono::steady_clock::now()).count();
+        if (left <= 0)
+            throw Timeout(this->getInfo() + " - No status byte received");
+        if ( this->listening() ) {
+            UsbComm::handleEvents(left);
+        } else {
+            // Other notifications (e.g. SRQ) are dispatched while waiting
+            uint8_t pkt[8];
+            int nbytes = this->readInterrupt(pkt, sizeof(pkt), left);
+            this->handleNotification(pkt, nbytes);
+        }
+    }
+    return m_stb_reply;
+}
+
+void UsbTmcComm::setRemoteEnable(bool t_enable)
+{
+    if (m_caps.valid && !m_caps.ren_control)
+        throw BadProtocol(this->getInfo() + " - REN_CONTROL not supported");
+    uint8_t resp[1];
+    if (this->controlRequest(REN_CONTROL, t_enable ? 1 : 0, m_cur_iface, resp, 1)
+        != STATUS_SUCCESS)
+        throw BadProtocol(this->getInfo() + " - REN_CONTROL failed");
+    return;
+}
+
+void UsbTmcComm::goToLocal()
+{
+    if (m_caps.valid && !m_caps.ren_control)
+        throw BadProtocol(this->getInfo() + " - GO_TO_LOCAL not supported");
+    uint8_t resp[1];
+    if (this->controlRequest(GO_TO_LOCAL, 0x0000, m_cur_iface, resp, 1)
+        != STATUS_SUCCESS)
+        throw BadProtocol(this->getInfo() + " - GO_TO_LOCAL failed");
+    return;
+}
+
+void UsbTmcComm::trigger()
+{
+    if (m_caps.valid && !m_caps.trigger)
+        throw BadProtocol(this->getInfo() + " - TRIGGER not supported");
+
+    // Header only; the device does not respond
+    uint8_t* stage = this->staging();
+    this->nextTag();
+    this->createUsbTmcHeader(stage, TRIGGER, 0x00, 0);
+    this->sendBulk(stage, HEADER_LEN);
+    DEBUG_PRINT("%s\n", "Sent trigger");
+    return;
+}
+
+void UsbTmcComm::abortBulkOut()
+{
+    // Abort the transfer with the last used bTag
+    uint8_t resp[8] = {0x00};
+    uint8_t status = this->controlRequest(INITIATE_ABORT_BULK_OUT, m_cur_tag,
+        m_ep_out_addr, resp, 2, LIBUSB_RECIPIENT_ENDPOINT);
+    DEBUG_PRINT("Abort bulk OUT bTag 0x%02X: status 0x%02X\n", m_cur_tag, status);
+
+    if (status == STATUS_SUCCESS) {
+        auto deadline = chrono::steady_clock::now() 
+            + chrono::milliseconds(RECOVERY_TIMEOUT_MS);
+        do {
+            status = this->controlRequest(CHECK_ABORT_BULK_OUT_STATUS, 0x0000,
+                m_ep_out_addr, resp, 8, LIBUSB_RECIPIENT_ENDPOINT);
+            if (status != STATUS_PENDING)
+                break;
+            this_thread::sleep_for(chrono::milliseconds(1));
+        } while (chrono::steady_clock::now() < deadline);
+        if (status != STATUS_SUCCESS)
+            throw BadProtocol(this->getInfo() + " - Abort bulk OUT failed (status "
+                + to_string(status) + ")");
+    } else if ( (status != STATUS_FAILED) && 
+                (status != STATUS_TRANSFER_NOT_IN_PROGRESS) ) {
+        throw BadProtocol(this->getInfo() + " - Abort bulk OUT rejected (status "
+            + to_string(status) + ")");
+    }
+
+    // Bulk OUT endpoint is halted by the device after an abort
+    check_and_throw(m_backend->clearHalt(m_ep_out_addr), 
+        "Failed to clear halt of bulk endpoint (OUT)");
+    return;
+}
+
+void UsbTmcComm::abortBulkIn()
+{
+    uint8_t resp[8] = {0x00};
+    uint8_t status = this->controlRequest(INITIATE_ABORT_BULK_IN, m_cur_tag,
+        m_ep_in_addr, resp, 2, LIBUSB_RECIPIENT_ENDPOINT);
+    DEBUG_PRINT("Abort bulk IN bTag 0x%02X: status 0x%02X\n", m_cur_tag, status);
+
+    // FIFO empty, no transfer in progress
+    if ( (status == STATUS_FAILED) || (status == STATUS_TRANSFER_NOT_IN_PROGRESS) )
+        return;
+    if (status != STATUS_SUCCESS)
+        throw BadProtocol(this->getInfo() + " - Abort bulk IN rejected (status "
+            + to_string(status) + ")");
+
+    // Device sends a short packet to end the aborted transfer
+    this->drainBulkIn();
+    auto deadline = chrono::steady_clock::now() 
+        + chrono::milliseconds(RECOVERY_TIMEOUT_MS);
+    do {
+        status = this->controlRequest(CHECK_ABORT_BULK_IN_STATUS, 0x0000,
+            m_ep_in_addr, resp, 8, LIBUSB_RECIPIENT_ENDPOINT);
+        if (status != STATUS_PENDING)
+            break;
+        if (resp[1] & 0x01)     // bmAbortBulkIn: data left in FIFO
+            this->drainBulkIn();
+        else
+            this_thread::sleep_for(chrono::milliseconds(1));
+    } while (chrono::steady_clock::now() < deadline);
+    if (status != STATUS_SUCCESS)
+        throw BadProtocol(this->getInfo() + " - Abort bulk IN failed (status "
+            + to_string(status) + ")");
+    return;
+}
 
-    return nbytes;
+void UsbTmcComm::clear()
+{
+    uint8_t resp[2] = {0x00};
+    uint8_t status = this->controlRequest(INITIATE_CLEAR, 0x0000, m_cur_iface, 
+        resp, 1);
+    if (status != STATUS_SUCCESS)
+        throw BadProtocol(this->getInfo() + " - INITIATE_CLEAR failed (status "
+            + to_string(status) + ")");
+
+    auto deadline = chrono::steady_clock::now() 
+        + chrono::milliseconds(RECOVERY_TIMEOUT_MS);
+    do {
+        status = this->controlRequest(CHECK_CLEAR_STATUS, 0x0000, m_cur_iface,
+            resp, 2);
+        if (status != STATUS_PENDING)
+            break;
+        if (resp[1] & 0x01)     // bmClear: data left in FIFO
+            this->drainBulkIn();
+        else
+            this_thread::sleep_for(chrono::milliseconds(1));
+    } while (chrono::steady_clock::now() < deadline);
+    if (status != STATUS_SUCCESS)
+        throw BadProtocol(this->getInfo() + " - Clear failed (status "
+            + to_string(status) + ")");
+
+    check_and_throw(m_backend->clearHalt(m_ep_out_addr), 
+        "Failed to clear halt of bulk endpoint (OUT)");
+    DEBUG_PRINT("%s\n", "Device cleared");
+    return;
+}
+
+int UsbTmcComm::writeDevDepMsg(const uint8_t* t_msg, size_t t_len,
+    uint8_t t_transfer_attr) 
+{
+    DEBUG_PRINT("%s\n", "Sending device dependent message");
+    return this->writeMsgOut(DEV_DEP_MSG_OUT, t_msg, t_len, t_transfer_attr);
 }
 
 int UsbTmcComm::readDevDepMsg(uint8_t* t_data, size_t t_max_len,
     int t_timeout_ms, uint8_t t_transfer_attr, uint8_t t_term_char) 
 {
-    uint8_t read_request[HEADER_LEN];
-    uint8_t rbuf[DFLT_BUF_SIZE] = { 0x00 };
-
-    // Send read request
+    // Request exactly the capacity of the caller's buffer
     DEBUG_PRINT("%s\n", "Sending read request");
-    this->createUsbTmcHeader(read_request, REQUEST_DEV_DEP_MSG_IN,
-        t_transfer_attr, sizeof(rbuf), t_term_char);
-    this->writeBulk((const uint8_t*)read_request, HEADER_LEN);
+    uint8_t* stage = this->staging();
+    this->nextTag();
+    this->createUsbTmcHeader(stage, REQUEST_DEV_DEP_MSG_IN, t_transfer_attr, 
+        t_max_len, t_term_char);
+    this->sendBulk(stage, HEADER_LEN);
 
-    // Read from bulk endpoint
+    // First packet holds the header; it is received into the staging buffer
     DEBUG_PRINT("%s\n", "Reading device dependent message");
-    int len = this->readBulk(rbuf, sizeof(rbuf), t_timeout_ms);
+    size_t pkt = m_max_pkt_size_in;
+    size_t len = this->receiveBulk(stage, pkt, t_timeout_ms);
 
     // If an empty message was received, return immediatly
     if (len == 0)
-        return len;
-
-    // Check header
-    int transfer_size = checkUsbUmcHeader(rbuf, DEV_DEP_MSG_IN);
-
-    // Copy data into output array
-    std::copy(rbuf + HEADER_LEN, rbuf + len, t_data);
-    int bytes_received = len - HEADER_LEN;
-    while (bytes_received < transfer_size) {
-        int nbytes = this->readBulk(rbuf, sizeof(rbuf), t_timeout_ms);
-        if (bytes_received > static_cast<int>(t_max_len))
-            throw BadIo(this->getInfo() + " - Buffer size too small");
-        std::copy(rbuf, rbuf + nbytes, t_data + bytes_received);
-        bytes_received += nbytes;
+        return 0;
+    if (len < HEADER_LEN)
+        throw BadProtocol(this->getInfo() + " - Incomplete USBTMC header");
+
+    // Check header before any data is copied
+    size_t transfer_size = checkUsbUmcHeader(stage, DEV_DEP_MSG_IN);
+    if (transfer_size > t_max_len)
+        throw BadIo(this->getInfo() + " - Buffer size too small");
+    size_t received = min(len - HEADER_LEN, transfer_size);
+    std::copy(stage + HEADER_LEN, stage + HEADER_LEN + received, t_data);
+
+    // Reads of whole packets do not see the end of the transfer
+    bool full = (len == pkt);
+    while (received < transfer_size) {
+        // Whole packets are received directly into the caller's buffer,
+        // the remainder (and alignment bytes) via the staging buffer
+        size_t left = transfer_size - received;
+        size_t direct = min(left, t_max_len - received) / pkt * pkt;
+        int nbytes;
+        if (direct > 0) {
+            nbytes = this->receiveBulk(t_data + received, direct, t_timeout_ms);
+            full = ((size_t)nbytes == direct);
+        } else {
+            // Not more than the rest of the transfer; the device does not
+            // end a transfer filling the request with a short packet
+            size_t tail = this->transferLen(transfer_size) - HEADER_LEN - received;
+            nbytes = this->receiveBulk(stage, tail, t_timeout_ms);
+            full = ((size_t)nbytes == tail);
+            nbytes = min((size_t)nbytes, left);
+            std::copy(stage, stage + nbytes, t_data + received);
+        }
+        if (nbytes == 0)
+            throw BadProtocol(this->getInfo() + " - Message incomplete");
+        received += nbytes;
     }
-    DEBUG_PRINT_BYTE_DATA(t_data, bytes_received, "Read %zu bytes: ", bytes_received);
+    this->receiveZeroLengthPacket(transfer_size, t_max_len, full, t_timeout_ms);
+    DEBUG_PRINT_BYTE_DATA(t_data, received, "Read %zu bytes: ", received);
 
-    // Increase bTag for next communication
-    m_cur_tag++;
-    
-    return bytes_received;
+    return received;
 }
 
-int UsbTmcComm::writeVendorSpecific(string t_msg) 
+UsbBuffer UsbTmcComm::readDevDepMsg(size_t t_max_len, int t_timeout_ms,
+    uint8_t t_transfer_attr, uint8_t t_term_char)
 {
-    // add space for header + total length must be multiple of 4
-    size_t tot_len = HEADER_LEN + t_msg.size() + 4 - t_msg.size()%4;
-    uint8_t* usbtmc_message = new uint8_t[tot_len];
-    this->createUsbTmcHeader(usbtmc_message, VENDOR_SPECIFIC_OUT, 0x00,
-        t_msg.size());
+    DEBUG_PRINT("%s\n", "Reading device dependent message");
+    return this->readMsgIn(REQUEST_DEV_DEP_MSG_IN, DEV_DEP_MSG_IN, t_max_len,
+        t_timeout_ms, t_transfer_attr, t_term_char);
+}
 
-    // Append data
-    for (size_t i = HEADER_LEN; i < tot_len; i++) 
-    {
-        usbtmc_message[i] = t_msg.c_str()[i-HEADER_LEN];
-        if (i > t_msg.size()+HEADER_LEN)
-            usbtmc_message[i] = 0x00;   // zero padding
+size_t UsbTmcComm::readDevDepMsg(const ChunkCallback& t_callback, 
+    int t_timeout_ms, size_t t_chunk_size, uint8_t t_transfer_attr, 
+    uint8_t t_term_char)
+{
+    // A single buffer holds header, chunk, and alignment bytes; it is 
+    // reused for every bulk transfer
+    size_t chunk = max(t_chunk_size, (size_t)m_max_pkt_size_in);
+    size_t len = this->transferLen(chunk);
+    UsbBuffer buf = this->acquireBuffer(len);
+
+    size_t total = 0;
+    bool eom = false;
+    while (!eom) {
+        this->nextTag();
+        this->createUsbTmcHeader(buf.raw(), REQUEST_DEV_DEP_MSG_IN, 
+            t_transfer_attr, chunk, t_term_char);
+        this->sendBulk(buf.raw(), HEADER_LEN);
+
+        // An empty first transfer is an empty message (see readMsgIn());
+        // later on, the message ended without EOM
+        size_t received = this->receiveBulk(buf.raw(), len, t_timeout_ms);
+        if (received == 0) {
+            if (total == 0)
+                break;
+            throw BadProtocol(this->getInfo() + " - Message incomplete");
+        }
+        if (received < HEADER_LEN)
+            throw BadProtocol(this->getInfo() + " - Incomplete USBTMC header");
+
+        size_t transfer_size = checkUsbUmcHeader(buf.raw(), DEV_DEP_MSG_IN);
+        if (transfer_size > chunk)
+            throw BadProtocol(this->getInfo() + " - Message exceeds requested size");
+        eom = buf.raw()[8] & EOM;
+        if ( (transfer_size == 0) && !eom )
+            throw BadProtocol(this->getInfo() + " - Empty transfer without EOM");
+
+        // Pass each bulk transfer on as soon as it completed; the rest of
+        // the transfer is read up to its end only
+        size_t end = this->transferLen(transfer_size);
+        bool full = (received == len);
+        size_t nbytes = min(received - HEADER_LEN, transfer_size);
+        size_t left = transfer_size - nbytes;
+        const uint8_t* data = buf.raw() + HEADER_LEN;
+        while (true) {
+            if (left == 0)
+                this->receiveZeroLengthPacket(transfer_size, chunk, full, t_timeout_ms);
+            try {
+                t_callback(data, nbytes, eom && (left == 0));
+            } catch (...) {
+                // Discard the rest of the transfer before passing on the error
+                if (left > 0)
+                    this->recover(true);
+                throw;
+            }
+            total += nbytes;
+            if (left == 0)
+                break;
+
+            nbytes = this->receiveBulk(buf.raw(), end - received, t_timeout_ms);
+            if (nbytes == 0)
+                throw BadProtocol(this->getInfo() + " - Message incomplete");
+            full = (nbytes == end - received);
+            received += nbytes;
+            nbytes = min(nbytes, left);
+            left -= nbytes;
+            data = buf.raw();
+        }
+        DEBUG_PRINT("Streamed transfer of %zu bytes (EOM %i)\n", transfer_size, eom);
     }
 
-    int nbytes = this->writeBulk((const uint8_t*)usbtmc_message, tot_len);
-    // cleanup
-    delete[] usbtmc_message;
+    return total;
+}
 
-    return nbytes;
+int UsbTmcComm::writeVendorSpecific(string t_msg) 
+{
+    return this->writeMsgOut(VENDOR_SPECIFIC_OUT, (const uint8_t*)t_msg.data(),
+        t_msg.size(), 0x00);
 }
 
 string UsbTmcComm::readVendorSpecific(int t_timeout_ms) 
 {
-    uint8_t read_request[HEADER_LEN], rbuf[DFLT_BUF_SIZE];
-    // Send read request
-    DEBUG_PRINT("%s\n", "Sending vendor specific read request\n");
-    this->createUsbTmcHeader(read_request, REQUEST_VENDOR_SPECIFIC_IN,
-        0x00, sizeof(rbuf), 0x00);
-    this->writeBulk((const uint8_t*)read_request, HEADER_LEN);
-
-    // Read from bulk endpoint
-    DEBUG_PRINT("%s\n", "Reading...\n");
-    int len = this->readBulk(rbuf, sizeof(rbuf), t_timeout_ms);
-
-    // If an empty message was received, return immediatly
-    if (len == 0)
-        return "";
-
-    // Check header
-    int transfer_size = checkUsbUmcHeader(rbuf, DEV_DEP_MSG_IN);
-    // Remove header from return value
-    len -= HEADER_LEN;
-    string ret((const char*)rbuf + HEADER_LEN, len);
-
-    // If more data than received was anounced in the header, keep reading
-    int bytes_left = transfer_size - len;
-    while (bytes_left > 0) {
-        int nbytes = this->readBulk(rbuf, sizeof(rbuf), t_timeout_ms);
-        ret.append((char*)rbuf, min(bytes_left, nbytes));
-        bytes_left -= nbytes;
-    }
-    // Increase bTag for next communication
-    m_cur_tag++;
+    DEBUG_PRINT("%s\n", "Reading vendor specific message");
+    UsbBuffer buf = this->readMsgIn(REQUEST_VENDOR_SPECIFIC_IN, VENDOR_SPECIFIC_IN,
+        DFLT_BUF_SIZE, t_timeout_ms, 0x00, 0x00);
+    string ret((const char*)buf.data(), buf.size());
     DEBUG_PRINT("Received vendor specific message (%lu) '%s'\n",
         ret.size(), ret.c_str());
 
     return ret;
 }
 
+void UsbTmcComm::close()
+{
+    // Return staging buffer before the device handle is released
+    m_staging = UsbBuffer();
+    UsbComm::close();
+    return;
+}
+
+int UsbTmcComm::subscribeServiceRequest(SrqCallback t_callback)
+{
+    if ( !this->listening() )
+        this->startInterruptListener([this](const uint8_t* t_data, size_t t_len) 
+            { return this->handleNotification(t_data, t_len); });
+    int id = m_srq_next_id++;
+    m_srq_subscribers[id] = t_callback;
+    return id;
+}
+
+void UsbTmcComm::unsubscribeServiceRequest(int t_id)
+{
+    m_srq_subscribers.erase(t_id);
+    return;
+}
+
+uint8_t UsbTmcComm::waitForServiceRequest(unsigned t_timeout_ms)
+{
+    if ( !this->listening() )
+        this->startInterruptListener([this](const uint8_t* t_data, size_t t_len) 
+            { return this->handleNotification(t_data, t_len); });
+
+    auto deadline = chrono::steady_clock::now() 
+        + chrono::milliseconds(t_timeout_ms);
+    unsigned count = m_srq_count;
+    while (m_srq_count == count) {
+        // Listener stopped due to an error; report it
+        if ( !this->listening() )
+            this->stopInterruptListener();
+
+        long left = chrono::duration_cast<chrono::milliseconds>(
+            deadline - chrono::steady_clock::now()).count();
+        if (left <= 0)
+            throw Timeout(this->getInfo() + " - No service request received");
+        UsbComm::handleEvents(left);
+    }
+    return m_srq_stb;
+}
+
 /*
  *      P R I V A T E   M E T H O D S
  */
 
+bool UsbTmcComm::handleNotification(const uint8_t* t_data, size_t t_len)
+{
+    if (t_len < 2)
+        return true;
+
+    DEBUG_PRINT("Interrupt notification bNotify1 0x%02X, bNotify2 0x%02X\n",
+        t_data[0], t_data[1]);
+    if ( (t_data[0] == (0x80 | m_stb_tag)) && (m_stb_tag > 1) ) {
+        // Response to READ_STATUS_BYTE
+        m_stb_reply = t_data[1];
+        m_stb_received = true;
+    } else if (t_data[0] == NOTIFY_SRQ) {
+        m_srq_stb = t_data[1];
+        m_srq_count++;
+        // Subscribers may unsubscribe from within their callback
+        auto subscribers = m_srq_subscribers;
+        for (auto& sub : subscribers)
+            sub.second(m_srq_stb);
+    }
+    return true;
+}
+
+UsbBuffer UsbTmcComm::readMsgIn(uint8_t t_request_id, uint8_t t_message_id,
+    size_t t_max_len, int t_timeout_ms, uint8_t t_transfer_attr, 
+    uint8_t t_term_char)
+{
+    // Header, message, and alignment bytes are received as whole packets;
+    // never more than the device sends for a message of t_max_len bytes
+    size_t len = this->transferLen(t_max_len);
+    UsbBuffer buf = this->acquireBuffer(len);
+
+    // Send read request
+    uint8_t read_request[HEADER_LEN];
+    this->nextTag();
+    this->createUsbTmcHeader(read_request, t_request_id, t_transfer_attr, 
+        t_max_len, t_term_char);
+    this->sendBulk((const uint8_t*)read_request, HEADER_LEN);
+
+    // If an empty message was received, return immediatly
+    size_t received = this->receiveBulk(buf.raw(), len, t_timeout_ms);
+    if (received == 0) {
+        buf.resize(0);
+        return buf;
+    }
+    if (received < HEADER_LEN)
+        throw BadProtocol(this->getInfo() + " - Incomplete USBTMC header");
+
+    size_t transfer_size = checkUsbUmcHeader(buf.raw(), t_message_id);
+    if (transfer_size > t_max_len)
+        throw BadProtocol(this->getInfo() + " - Message exceeds requested size");
+
+    // Keep reading into the same buffer until the announced size arrived
+    size_t end = this->transferLen(transfer_size);
+    bool full = (received == len);
+    while (received < HEADER_LEN + transfer_size) {
+        size_t nbytes = this->receiveBulk(buf.raw() + received, end - received,
+            t_timeout_ms);
+        if (nbytes == 0)
+            throw BadProtocol(this->getInfo() + " - Message incomplete");
+        full = (nbytes == end - received);
+        received += nbytes;
+    }
+    this->receiveZeroLengthPacket(transfer_size, t_max_len, full, t_timeout_ms);
+    buf.trim(HEADER_LEN, transfer_size);
+    DEBUG_PRINT("Read %zu bytes into %s buffer\n", buf.size(), 
+        buf.dma() ? "device" : "heap");
+
+    return buf;
+}
+
+int UsbTmcComm::writeMsgOut(uint8_t t_message_id, const uint8_t* t_msg,
+    size_t t_len, uint8_t t_transfer_attr)
+{
+    uint8_t* stage = this->staging();
+    size_t pkt = m_max_pkt_size_out;
+    size_t pad = (4 - (HEADER_LEN + t_len) % 4) % 4;
+    this->nextTag();
+    this->createUsbTmcHeader(stage, t_message_id, t_transfer_attr, t_len);
+
+    // Short messages are sent from the staging buffer in a single transfer
+    size_t first = min(t_len, pkt - HEADER_LEN);
+    std::copy(t_msg, t_msg + first, stage + HEADER_LEN);
+    if (first == t_len) {
+        std::fill(stage + HEADER_LEN + t_len, stage + HEADER_LEN + t_len + pad, 0x00);
+        this->sendBulk(stage, HEADER_LEN + t_len + pad);
+        DEBUG_PRINT_BYTE_DATA(stage, HEADER_LEN + t_len + pad, 
+            "Written %zu bytes: ", HEADER_LEN + t_len + pad);
+        return t_len;
+    }
+
+    // Header and first payload bytes fill exactly one packet
+    this->sendBulk(stage, pkt);
+
+    // Whole packets are sent directly from the caller's memory; the tail
+    // is sent from the staging buffer to append the alignment bytes
+    size_t rest = t_len - first;
+    size_t tail = rest % pkt;
+    if ( (tail == 0) && (pad > 0) )
+        tail = pkt;
+    size_t direct = rest - tail;
+    if (direct > 0)
+        this->sendBulk(t_msg + first, direct);
+    if (tail > 0) {
+        std::copy(t_msg + first + direct, t_msg + t_len, stage);
+        std::fill(stage + tail, stage + tail + pad, 0x00);
+        this->sendBulk(stage, tail + pad);
+    }
+    DEBUG_PRINT("Written %zu bytes (%zu packets direct)\n", t_len, direct / pkt);
+    return t_len;
+}
+
+uint8_t* UsbTmcComm::staging()
+{
+    // Header or packets with alignment bytes fit into the buffer
+    size_t len = STAGING_PACKETS * max(m_max_pkt_size_in, m_max_pkt_size_out);
+    if (m_staging.capacity() < len)
+        m_staging = this->acquireBuffer(len);
+    return m_staging.raw();
+}
+
+uint8_t UsbTmcComm::nextTag()
+{
+    // bTag 0 is invalid; 255 is followed by 1
+    m_cur_tag = (m_cur_tag % 255) + 1;
+    return m_cur_tag;
+}
+
+void UsbTmcComm::sendBulk(const uint8_t* t_data, size_t t_len)
+{
+    try {
+        this->writeBulk(t_data, t_len);
+    } catch (const BadConnection&) {
+        throw;
+    } catch (const Exception&) {
+        this->recover(false);
+        throw;
+    }
+    return;
+}
+
+int UsbTmcComm::receiveBulk(uint8_t* t_data, size_t t_max_len, int t_timeout_ms)
+{
+    try {
+        return this->readBulk(t_data, t_max_len, t_timeout_ms);
+    } catch (const BadConnection&) {
+        throw;
+    } catch (const Exception& e) {
+        // A stalled endpoint has to be cleared after the abort
+        if (e.errorNumber() == LIBUSB_ERROR_PIPE)
+            m_backend->clearHalt(m_ep_in_addr);
+        this->recover(true);
+        throw;
+    }
+}
+
+size_t UsbTmcComm::transferLen(size_t t_len) const
+{
+    size_t pkt = m_max_pkt_size_in;
+    size_t len = HEADER_LEN + (t_len + 3) / 4 * 4;
+    return (len + pkt - 1) / pkt * pkt;
+}
+
+void UsbTmcComm::receiveZeroLengthPacket(size_t t_transfer_size,
+    size_t t_requested, bool t_full, int t_timeout_ms)
+{
+    // A transfer shorter than requested and ending on a packet boundary is
+    // terminated by a zero length packet; otherwise it would end the next
+    // read
+    size_t len = HEADER_LEN + (t_transfer_size + 3) / 4 * 4;
+    if ( !t_full || (t_transfer_size >= t_requested) ||
+         (len != this->transferLen(t_transfer_size)) )
+        return;
+    if (this->receiveBulk(this->staging(), m_max_pkt_size_in, t_timeout_ms) != 0)
+        throw BadProtocol(this->getInfo() + " - Transfer exceeds announced size");
+    return;
+}
+
+void UsbTmcComm::drainBulkIn()
+{
+    uint8_t* stage = this->staging();
+    size_t len = STAGING_PACKETS * m_max_pkt_size_in;
+    try {
+        // Read until a short packet ends the transfer
+        while (this->readBulk(stage, len, DRAIN_TIMEOUT_MS) == (int)len) {}
+    } catch (const Timeout&) {
+        // Nothing left
+    }
+    return;
+}
+
+void UsbTmcComm::recover(bool t_in) noexcept
+{
+    try {
+        if (t_in)
+            this->abortBulkIn();
+        else
+            this->abortBulkOut();
+        return;
+    } catch (const Exception& e) {
+        DEBUG_PRINT("Abort failed, clearing device: %s\n", e.what());
+    }
+    try {
+        this->clear();
+    } catch (const Exception& e) {
+        DEBUG_PRINT("Recovery failed: %s\n", e.what());
+    }
+    return;
+}
+
+uint8_t UsbTmcComm::controlRequest(uint8_t t_request, uint16_t t_value,
+    uint16_t t_index, uint8_t* t_resp, uint16_t t_len, uint8_t t_recipient)
+{
+    int nbytes = this->controlTransfer(
+        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | t_recipient,
+        t_request, t_value, t_index, t_resp, t_len);
+    if (nbytes < 1)
+        throw BadProtocol(this->getInfo() + " - Empty response to request "
+            + to_string(t_request));
+    DEBUG_PRINT("Request %u: USBTMC_status 0x%02X\n", t_request, t_resp[0]);
+    return t_resp[0];
+}
+
 void UsbTmcComm::createUsbTmcHeader(uint8_t* t_header, uint8_t t_message_id, 
     uint8_t t_transfer_attr, uint32_t t_transfer_size, uint8_t t_term_char) 
 {
@@ -171,6 +693,9 @@ void UsbTmcComm::createUsbTmcHeader(uint8_t* t_header, uint8_t t_message_id,
         break;
 
         case REQUEST_DEV_DEP_MSG_IN:
+        // TermChar must not be requested if the device does not support it
+        if (m_caps.valid && !m_caps.term_char)
+            t_transfer_attr &= ~TERM_CHAR;
         t_header[8] = 0x02 & t_transfer_attr;
         t_header[9] = t_term_char;
         t_header[10] = 0x00;
@@ -181,6 +706,7 @@ void UsbTmcComm::createUsbTmcHeader(uint8_t* t_header, uint8_t t_message_id,
 
         case VENDOR_SPECIFIC_OUT:
         case REQUEST_VENDOR_SPECIFIC_IN:
+        case TRIGGER:
         t_header[8] = 0x00;
         t_header[9] = 0x00;
         t_header[10] = 0x00;
@@ -197,6 +723,7 @@ int UsbTmcComm::checkUsbUmcHeader(uint8_t* t_message, uint8_t t_message_id)
     if ( t_message_id != t_message[0] ) {
         DEBUG_PRINT("Wrong MsgID returned : expected 0x%02X, received 0x%02X\n",
             t_message_id, t_message[0]);
+        this->recover(true);
         throw BadProtocol(this->getInfo() + " - Wrong MsgID received");
     }
 
@@ -206,6 +733,8 @@ int UsbTmcComm::checkUsbUmcHeader(uint8_t* t_message, uint8_t t_message_id)
         DEBUG_PRINT("Wrong bTag/~bTag returned : expected 0x%02X/0x%02X, "
             "received 0x%02X/0x%02X\n", m_cur_tag, inv_cur_tag, t_message[1], 
             t_message[2]);
+        // Stale data of an earlier transfer; flush the bulk IN FIFO
+        this->recover(true);
         throw BadProtocol(this->getInfo() + " - Wrong bTag/~bTag received");
     }
 
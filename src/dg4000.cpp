@@ -32,9 +32,7 @@ void Dg4000::connect(std::unique_ptr<TcpipComm> t_tcpip)
 
 void Dg4000::connect(std::unique_ptr<UsbTmcComm> t_usbtmc)
 {
-    t_usbtmc->configInterface(0);
-    t_usbtmc->configEndpointIn(0x86);
-    t_usbtmc->configEndpointOut(0x02);
+    t_usbtmc->configTmcInterface();
     this->BasicDevice::connect(std::move(t_usbtmc));
     this->init();
     return;
@@ -32,9 +32,7 @@ void Ds1000Z::connect(unique_ptr<TcpipComm> t_tcpip)
 
 void Ds1000Z::connect(unique_ptr<UsbTmcComm> t_usbtmc)
 {
-    t_usbtmc->configInterface(0);
-    t_usbtmc->configEndpointIn(0x82);
-    t_usbtmc->configEndpointOut(0x03);
+    t_usbtmc->configTmcInterface();
     this->BasicDevice::connect(std::move(t_usbtmc));
     this->init();
     return;